@@ -17,8 +17,19 @@ process the queue and visualize them*/
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include "vehicle_ring.h"
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
-#define MAX_LINE_LENGTH 20
 #define MAIN_FONT "DejaVuSans.ttf"
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 800
@@ -27,214 +38,2649 @@ process the queue and visualize them*/
 #define LANE_WIDTH 50
 #define ARROW_SIZE 15
 #define MAX_QUEUE_SIZE 100
-#define MAX_VEHICLE_ID 20
+#define NUM_ROADS 4
+#define LANES_PER_ROAD 3
+#define NUM_LANES (NUM_ROADS * LANES_PER_ROAD)
+#define MAX_VEHICLE_ID 16  // longest plate text (EMG + 10 + L3) plus NUL
+#define TEXT_CACHE_LENGTH 32
 #define VEHICLE_LENGTH 20  // Length of vehicle rectangle
 #define VEHICLE_GAP 15    // Minimum gap between vehicles
 #define VEHICLE_WIDTH 10  // Width of vehicle rectangle
 #define TURN_DURATION 1500.0f
 #define BEZIER_CONTROL_OFFSET 80.0f
+#define LOD_DEFAULT_THRESHOLD 20  // queued vehicles per approach before they become a band
 #define TURN_SPEED 0.0008f
 
 
 const char* VEHICLE_FILE = "vehicles.data";
 
+// Signal controllers selectable with --controller.
+typedef enum {
+    CONTROLLER_HEURISTIC,   // chequeQueue(): road A priority, then lane 2 counts
+    CONTROLLER_PLAN,        // runSignalPlan(): fixed stages of compatible movements
+    CONTROLLER_PRESSURE,    // runMaxPressure(): plan stage with the largest queue pressure
+    CONTROLLER_PREDICTIVE,  // chequeQueue() with greens split from arrival-rate estimates
+    CONTROLLER_COUNT
+} ControllerPolicy;
+
+const char* controllerNames[CONTROLLER_COUNT] = { "heuristic", "plan", "pressure", "predictive" };
+
+// Runtime options, filled from the command line by parseArguments().
+typedef struct {
+    const char* throughputCsvPath;  // --throughput-csv <file>
+    const char* tracePath;          // --trace <file>
+    bool lockProfile;               // --lock-profile: time lock waits and holds
+    bool showHud;                   // --hud: start with the performance overlay on
+    const char* shmName;            // --shm <name>: read vehicles from the generator's ring
+    const char* listenPath;         // --listen <path>: accept producers on a Unix socket
+    char** mergePaths;              // --merge <feed>...: replay timestamped feeds in order
+    int mergeCount;
+    double replaySpeed;             // --replay-speed <x>: feed time per real second, 0 = no pacing
+    long long parseBench;           // --parse-bench <n>: benchmark the record parser and exit
+    Uint32 dedupWindowMs;           // --dedup-window <ms>: drop repeated plates, 0 = off
+    bool simThread;                 // --sim-thread: simulate on its own thread
+    int tickHz;                     // --tick-hz <n>: simulation rate with --sim-thread
+    bool reservations;              // --reservations: lane 2 crosses on tile reservations, not phases
+    ControllerPolicy controller;    // --controller <name>: which signal controller runs
+    const char* planPath;           // --plan <file>: signal plan for --controller plan
+    const char* comparePath;        // --compare <file>: append this run's controller summary
+    bool deterministic;             // --deterministic: fixed-tick lockstep on the main thread
+    bool headless;                  // --headless: deterministic, no window, as fast as possible
+    int hashEvery;                  // --state-hash <n>: print a rolling state hash every n ticks
+    long long maxTicks;             // --ticks <n>: stop a deterministic run after n ticks
+    const char* checkpointDir;      // --checkpoint-dir <dir>: write/read deterministic checkpoints
+    Uint32 checkpointEveryMs;       // --checkpoint-every <s>: simulated time between checkpoints
+    long long seekMs;               // --seek <s>: restore and fast-forward to this time, -1 = off
+    const char* trajectoryPath;     // --trajectory <file>: stream per-tick vehicle positions
+    const char* trajectoryDumpPath; // --trajectory-dump <file>: decode one to CSV and exit
+    const char* capturePath;        // --capture <dir>: write every rendered frame as PPM
+    int captureFps;                 // --capture-fps <n>: headless frames per simulated second
+    int lodThreshold;               // --lod <n>: queued vehicles per approach before a band, 0 = off
+} SimConfig;
+
+// Defaults; every option not named here starts off (0, false or NULL).
+SimConfig simConfig = {
+    .replaySpeed = 1.0,
+    .tickHz = 240,
+    .controller = CONTROLLER_HEURISTIC,
+    .checkpointEveryMs = 60000,
+    .seekMs = -1,
+    .captureFps = 30,
+    .lodThreshold = LOD_DEFAULT_THRESHOLD,
+};
+
+// Why the controller picked a phase.
+typedef enum {
+    SWITCH_START,           // all red at startup
+    SWITCH_PRIORITY_A,      // more than 5 vehicles on road A
+    SWITCH_PRIORITY_QUEUE,  // more than 10 vehicles in lane 2 of B, C or D
+    SWITCH_NORMAL_CYCLE,    // round robin over the lanes with vehicles
+    SWITCH_EMERGENCY,       // preempted for an emergency vehicle
+    SWITCH_PLAN_STAGE,      // next stage of the signal plan
+    SWITCH_CLEARANCE,       // amber / all-red between plan stages
+    SWITCH_MAX_PRESSURE,    // stage with the largest queue pressure
+    SWITCH_PREDICTED_CYCLE, // round robin with greens from predicted queues
+    SWITCH_EMERGENCY_CLEARANCE, // amber / all-red before an emergency green
+    SWITCH_REASON_COUNT
+} SwitchReason;
+
+const char* switchReasonNames[SWITCH_REASON_COUNT] = {
+    "start", "priority A", "priority queue", "normal cycle", "emergency", "plan stage", "clearance",
+    "max pressure", "predicted cycle", "emergency clearance"
+};
+
+typedef enum { LIGHT_RED, LIGHT_AMBER, LIGHT_GREEN } LightColour;
+
+// One consistent view of the signal. Lane 2 of road r may go when bit r of
+// greenMask is set; amberMask only changes what is drawn.
+typedef struct {
+    int phase;              // 0 = all red, 1-4 = road A-D green, or plan stage number
+    int greenMask;
+    int amberMask;
+    Uint32 phaseStartMs;    // when the phase was requested / went green
+    Uint32 durationMs;      // planned length, 0 = until the controller says otherwise
+    SwitchReason reason;
+    uint32_t version;       // bumped on every request, so repeats are seen too
+} SignalState;
+
+// Seqlock around a SignalState. One writer per lock; readers never block it
+// and retry if a write overlapped their read. The fields are relaxed atomics
+// so a torn read is harmless (and detected) rather than a data race.
+typedef struct {
+    atomic_uint sequence;   // odd while a write is in progress
+    atomic_int phase;
+    atomic_int greenMask;
+    atomic_int amberMask;
+    atomic_uint phaseStartMs;
+    atomic_uint durationMs;
+    atomic_int reason;
+    atomic_uint version;
+} SignalSeqlock;
+
 typedef struct{
-    int currentLight;
-    int nextLight;
+    SignalSeqlock requested;    // written by the controller (chequeQueue)
+    SignalSeqlock current;      // written by advanceLight() on the simulation side
 } SharedData;
 
-// adding queue structures
-// Vehicle structure
+void writeSignal(SignalSeqlock* lock, const SignalState* state) {
+    unsigned sequence = atomic_load_explicit(&lock->sequence, memory_order_relaxed);
+    atomic_store_explicit(&lock->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&lock->phase, state->phase, memory_order_relaxed);
+    atomic_store_explicit(&lock->greenMask, state->greenMask, memory_order_relaxed);
+    atomic_store_explicit(&lock->amberMask, state->amberMask, memory_order_relaxed);
+    atomic_store_explicit(&lock->phaseStartMs, state->phaseStartMs, memory_order_relaxed);
+    atomic_store_explicit(&lock->durationMs, state->durationMs, memory_order_relaxed);
+    atomic_store_explicit(&lock->reason, state->reason, memory_order_relaxed);
+    atomic_store_explicit(&lock->version, state->version, memory_order_relaxed);
+    atomic_store_explicit(&lock->sequence, sequence + 2, memory_order_release);
+}
+
+SignalState readSignal(SignalSeqlock* lock) {
+    SignalState state;
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&lock->sequence, memory_order_acquire);
+        state.phase = atomic_load_explicit(&lock->phase, memory_order_relaxed);
+        state.greenMask = atomic_load_explicit(&lock->greenMask, memory_order_relaxed);
+        state.amberMask = atomic_load_explicit(&lock->amberMask, memory_order_relaxed);
+        state.phaseStartMs = atomic_load_explicit(&lock->phaseStartMs, memory_order_relaxed);
+        state.durationMs = atomic_load_explicit(&lock->durationMs, memory_order_relaxed);
+        state.reason = (SwitchReason)atomic_load_explicit(&lock->reason, memory_order_relaxed);
+        state.version = atomic_load_explicit(&lock->version, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&lock->sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return state;
+}
+
+bool roadGreen(int greenMask, char road) {
+    return (greenMask >> (road - 'A')) & 1;
+}
+
+// "A+B", "amber C+D" or "all red", for logs and the Traffic Monitor.
+const char* signalLabel(const SignalState* state, char* out, size_t size) {
+    int mask = state->greenMask ? state->greenMask : state->amberMask;
+    if (mask == 0) {
+        snprintf(out, size, "all red");
+        return out;
+    }
+    int n = snprintf(out, size, "%s", state->greenMask ? "" : "amber ");
+    for (int r = 0; r < 4 && n < (int)size; r++)
+        if (mask & (1 << r))
+            n += snprintf(out + n, size - n, "%s%c", (mask & ((1 << r) - 1)) ? "+" : "", 'A' + r);
+    return out;
+}
+
+// Time left in the phase at now, or -1 when it has no planned end.
+int signalRemainingMs(const SignalState* state, Uint32 now) {
+    if (state->durationMs == 0) return -1;
+    Uint32 elapsed = now - state->phaseStartMs;
+    return elapsed >= state->durationMs ? 0 : (int)(state->durationMs - elapsed);
+}
+
+// Log-bucketed latency histogram (HDR style): values below HIST_SUB_BUCKETS are
+// exact, above that every power of two is split into HIST_SUB_BUCKETS linear
+// buckets, so the relative error stays under ~6% and recording is O(1).
+#define HIST_SUB_BUCKET_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BUCKET_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint32_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint32_t max;
+} Histogram;
+
+int histogramBucket(uint32_t value) {
+    if (value < HIST_SUB_BUCKETS)
+        return (int)value;
+    int msb = 31 - __builtin_clz(value);
+    int shift = msb - HIST_SUB_BUCKET_BITS;
+    int sub = (int)(value >> shift) - HIST_SUB_BUCKETS;
+    return (shift + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// Highest value that falls into the given bucket.
+uint32_t histogramBucketLimit(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS)
+        return (uint32_t)bucket;
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << shift;
+    return (uint32_t)(low + ((uint64_t)1 << shift) - 1);
+}
+
+void histogramRecord(Histogram* h, uint32_t value) {
+    h->counts[histogramBucket(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+void histogramMerge(Histogram* dst, const Histogram* src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// Value at quantile q (0..1); returns 0 for an empty histogram.
+uint32_t histogramPercentile(const Histogram* h, double q) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)h->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->total) rank = h->total;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint32_t limit = histogramBucketLimit(i);
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Plates are packed into 64 bits: up to PLATE_MAX_CHARS characters of 6 bits
+// each, first character highest, with the lane suffix and EMG prefix as bit
+// fields above them. Keys compare equal exactly when the plates do, but their
+// order is not the text's. Zero is never a plate.
+// plateText() rebuilds the string for display.
+typedef uint64_t PlateKey;
+
+#define PLATE_MAX_CHARS 10
+#define PLATE_CHAR_BITS 6
+#define PLATE_BODY_BITS (PLATE_MAX_CHARS * PLATE_CHAR_BITS)
+#define PLATE_LANE_SHIFT PLATE_BODY_BITS            // 2 bits: L1-L3 suffix, 0 = none
+#define PLATE_EMERGENCY_BIT (1ull << (PLATE_BODY_BITS + 2))
+
+// 6-bit code -> character; code 0 pads unused positions.
+const char plateCharset[65] = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-";
+
+typedef struct {
+    char text[MAX_VEHICLE_ID];
+} PlateText;
+
+PlateText plateText(PlateKey key) {
+    PlateText out;
+    int n = 0;
+    if (key & PLATE_EMERGENCY_BIT) {
+        memcpy(out.text, "EMG", 3);
+        n = 3;
+    }
+    for (int i = 0; i < PLATE_MAX_CHARS; i++) {
+        int code = (key >> (PLATE_BODY_BITS - PLATE_CHAR_BITS * (i + 1))) & 63;
+        if (code == 0) break;
+        out.text[n++] = plateCharset[code];
+    }
+    int lane = (key >> PLATE_LANE_SHIFT) & 3;
+    if (lane) {
+        out.text[n++] = 'L';
+        out.text[n++] = '0' + lane;
+    }
+    out.text[n] = '\0';
+    return out;
+}
+
+// adding queue structures
+// Vehicle structure
+typedef struct {
+    PlateKey plate;         // packed plate, see plateText()
+    char lane;              // A/B/C/D
+    bool isEmergency;
+    int lane_number;        // 1 for left, 2 for middle, 3 for right
+    float animPos;          // field for animation
+    bool turning;           // new: indicates if a turn is in progress
+    float turnProgress;     // new: progress value from 0.0 to 1.0 for a turn
+    float turnPosX;         // New fields for turning animation positions (x and y)
+    float turnPosY;
+    float angle;
+    float targetAngle;
+    char originLane;        // road the vehicle entered on (lane changes after a turn)
+    int originLaneNumber;
+    Uint32 enterTimeMs;     // sim time when the vehicle was enqueued
+    Uint32 stopLineTimeMs;  // sim time when it crossed its stop line
+    Uint32 exitTimeMs;      // sim time when it left the screen
+    bool crossedStopLine;
+    int footprint;          // its entry in the conflict grid this tick
+    Uint32 yieldingSinceMs; // 0 unless it is giving way in the junction
+    uint32_t serial;        // unique per run, in arrival order (plates can repeat)
+    bool awaitingGreen;     // signalled emergency its road hasn't had green for since enterTimeMs
+    bool preemptExpired;    // its preemption ran out, normal control serves it
+} Vehicle;
+
+// Call sites that take a queue lock, for contention profiling.
+typedef enum {
+    LOCK_SITE_ENQUEUE,
+    LOCK_SITE_DEQUEUE,
+    LOCK_SITE_COUNT,        // countVehicles() / countVehiclesLaneA()
+    LOCK_SITE_UPDATE,       // updateVehicles()
+    LOCK_SITE_SNAPSHOT,     // publishSnapshot()
+    LOCK_SITE_TRAJECTORY,   // recordTrajectory()
+    LOCK_SITE_PREEMPTION,   // recordPreemptionLatency() / expirePreemption()
+    LOCK_SITE_CLEANUP,
+    LOCK_SITE_MAX
+} LockSite;
+
+const char* lockSiteNames[LOCK_SITE_MAX] = {
+    "enqueue", "dequeue", "countVehicles", "updateVehicles", "publishSnapshot", "recordTrajectory",
+    "preemption", "cleanup"
+};
+
+// Only written while holding the queue lock it belongs to.
+typedef struct {
+    uint64_t acquisitions;
+    uint64_t contended;     // trylock failed, the caller had to block
+    Histogram waitUs;
+    Histogram holdUs;
+} LockSiteStats;
+
+// Queue structure
+typedef struct {
+    Vehicle* vehicles[MAX_QUEUE_SIZE];
+    int front;
+    int rear;
+    int size;
+    char road;              // A/B/C/D
+    pthread_mutex_t lock;
+    LockSite lockSite;      // site currently holding the lock
+    uint64_t lockAcquiredUs;
+    LockSiteStats lockStats[LOCK_SITE_MAX];
+} VehicleQueue;
+
+atomic_uint vehicleSerials;     // last Vehicle::serial handed out
+
+// global queue variables
+VehicleQueue* queueA;
+VehicleQueue* queueB;
+VehicleQueue* queueC;
+VehicleQueue* queueD;
+
+// Clock used for all per-vehicle timestamps (milliseconds). With
+// --deterministic it only moves when lockstepTick() advances it.
+Uint32 simClockMs;
+Uint32 lastUpdateMs;            // previous updateVehicles(), for its delta
+
+Uint32 getSimTimeMs() {
+    if (simConfig.deterministic) return simClockMs;
+    return SDL_GetTicks();
+}
+
+// Monotonic wall clock in microseconds, for profiling.
+uint64_t getTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+// Allocations (vehicles, surfaces, textures) and ingested vehicles, read and
+// reset by the performance HUD once per frame.
+atomic_int frameAllocations;
+atomic_ullong vehiclesIngested;
+
+void countAllocation() {
+    atomic_fetch_add_explicit(&frameAllocations, 1, memory_order_relaxed);
+}
+
+// Chrome/Perfetto trace-event profiling (--trace <file>). Every thread that
+// wants spans registers once; spans go into that thread's own buffer and are
+// written out as "X" (complete) events at exit. When tracing is off a span
+// costs one branch on traceEnabled.
+#define TRACE_MAX_THREADS 8
+#define TRACE_MAX_EVENTS_PER_THREAD (1 << 18)
+
+typedef struct {
+    const char* name;       // must be a string literal
+    uint64_t startUs;
+    uint32_t durationUs;
+} TraceEvent;
+
+typedef struct {
+    const char* threadName;
+    TraceEvent* events;
+    atomic_int count;
+    int dropped;
+} TraceBuffer;
+
+typedef struct {
+    const char* name;
+    uint64_t startUs;
+} TraceSpan;
+
+bool traceEnabled = false;
+uint64_t traceStartUs;
+TraceBuffer traceBuffers[TRACE_MAX_THREADS];
+atomic_int traceThreadCount;
+__thread TraceBuffer* traceLocal = NULL;
+
+void traceRegisterThread(const char* threadName) {
+    if (!traceEnabled) return;
+    int slot = atomic_fetch_add(&traceThreadCount, 1);
+    if (slot >= TRACE_MAX_THREADS) return;
+    TraceBuffer* buffer = &traceBuffers[slot];
+    buffer->threadName = threadName;
+    buffer->events = (TraceEvent*)malloc(sizeof(TraceEvent) * TRACE_MAX_EVENTS_PER_THREAD);
+    if (buffer->events) traceLocal = buffer;
+}
+
+TraceSpan traceSpanBegin(const char* name) {
+    TraceSpan span = { name, 0 };
+    if (traceEnabled) span.startUs = getTimeUs();
+    return span;
+}
+
+void traceSpanEnd(TraceSpan* span) {
+    if (!traceEnabled || !traceLocal) return;
+    int n = atomic_load_explicit(&traceLocal->count, memory_order_relaxed);
+    if (n >= TRACE_MAX_EVENTS_PER_THREAD) {
+        traceLocal->dropped++;
+        return;
+    }
+    TraceEvent* e = &traceLocal->events[n];
+    e->name = span->name;
+    e->startUs = span->startUs;
+    e->durationUs = (uint32_t)(getTimeUs() - span->startUs);
+    atomic_store_explicit(&traceLocal->count, n + 1, memory_order_release);
+}
+
+// Records a span from here to the end of the enclosing block.
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    TraceSpan TRACE_CONCAT(traceSpan_, __LINE__) __attribute__((cleanup(traceSpanEnd))) = traceSpanBegin(name)
+
+void traceWriteFile(const char* path) {
+    if (!traceEnabled) return;
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror("Error opening trace file");
+        return;
+    }
+    int threads = atomic_load(&traceThreadCount);
+    if (threads > TRACE_MAX_THREADS) threads = TRACE_MAX_THREADS;
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"simulator\"}}");
+    long total = 0;
+    for (int t = 0; t < threads; t++) {
+        TraceBuffer* buffer = &traceBuffers[t];
+        if (!buffer->events) continue;
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                t + 1, buffer->threadName);
+        int n = atomic_load_explicit(&buffer->count, memory_order_acquire);
+        for (int i = 0; i < n; i++) {
+            TraceEvent* e = &buffer->events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":1,\"tid\":%d}",
+                    e->name, (unsigned long long)(e->startUs - traceStartUs), e->durationUs, t + 1);
+        }
+        total += n;
+        if (buffer->dropped)
+            printf("Trace: thread %s dropped %d events (buffer full)\n", buffer->threadName, buffer->dropped);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+    printf("Trace: wrote %ld events to %s\n", total, path);
+    fflush(stdout);
+}
+
+// Index of a road/lane in per-lane arrays.
+int laneIndex(char road, int laneNumber) {
+    int r = road - 'A';
+    if (r < 0 || r >= NUM_ROADS) r = 0;
+    if (laneNumber < 1 || laneNumber > LANES_PER_ROAD) laneNumber = 2;
+    return r * LANES_PER_ROAD + (laneNumber - 1);
+}
+
+// Lane counts kept up to date as vehicles arrive, cross and leave, so the
+// controllers can read them without walking the queues. laneWaiting is
+// indexed like laneDelayStats and counts vehicles short of their stop line.
+// exitOccupancy counts lane 2 vehicles past their stop line and still on
+// screen, by the road their turn leaves on.
+atomic_int laneWaiting[NUM_LANES];
+atomic_int exitOccupancy[NUM_ROADS];
+
+// Road (0-3) a lane 2 turn leaves on: A2 -> B1, B2 -> A1, C2 -> D1, D2 -> C1.
+int laneTwoExit(int road) {
+    return road ^ 1;
+}
+
+// Per-lane arrival and discharge rate estimates. Arrivals (enqueue()) feed an
+// exponentially decaying rate with time constant ARRIVAL_TAU_MS, so a burst
+// from the file reader raises it a little and a quiet lane decays to zero.
+// Discharges (trackStopLine()) feed an EWMA of the headway between stop-line
+// crossings. A headway only counts when the first vehicle left others waiting
+// behind it and it is shorter than DISCHARGE_MAX_GAP_MS, so red time and an
+// empty queue don't drag the saturation rate down.
+#define ARRIVAL_TAU_MS 30000.0
+#define RATE_EWMA_ALPHA 0.2
+#define DISCHARGE_MAX_GAP_MS 4000
+
+typedef struct {
+    double arrivalRate;     // vehicles/s as of lastArrivalMs
+    double dischargeGapMs;  // 0 until the first discharge sample
+    Uint32 lastArrivalMs;
+    Uint32 lastDischargeMs;
+    bool queueBehind;       // vehicles were still waiting after the last discharge
+} LaneRates;
+
+LaneRates laneRates[NUM_LANES];
+pthread_mutex_t laneRatesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void noteLaneArrival(int lane, Uint32 now) {
+    pthread_mutex_lock(&laneRatesMutex);
+    LaneRates* r = &laneRates[lane];
+    r->arrivalRate = r->arrivalRate * exp(-(double)(now - r->lastArrivalMs) / ARRIVAL_TAU_MS) +
+                     1000.0 / ARRIVAL_TAU_MS;
+    r->lastArrivalMs = now;
+    pthread_mutex_unlock(&laneRatesMutex);
+}
+
+void noteLaneDischarge(int lane, Uint32 now, bool queueBehind) {
+    pthread_mutex_lock(&laneRatesMutex);
+    LaneRates* r = &laneRates[lane];
+    Uint32 gap = now - r->lastDischargeMs;
+    if (r->queueBehind && gap < DISCHARGE_MAX_GAP_MS)
+        r->dischargeGapMs = r->dischargeGapMs == 0 ? gap
+                          : RATE_EWMA_ALPHA * gap + (1 - RATE_EWMA_ALPHA) * r->dischargeGapMs;
+    r->lastDischargeMs = now;
+    r->queueBehind = queueBehind;
+    pthread_mutex_unlock(&laneRatesMutex);
+}
+
+// Vehicles per second as of now.
+void readLaneRates(int lane, Uint32 now, double* arrivalRate, double* dischargeRate) {
+    pthread_mutex_lock(&laneRatesMutex);
+    const LaneRates* r = &laneRates[lane];
+    *arrivalRate = r->arrivalRate * exp(-(double)(now - r->lastArrivalMs) / ARRIVAL_TAU_MS);
+    *dischargeRate = r->dischargeGapMs > 0 ? 1000.0 / r->dischargeGapMs : 0.0;
+    pthread_mutex_unlock(&laneRatesMutex);
+}
+
+// Emergency preemption. Only lane 2 is signalled, so emergency vehicles there
+// are indexed per road from enqueue() until they cross the stop line. The
+// controller checks emergencyPending (one load) and is woken through
+// controllerWake as soon as one arrives, instead of finishing its hold.
+// A preemption that has not cleared its road after EMERGENCY_MAX_PREEMPT_MS
+// gives up: the vehicles still waiting there stop counting as pending and
+// are left to normal control.
+#define CONTROLLER_IDLE_MS 100      // controller poll when no lane has vehicles
+#define EMERGENCY_POLL_MS 20        // re-check while holding a preemption
+#define EMERGENCY_MAX_PREEMPT_MS 30000
+
+atomic_int emergencyPending;                    // all roads
+atomic_int emergencyWaiting[NUM_ROADS];
+atomic_ullong emergencyArrivalUs[NUM_ROADS];    // oldest not yet given green, 0 = none (for order, simulated)
+pthread_mutex_t controllerMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t controllerWake = PTHREAD_COND_INITIALIZER;
+atomic_bool stopping;                           // main() is shutting down: threads return
+
+typedef struct {
+    int arrivals;
+    int preemptions;                // phase changes made for an emergency
+    Histogram latencyMs;            // arrival -> green on its road, simulated
+    int expired;                    // gave up after EMERGENCY_MAX_PREEMPT_MS
+    uint64_t emergencyGreenMs;      // time spent in finished emergency phases
+    uint64_t greenCutMs;            // planned green taken from the road that was interrupted
+    uint64_t heldVehicleMs;         // lane 2 vehicles on other roads x emergency green
+    int heldVehicles;               // waiting elsewhere when the current preemption began
+    bool active;                    // the current phase was switched to by a preemption
+    Uint32 activeSinceMs;
+} PreemptionStats;
+
+PreemptionStats preemption;
+
+bool isSignalledEmergency(const Vehicle* v) {
+    return v->isEmergency && v->originLaneNumber == 2 && v->originLane >= 'A' && v->originLane <= 'D';
+}
+
+// Arrival stamp of a signalled emergency vehicle, in simulated microseconds so
+// it orders arrivals the same way in every mode; only the ingestion thread gets
+// here.
+unsigned long long lastEmergencyArrivalUs;
+
+unsigned long long emergencyArrivalStamp() {
+    unsigned long long now = getSimTimeMs() * 1000ull;
+    if (now <= lastEmergencyArrivalUs) now = lastEmergencyArrivalUs + 1; // strictly increasing, so ties keep arrival order
+    lastEmergencyArrivalUs = now;
+    return now;
+}
+
+void noteEmergencyArrival(const Vehicle* v, unsigned long long arrivalUs) {
+    int road = v->originLane - 'A';
+    unsigned long long none = 0;
+    atomic_compare_exchange_strong(&emergencyArrivalUs[road], &none, arrivalUs);
+    atomic_fetch_add(&emergencyWaiting[road], 1);
+    pthread_mutex_lock(&controllerMutex);
+    atomic_fetch_add(&emergencyPending, 1);
+    preemption.arrivals++;
+    pthread_cond_broadcast(&controllerWake);
+    pthread_mutex_unlock(&controllerMutex);
+}
+
+// Called with the vehicle's queue locked, like expirePreemption().
+void noteEmergencyCleared(const Vehicle* v) {
+    if (v->preemptExpired) return;  // no longer counted
+    atomic_fetch_sub(&emergencyWaiting[v->originLane - 'A'], 1);
+    atomic_fetch_sub(&emergencyPending, 1);
+}
+
+// Road (0-3) of the longest-waiting emergency vehicle, or -1.
+int emergencyRoad() {
+    if (atomic_load(&emergencyPending) == 0) return -1;
+    int best = -1;
+    unsigned long long bestUs = 0;
+    for (int r = 0; r < NUM_ROADS; r++) {
+        if (atomic_load(&emergencyWaiting[r]) == 0) continue;
+        unsigned long long arrivalUs = atomic_load(&emergencyArrivalUs[r]);
+        if (best < 0 || (arrivalUs != 0 && (bestUs == 0 || arrivalUs < bestUs))) {
+            best = r;
+            bestUs = arrivalUs;
+        }
+    }
+    return best;
+}
+
+// Deterministic lockstep (--deterministic). The clock only moves in fixed
+// ticks on the main thread, and the controller thread becomes a coroutine of
+// it: it runs only while the main thread waits for it to park again in
+// waitForController() or pauseController(). It is resumed once the clock
+// reaches the time it asked to wake at, or when an emergency vehicle is
+// waiting if it asked for that. Everything then happens in the same order on
+// every run.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool controllerStarted;     // a controller thread takes part
+    bool parked;
+    Uint32 wakeMs;
+    bool wakeOnEmergency;
+    bool atPassEnd;             // parked in waitAtPassEnd(): a checkpoint can be taken
+} Lockstep;
+
+Lockstep lockstep = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Controller side: blocks until the main thread resumes it at wakeMs (or for
+// an emergency vehicle).
+bool lockstepParkUntil(Uint32 wakeMs, bool wakeOnEmergency) {
+    pthread_mutex_lock(&lockstep.mutex);
+    lockstep.wakeMs = wakeMs;
+    lockstep.wakeOnEmergency = wakeOnEmergency;
+    lockstep.parked = true;
+    pthread_cond_broadcast(&lockstep.cond);
+    while (lockstep.parked && !atomic_load(&stopping))
+        pthread_cond_wait(&lockstep.cond, &lockstep.mutex);
+    pthread_mutex_unlock(&lockstep.mutex);
+    if (atomic_load(&stopping)) pthread_exit(NULL);    // joined by stopThreads()
+    return wakeOnEmergency && atomic_load(&emergencyPending) > 0;
+}
+
+bool lockstepPark(int timeoutMs, bool wakeOnEmergency) {
+    if (wakeOnEmergency && atomic_load(&emergencyPending) > 0) return true;
+    return lockstepParkUntil(simClockMs + (timeoutMs > 0 ? timeoutMs : 1), wakeOnEmergency);
+}
+
+// Main thread, before the first tick: the controller's first pass must not
+// overlap ingestion.
+void lockstepWaitForController() {
+    if (!lockstep.controllerStarted) return;
+    pthread_mutex_lock(&lockstep.mutex);
+    while (!lockstep.parked)
+        pthread_cond_wait(&lockstep.cond, &lockstep.mutex);
+    pthread_mutex_unlock(&lockstep.mutex);
+}
+
+// Main thread, once per tick: lets the controller run until it parks with a
+// wake-up time still ahead of the clock.
+void lockstepResumeController() {
+    if (!lockstep.controllerStarted) return;
+    pthread_mutex_lock(&lockstep.mutex);
+    while (1) {
+        while (!lockstep.parked)
+            pthread_cond_wait(&lockstep.cond, &lockstep.mutex);
+        bool due = (Sint32)(simClockMs - lockstep.wakeMs) >= 0 ||
+                   (lockstep.wakeOnEmergency && atomic_load(&emergencyPending) > 0);
+        if (!due) break;
+        lockstep.parked = false;
+        pthread_cond_broadcast(&lockstep.cond);
+    }
+    pthread_mutex_unlock(&lockstep.mutex);
+}
+
+// Free-running controller: sleeps for timeoutMs, or less if an emergency
+// vehicle is waiting and wakeOnEmergency is set. At shutdown the thread ends
+// here, parked between passes like the lockstep one.
+void sleepController(int timeoutMs, bool wakeOnEmergency) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&controllerMutex);
+    while (!atomic_load(&stopping) && !(wakeOnEmergency && atomic_load(&emergencyPending) > 0)) {
+        if (pthread_cond_timedwait(&controllerWake, &controllerMutex, &deadline) != 0)
+            break;
+    }
+    pthread_mutex_unlock(&controllerMutex);
+    if (atomic_load(&stopping)) pthread_exit(NULL);    // joined by stopThreads()
+}
+
+// Sleeps the controller without the emergency wake-up.
+void pauseController(int ms) {
+    if (simConfig.deterministic)
+        lockstepPark(ms, false);
+    else
+        sleepController(ms, false);
+}
+
+// Sleeps the controller for up to timeoutMs. Returns true (early) when an
+// emergency vehicle is waiting.
+bool waitForController(int timeoutMs) {
+    if (simConfig.deterministic) return lockstepPark(timeoutMs, true);
+    sleepController(timeoutMs, true);
+    return atomic_load(&emergencyPending) > 0;
+}
+
+// Main thread, at exit: the controller ends at its next wait and the
+// ingestion thread at its next record or poll. Both are joined, so nothing
+// still uses the queues when they are freed.
+void stopThreads(pthread_t controller, pthread_t ingestion) {
+    atomic_store(&stopping, true);
+    pthread_mutex_lock(&controllerMutex);
+    pthread_cond_broadcast(&controllerWake);
+    pthread_mutex_unlock(&controllerMutex);
+    pthread_mutex_lock(&lockstep.mutex);
+    pthread_cond_broadcast(&lockstep.cond);
+    pthread_mutex_unlock(&lockstep.mutex);
+    if (!simConfig.reservations) pthread_join(controller, NULL);
+    if (!simConfig.deterministic) pthread_join(ingestion, NULL);
+}
+
+// What a controller carries from one pass of its loop to the next; nothing
+// else on its stack outlives a pass. A checkpoint is only taken while the
+// controller is parked in waitAtPassEnd(), so saving this and the wake-up it
+// is parked with is enough to resume it exactly.
+typedef struct {
+    int32_t greenMask;          // plan, pressure: roads green (or last green)
+    int32_t next;               // plan: stage to try first
+    int32_t lastStage;
+    int32_t activeStage;        // plan: stage whose green is running, -1 = none
+    uint32_t stageStartMs;
+    uint32_t preempted;         // the wait at the end of the pass was cut short
+} ControllerState;
+
+ControllerState controllerState = { .lastStage = -1, .activeStage = -1 };
+
+// waitForController() as the last thing in a pass of the controller's loop.
+bool waitAtPassEnd(int timeoutMs) {
+    lockstep.atPassEnd = true;
+    bool preempted = waitForController(timeoutMs);
+    lockstep.atPassEnd = false;
+    return preempted;
+}
+
+// queue operations:
+VehicleQueue* createQueue(char road) {
+    VehicleQueue* queue = (VehicleQueue*)calloc(1, sizeof(VehicleQueue));
+    queue->front = 0;
+    queue->rear = -1;
+    queue->size = 0;
+    queue->road = road;
+    pthread_mutex_init(&queue->lock, NULL);
+    return queue;
+}
+
+// All queue locking goes through these. Acquisitions and contended
+// acquisitions are always counted; with --lock-profile the wait and hold
+// times go into per-site histograms. Contended waits show up in traces.
+void lockQueue(VehicleQueue* queue, LockSite site) {
+    static const char* waitNames[] = { "lock wait A", "lock wait B", "lock wait C", "lock wait D" };
+    uint64_t start = simConfig.lockProfile ? getTimeUs() : 0;
+    bool contended = pthread_mutex_trylock(&queue->lock) != 0;
+    if (contended) {
+        TRACE_SCOPE(waitNames[(queue->road - 'A') & 3]);
+        pthread_mutex_lock(&queue->lock);
+    }
+    LockSiteStats* stats = &queue->lockStats[site];
+    stats->acquisitions++;
+    if (contended) stats->contended++;
+    queue->lockSite = site;
+    if (simConfig.lockProfile) {
+        queue->lockAcquiredUs = getTimeUs();
+        histogramRecord(&stats->waitUs, (uint32_t)(queue->lockAcquiredUs - start));
+    }
+}
+
+void unlockQueue(VehicleQueue* queue) {
+    if (simConfig.lockProfile)
+        histogramRecord(&queue->lockStats[queue->lockSite].holdUs,
+                        (uint32_t)(getTimeUs() - queue->lockAcquiredUs));
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Totals over all sites of a queue. The caller holds its lock, since every
+// lockQueue() counts while holding it.
+void lockTotals(VehicleQueue* queue, uint64_t* acquisitions, uint64_t* contended) {
+    for (int site = 0; site < LOCK_SITE_MAX; site++) {
+        *acquisitions += queue->lockStats[site].acquisitions;
+        *contended += queue->lockStats[site].contended;
+    }
+}
+
+void printLockReport(VehicleQueue* queues[], int count) {
+    printf("\n=== Queue lock contention ===\n");
+    printf("Queue site            acquired  contended |  wait p50   p99    max us |  hold p50   p99    max us\n");
+    for (int q = 0; q < count; q++) {
+        for (int site = 0; site < LOCK_SITE_MAX; site++) {
+            LockSiteStats* s = &queues[q]->lockStats[site];
+            if (s->acquisitions == 0) continue;
+            printf("%c     %-14s %9llu %9.2f%% | %8u %6u %8u | %8u %6u %8u\n",
+                   queues[q]->road, lockSiteNames[site],
+                   (unsigned long long)s->acquisitions, 100.0 * s->contended / s->acquisitions,
+                   histogramPercentile(&s->waitUs, 0.50), histogramPercentile(&s->waitUs, 0.99), s->waitUs.max,
+                   histogramPercentile(&s->holdUs, 0.50), histogramPercentile(&s->holdUs, 0.99), s->holdUs.max);
+        }
+    }
+    if (!simConfig.lockProfile)
+        printf("(wait/hold times need --lock-profile)\n");
+    fflush(stdout);
+}
+
+bool isQueueFull(VehicleQueue* queue) {
+    return queue->size >= MAX_QUEUE_SIZE;
+}
+
+bool isQueueEmpty(VehicleQueue* queue) {
+    return queue->size == 0;
+}
+
+// Returns false (and leaves the vehicle to the caller) when the queue is full.
+bool enqueue(VehicleQueue* queue, Vehicle* vehicle) {
+    unsigned long long arrivalUs = 0;   // the vehicle's copy can be cleared once it is queued
+    lockQueue(queue, LOCK_SITE_ENQUEUE);
+    bool added = !isQueueFull(queue);
+    if (added) {
+        vehicle->originLane = vehicle->lane;
+        vehicle->originLaneNumber = vehicle->lane_number;
+        vehicle->enterTimeMs = getSimTimeMs();
+        vehicle->crossedStopLine = false;
+        vehicle->awaitingGreen = isSignalledEmergency(vehicle);
+        if (vehicle->awaitingGreen)
+            arrivalUs = emergencyArrivalStamp();
+        queue->rear = (queue->rear + 1) % MAX_QUEUE_SIZE;
+        queue->vehicles[queue->rear] = vehicle;
+        queue->size++;
+        atomic_fetch_add_explicit(&vehiclesIngested, 1, memory_order_relaxed);
+        printf("Enqueued vehicle %s to lane %c (size: %d)\n", 
+               plateText(vehicle->plate).text, vehicle->lane, queue->size);
+    } else {
+        printf("Queue for lane %c is full!\n", vehicle->lane);
+    }
+    unlockQueue(queue);
+    if (added) {
+        int lane = laneIndex(vehicle->originLane, vehicle->originLaneNumber);
+        atomic_fetch_add(&laneWaiting[lane], 1);
+        noteLaneArrival(lane, vehicle->enterTimeMs);
+    }
+    if (added && isSignalledEmergency(vehicle))
+        noteEmergencyArrival(vehicle, arrivalUs);
+    return added;
+}
+
+Vehicle* dequeue(VehicleQueue* queue) {
+    lockQueue(queue, LOCK_SITE_DEQUEUE);
+    Vehicle* vehicle = NULL;
+    if (!isQueueEmpty(queue)) {
+        vehicle = queue->vehicles[queue->front];
+        queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
+        queue->size--;
+        printf("Dequeued vehicle %s from lane %c (size: %d)\n", 
+               plateText(vehicle->plate).text, vehicle->lane, queue->size);
+    }
+    unlockQueue(queue);
+    return vehicle;
+}
+
+// Added unlocked dequeue version (assumes lock is held)
+Vehicle* dequeueUnlocked(VehicleQueue* queue) {
+    Vehicle* vehicle = NULL;
+    if (!isQueueEmpty(queue)) {
+        vehicle = queue->vehicles[queue->front];
+        queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
+        queue->size--;
+        printf("Dequeued vehicle %s from lane %c (size: %d) [unlocked]\n", 
+               plateText(vehicle->plate).text, vehicle->lane, queue->size);
+    }
+    return vehicle;
+}
+
+// queue cleanup
+void cleanupQueue(VehicleQueue* queue) {
+    lockQueue(queue, LOCK_SITE_CLEANUP);
+    for (int i = 0; i < queue->size; i++) {
+        int idx = (queue->front + i) % MAX_QUEUE_SIZE;
+        free(queue->vehicles[idx]);
+    }
+    unlockQueue(queue);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+// Function to get queue size
+int getQueueSize(VehicleQueue *queue) {
+    return queue->size;
+}
+
+// Per-lane delay statistics, indexed by the road/lane a vehicle entered on.
+// Written by the thread running updateVehicles(); drawUI() only reads them for
+// display, which with --sim-thread may see a half-recorded sample.
+
+typedef struct {
+    Histogram waitTime;     // enter -> stop line
+    Histogram travelTime;   // enter -> exit
+} LaneDelayStats;
+
+LaneDelayStats laneDelayStats[NUM_LANES];
+LaneDelayStats totalDelayStats;
+
+// Stop-line throughput, accumulated per signal phase (one phase = one light state,
+// SignalState::phase). Saturation flow is measured from the discharge headways of
+// vehicles that were already waiting when their green started.
+#define SATURATION_SKIP_VEHICLES 2  // start-up lost time: ignore the first discharges
+
+typedef struct {
+    int index;
+    int light;                      // light state during the phase (0 = all red)
+    int greenMask;                  // roads whose lane 2 had green
+    Uint32 startMs;
+    int laneCrossings[NUM_LANES];
+    int straightCrossings;
+    int turnCrossings;
+    int servedCrossings;            // straight crossings on the road holding the green
+    int queuedDischarged;           // served vehicles that were waiting at green start
+    Uint32 lastDischargeMs;
+    uint64_t headwaySumMs;
+    int headwayCount;
+} PhaseThroughput;
+
+typedef struct {
+    PhaseThroughput phase;
+    int phasesCompleted;
+    uint64_t laneCrossings[NUM_LANES];
+    uint64_t straightCrossings;
+    uint64_t turnCrossings;
+    uint64_t saturatedHeadwaySumMs;
+    uint64_t saturatedHeadwayCount;
+    uint64_t greenMs;               // total green time handed out
+    double usedGreenMs;             // served vehicles x saturation headway
+    float lastUtilisation;          // of the last completed green, -1 if unknown
+    FILE* csv;
+} ThroughputStats;
+
+ThroughputStats throughput = { .lastUtilisation = -1.0f };
+
+// Measured saturation flow in vehicles/hour, 0 until enough headways were seen.
+float saturationFlowVph() {
+    if (throughput.saturatedHeadwayCount == 0) return 0.0f;
+    return 3600000.0f * throughput.saturatedHeadwayCount / throughput.saturatedHeadwaySumMs;
+}
+
+void throughputBeginPhase(int light, int greenMask, Uint32 now) {
+    int index = throughput.phase.index + 1;
+    memset(&throughput.phase, 0, sizeof(throughput.phase));
+    throughput.phase.index = index;
+    throughput.phase.light = light;
+    throughput.phase.greenMask = greenMask;
+    throughput.phase.startMs = now;
+}
+
+void throughputEndPhase(Uint32 now) {
+    PhaseThroughput* p = &throughput.phase;
+    Uint32 duration = now - p->startMs;
+    float utilisation = -1.0f;
+    if (p->greenMask != 0) {
+        throughput.greenMs += duration;
+        float satFlow = saturationFlowVph();
+        if (satFlow > 0.0f && duration > 0) {
+            float used = p->servedCrossings * (3600000.0f / satFlow);
+            throughput.usedGreenMs += used;
+            utilisation = used / duration;
+            if (utilisation > 1.0f) utilisation = 1.0f;
+        }
+        throughput.lastUtilisation = utilisation;
+    }
+    throughput.phasesCompleted++;
+
+    if (throughput.csv) {
+        fprintf(throughput.csv, "%d,%d,%u,%u", p->index, p->light, p->startMs, duration);
+        for (int i = 0; i < NUM_LANES; i++)
+            fprintf(throughput.csv, ",%d", p->laneCrossings[i]);
+        fprintf(throughput.csv, ",%d,%d,%d,%d,%.1f,%.3f\n",
+                p->straightCrossings, p->turnCrossings, p->servedCrossings,
+                p->headwayCount, saturationFlowVph(), utilisation);
+        fflush(throughput.csv);
+    }
+}
+
+bool openThroughputCsv(const char* path) {
+    throughput.csv = fopen(path, "w");
+    if (!throughput.csv) {
+        perror("Error opening throughput file");
+        return false;
+    }
+    fprintf(throughput.csv, "phase,light,start_ms,duration_ms");
+    for (int i = 0; i < NUM_LANES; i++)
+        fprintf(throughput.csv, ",%cL%d", 'A' + i / LANES_PER_ROAD, i % LANES_PER_ROAD + 1);
+    fprintf(throughput.csv, ",straight,turn,served,sat_headways,sat_flow_vph,utilisation\n");
+    return true;
+}
+
+// Called once per vehicle when it crosses the stop line of its road.
+void recordStopLineCrossing(const Vehicle* v, Uint32 now) {
+    PhaseThroughput* p = &throughput.phase;
+    int lane = laneIndex(v->originLane, v->originLaneNumber);
+    p->laneCrossings[lane]++;
+    throughput.laneCrossings[lane]++;
+    if (v->originLaneNumber == 3) {
+        p->turnCrossings++;
+        throughput.turnCrossings++;
+        return;
+    }
+    p->straightCrossings++;
+    throughput.straightCrossings++;
+
+    bool served = v->originLaneNumber == 2 && roadGreen(p->greenMask, v->originLane);
+    if (!served) return;
+    p->servedCrossings++;
+    if (v->enterTimeMs >= p->startMs) return;   // arrived during the green, not a queue discharge
+    p->queuedDischarged++;
+    if (p->queuedDischarged > SATURATION_SKIP_VEHICLES) {
+        Uint32 headway = now - p->lastDischargeMs;
+        p->headwaySumMs += headway;
+        p->headwayCount++;
+        throughput.saturatedHeadwaySumMs += headway;
+        throughput.saturatedHeadwayCount++;
+    }
+    p->lastDischargeMs = now;
+}
+
+void printThroughputReport() {
+    throughputEndPhase(getSimTimeMs());
+    printf("\n=== Stop-line throughput ===\n");
+    printf("Phases: %d, green time: %.1f s\n", throughput.phasesCompleted, throughput.greenMs / 1000.0);
+    for (int i = 0; i < NUM_LANES; i++) {
+        if (throughput.laneCrossings[i] == 0) continue;
+        printf("%cL%d crossings: %llu\n", 'A' + i / LANES_PER_ROAD, i % LANES_PER_ROAD + 1,
+               (unsigned long long)throughput.laneCrossings[i]);
+    }
+    printf("Straight: %llu, turn: %llu\n", (unsigned long long)throughput.straightCrossings,
+           (unsigned long long)throughput.turnCrossings);
+    if (throughput.saturatedHeadwayCount > 0)
+        printf("Saturation flow: %.0f veh/h (%llu headways)\n", saturationFlowVph(),
+               (unsigned long long)throughput.saturatedHeadwayCount);
+    else
+        printf("Saturation flow: not measured (no saturated discharges)\n");
+    if (throughput.greenMs > 0 && throughput.usedGreenMs > 0)
+        printf("Green utilisation: %.1f%%\n", 100.0 * throughput.usedGreenMs / throughput.greenMs);
+    if (throughput.csv) fclose(throughput.csv);
+    fflush(stdout);
+}
+
+// Render snapshots. After every simulation tick the vehicles, light and queue
+// sizes are copied into a snapshot and published through a lock-free triple
+// buffer: the simulation owns one buffer, the renderer another, and the third
+// changes hands with a single atomic exchange. Neither side ever waits for the
+// other and the renderer never takes a queue lock or touches a live Vehicle.
+#define SNAPSHOT_MAX_VEHICLES (NUM_ROADS * MAX_QUEUE_SIZE)
+#define SNAPSHOT_FRESH 4                // in snapshotMiddle: holds an unread snapshot
+
+typedef struct {
+    Vehicle vehicle;                    // copy, still valid once the original is freed
+} SnapshotVehicle;
+
+typedef struct {
+    uint64_t tick;
+    Uint32 timeMs;
+    SignalState signal;                 // SharedData::current after the tick
+    int queueSizes[NUM_ROADS];
+    // Traffic Monitor figures, taken on the simulation side so drawUI() never
+    // reads counters while they are being updated.
+    uint32_t waitMs[3];                 // p50 / p90 / p99
+    uint32_t tripMs[3];
+    float saturationFlowVph;
+    float lastUtilisation;
+    uint64_t lockAcquisitions;
+    uint64_t lockContended;
+    int vehicleCount;
+    SnapshotVehicle vehicles[SNAPSHOT_MAX_VEHICLES];
+} RenderSnapshot;
+
+RenderSnapshot snapshots[3];
+atomic_int snapshotMiddle = 1;          // buffer index | SNAPSHOT_FRESH
+int snapshotBack = 0;                   // written by the simulation
+int snapshotFront = 2;                  // read by the renderer
+uint64_t snapshotTicks;
+atomic_bool simulationRunning;          // --sim-thread is ticking
+atomic_ullong lastTickUs;               // duration of its last tick, for the HUD
+
+void copyQueueToSnapshot(RenderSnapshot* snapshot, VehicleQueue* queue) {
+    lockQueue(queue, LOCK_SITE_SNAPSHOT);
+    for (int i = 0; i < queue->size && snapshot->vehicleCount < SNAPSHOT_MAX_VEHICLES; i++) {
+        SnapshotVehicle* out = &snapshot->vehicles[snapshot->vehicleCount++];
+        out->vehicle = *queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+    }
+    snapshot->queueSizes[queue->road - 'A'] = queue->size;
+    lockTotals(queue, &snapshot->lockAcquisitions, &snapshot->lockContended);
+    unlockQueue(queue);
+}
+
+void publishSnapshot(SharedData* sharedData) {
+    RenderSnapshot* snapshot = &snapshots[snapshotBack];
+    snapshot->tick = ++snapshotTicks;
+    snapshot->timeMs = getSimTimeMs();
+    snapshot->signal = readSignal(&sharedData->current);
+    static const double quantiles[3] = { 0.50, 0.90, 0.99 };
+    for (int i = 0; i < 3; i++) {
+        snapshot->waitMs[i] = histogramPercentile(&totalDelayStats.waitTime, quantiles[i]);
+        snapshot->tripMs[i] = histogramPercentile(&totalDelayStats.travelTime, quantiles[i]);
+    }
+    snapshot->saturationFlowVph = saturationFlowVph();
+    snapshot->lastUtilisation = throughput.lastUtilisation;
+    snapshot->lockAcquisitions = snapshot->lockContended = 0;
+    snapshot->vehicleCount = 0;
+    copyQueueToSnapshot(snapshot, queueA);
+    copyQueueToSnapshot(snapshot, queueB);
+    copyQueueToSnapshot(snapshot, queueC);
+    copyQueueToSnapshot(snapshot, queueD);
+    snapshotBack = atomic_exchange(&snapshotMiddle, snapshotBack | SNAPSHOT_FRESH) & 3;
+}
+
+// Latest published snapshot; stays valid until the next call.
+const RenderSnapshot* acquireSnapshot() {
+    if (atomic_load(&snapshotMiddle) & SNAPSHOT_FRESH)
+        snapshotFront = atomic_exchange(&snapshotMiddle, snapshotFront) & 3;
+    return &snapshots[snapshotFront];
+}
+
+// Fixed pool of buffers handed from a producer (the simulation or render
+// loop) to one background writer and back. Only indices move, so nothing is
+// allocated per use, and the lock is only taken once per buffer.
+#define HANDOFF_MAX 16
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;          // a buffer is waiting for the writer, or stopping
+    pthread_cond_t emptied;         // the writer gave a buffer back
+    int count;
+    int free[HANDOFF_MAX], freeCount;
+    int full[HANDOFF_MAX], fullHead, fullCount;
+    bool stopping;
+    uint64_t stalls;                // handoffTake() had to wait
+    uint64_t stallUs;
+} HandoffPool;
+
+void handoffInit(HandoffPool* pool, int count) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->filled, NULL);
+    pthread_cond_init(&pool->emptied, NULL);
+    pool->count = count;
+    for (int i = 0; i < count; i++) pool->free[pool->freeCount++] = i;
+}
+
+// Producer: a free buffer, or -1 when there is none and wait is false.
+int handoffTake(HandoffPool* pool, bool wait) {
+    int index = -1;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->freeCount == 0 && wait) {
+        uint64_t startUs = getTimeUs();
+        pool->stalls++;
+        while (pool->freeCount == 0)
+            pthread_cond_wait(&pool->emptied, &pool->lock);
+        pool->stallUs += getTimeUs() - startUs;
+    }
+    if (pool->freeCount > 0) index = pool->free[--pool->freeCount];
+    pthread_mutex_unlock(&pool->lock);
+    return index;
+}
+
+// Producer: queues a filled buffer for the writer.
+void handoffSubmit(HandoffPool* pool, int index) {
+    pthread_mutex_lock(&pool->lock);
+    pool->full[(pool->fullHead + pool->fullCount++) % pool->count] = index;
+    pthread_cond_signal(&pool->filled);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Writer: the oldest filled buffer, or -1 once stopping and drained.
+int handoffNext(HandoffPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->fullCount == 0 && !pool->stopping)
+        pthread_cond_wait(&pool->filled, &pool->lock);
+    int index = -1;
+    if (pool->fullCount > 0) {
+        index = pool->full[pool->fullHead];
+        pool->fullHead = (pool->fullHead + 1) % pool->count;
+        pool->fullCount--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return index;
+}
+
+// Writer: gives a written buffer back to the producer.
+void handoffRelease(HandoffPool* pool, int index) {
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->freeCount++] = index;
+    pthread_cond_signal(&pool->emptied);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Producer: lets the writer finish what is queued and exit.
+void handoffStop(HandoffPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_signal(&pool->filled);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Trajectory export (--trajectory <file>). After every tick the simulation
+// copies each vehicle's position into a row of a chunk from a small pool, and
+// hands full chunks to a writer thread. That thread encodes them and writes
+// them out in large blocks, so the simulation only pays for the copy.
+//
+// The file is TRAJECTORY_MAGIC, then one block per tick:
+//   varint length of the rest of the block
+//   varint time since the previous block (ms), byte green mask
+//   varint rows, varint vehicles seen for the first time
+//   columns, one value per row unless noted:
+//     serial     zigzag varint, difference from the previous row
+//     plate      varint plate key, only for first-time vehicles
+//     road/lane  byte, road index << 2 | lane number
+//     flags      byte, TRAJECTORY_TURNING | TRAJECTORY_EMERGENCY
+//     animPos, turnPosX, turnPosY, angle
+//                zigzag varint, change since the vehicle's previous row,
+//                in 1/TRAJECTORY_SCALE of a pixel or degree
+// A vehicle that only moved along its lane costs about 7 bytes per tick.
+// --trajectory-dump decodes a file to CSV.
+#define TRAJECTORY_MAGIC "TJTRAJ01"
+#define TRAJECTORY_SCALE 256.0f
+#define TRAJECTORY_CHUNKS 8
+#define TRAJECTORY_CHUNK_ROWS (1 << 16)
+#define TRAJECTORY_CHUNK_TICKS 4096
+#define TRAJECTORY_WRITE_BYTES (4 << 20)   // the writer's fwrite() size
+#define TRAJECTORY_MAX_BLOCK (16 + SNAPSHOT_MAX_VEHICLES * 48)
+#define TRAJECTORY_TURNING 0x01
+#define TRAJECTORY_EMERGENCY 0x02
+#define TRAJECTORY_MAX_SERIAL (1u << 26)  // --trajectory-dump: larger means a corrupt block
+
+typedef struct {
+    PlateKey plate;
+    uint32_t serial;
+    uint8_t roadLane;
+    uint8_t flags;
+    float animPos, turnPosX, turnPosY, angle;
+} TrajectoryRow;
+
+typedef struct {
+    Uint32 timeMs;
+    uint8_t greenMask;
+    int rows;
+} TrajectoryTick;
+
+typedef struct {
+    int tickCount;
+    int rowCount;
+    TrajectoryTick ticks[TRAJECTORY_CHUNK_TICKS];
+    TrajectoryRow rows[TRAJECTORY_CHUNK_ROWS];
+} TrajectoryChunk;
+
+// A vehicle's last quantised position, by serial; only the writer touches it.
+typedef struct {
+    int32_t value[4];
+    bool seen;
+} TrajectoryTrack;
+
+typedef struct {
+    FILE* file;
+    pthread_t writer;
+    HandoffPool chunks;
+    TrajectoryChunk* pool[TRAJECTORY_CHUNKS];
+    int current;                    // chunk the simulation is filling, -1 = none
+    // simulation side
+    uint64_t ticks, rows;
+    uint64_t droppedTicks;          // windowed runs: no free chunk
+    // writer side
+    TrajectoryTrack* tracks;
+    size_t trackCapacity;
+    Uint32 lastTimeMs;
+    uint8_t* out;
+    size_t outUsed;
+    uint64_t bytesWritten;
+    uint64_t encodeUs;
+} TrajectoryExport;
+
+TrajectoryExport trajectory = { .current = -1 };
+
+static inline uint8_t* putVarint(uint8_t* p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+void trajectoryFlush() {
+    if (trajectory.outUsed == 0) return;
+    if (fwrite(trajectory.out, 1, trajectory.outUsed, trajectory.file) != trajectory.outUsed)
+        perror("Error writing trajectory");
+    trajectory.bytesWritten += trajectory.outUsed;
+    trajectory.outUsed = 0;
+}
+
+// The track of serial, growing the table to fit it. The capacity doubles in
+// size_t, so it can't wrap below the serial. NULL when out of memory.
+TrajectoryTrack* trajectoryTrack(uint32_t serial) {
+    TrajectoryExport* t = &trajectory;
+    if (serial >= t->trackCapacity) {
+        size_t capacity = t->trackCapacity ? t->trackCapacity : 1024;
+        while (capacity <= serial) capacity *= 2;
+        TrajectoryTrack* tracks = realloc(t->tracks, capacity * sizeof(TrajectoryTrack));
+        if (!tracks) return NULL;
+        memset(tracks + t->trackCapacity, 0, (capacity - t->trackCapacity) * sizeof(TrajectoryTrack));
+        t->tracks = tracks;
+        t->trackCapacity = capacity;
+    }
+    return &t->tracks[serial];
+}
+
+void encodeTrajectoryTick(const TrajectoryTick* tick, const TrajectoryRow* rows) {
+    TrajectoryExport* t = &trajectory;
+    static uint8_t block[TRAJECTORY_MAX_BLOCK];
+    uint8_t* p = block;
+    int newCount = 0;
+    for (int i = 0; i < tick->rows; i++) {
+        const TrajectoryTrack* track = trajectoryTrack(rows[i].serial);
+        if (!track) {
+            perror("Error growing trajectory tracks");    // the tick is left out
+            return;
+        }
+        if (!track->seen) newCount++;
+    }
+    p = putVarint(p, tick->timeMs - t->lastTimeMs);
+    *p++ = tick->greenMask;
+    p = putVarint(p, tick->rows);
+    p = putVarint(p, newCount);
+    uint32_t previous = 0;
+    for (int i = 0; i < tick->rows; i++) {
+        p = putVarint(p, zigzag((int64_t)rows[i].serial - previous));
+        previous = rows[i].serial;
+    }
+    for (int i = 0; i < tick->rows; i++)
+        if (!t->tracks[rows[i].serial].seen) p = putVarint(p, rows[i].plate);
+    for (int i = 0; i < tick->rows; i++) *p++ = rows[i].roadLane;
+    for (int i = 0; i < tick->rows; i++) *p++ = rows[i].flags;
+    for (int column = 0; column < 4; column++) {
+        for (int i = 0; i < tick->rows; i++) {
+            const float* values = &rows[i].animPos;
+            TrajectoryTrack* track = &t->tracks[rows[i].serial];
+            int32_t value = (int32_t)lrintf(values[column] * TRAJECTORY_SCALE);
+            p = putVarint(p, zigzag((int64_t)value - (track->seen ? track->value[column] : 0)));
+            track->value[column] = value;
+        }
+    }
+    for (int i = 0; i < tick->rows; i++) t->tracks[rows[i].serial].seen = true;
+    t->lastTimeMs = tick->timeMs;
+
+    size_t length = p - block;
+    if (t->outUsed + length + 10 > TRAJECTORY_WRITE_BYTES) trajectoryFlush();
+    t->outUsed = putVarint(t->out + t->outUsed, length) - t->out;
+    memcpy(t->out + t->outUsed, block, length);
+    t->outUsed += length;
+}
+
+void* writeTrajectory(void* arg) {
+    (void)arg;
+    TrajectoryExport* t = &trajectory;
+    traceRegisterThread("trajectory");
+    int index;
+    while ((index = handoffNext(&t->chunks)) >= 0) {
+        uint64_t startUs = getTimeUs();
+        {
+            TRACE_SCOPE("encodeTrajectory");
+            const TrajectoryChunk* chunk = t->pool[index];
+            const TrajectoryRow* rows = chunk->rows;
+            for (int i = 0; i < chunk->tickCount; i++) {
+                encodeTrajectoryTick(&chunk->ticks[i], rows);
+                rows += chunk->ticks[i].rows;
+            }
+        }
+        t->encodeUs += getTimeUs() - startUs;
+        handoffRelease(&t->chunks, index);
+    }
+    trajectoryFlush();
+    return NULL;
+}
+
+bool startTrajectory(const char* path) {
+    TrajectoryExport* t = &trajectory;
+    t->file = fopen(path, "wb");
+    if (!t->file) {
+        perror("Error opening trajectory file");
+        return false;
+    }
+    fwrite(TRAJECTORY_MAGIC, 1, strlen(TRAJECTORY_MAGIC), t->file);
+    t->out = malloc(TRAJECTORY_WRITE_BYTES);
+    for (int i = 0; i < TRAJECTORY_CHUNKS; i++)
+        t->pool[i] = malloc(sizeof(TrajectoryChunk));
+    handoffInit(&t->chunks, TRAJECTORY_CHUNKS);
+    pthread_create(&t->writer, NULL, writeTrajectory, NULL);
+    return true;
+}
+
+// Hands the chunk being filled to the writer.
+void trajectorySubmit() {
+    TrajectoryExport* t = &trajectory;
+    if (t->current < 0) return;
+    handoffSubmit(&t->chunks, t->current);
+    t->current = -1;
+}
+
+// A free chunk to fill. Headless runs have no frame rate to keep, so they wait
+// for the writer rather than lose ticks; windowed runs drop the tick instead.
+bool trajectoryTakeChunk() {
+    TrajectoryExport* t = &trajectory;
+    t->current = handoffTake(&t->chunks, simConfig.headless);
+    if (t->current < 0) return false;
+    t->pool[t->current]->tickCount = 0;
+    t->pool[t->current]->rowCount = 0;
+    return true;
+}
+
+void recordTrajectory(SharedData* sharedData) {
+    TRACE_SCOPE("recordTrajectory");
+    TrajectoryExport* t = &trajectory;
+    if (t->current >= 0) {
+        TrajectoryChunk* chunk = t->pool[t->current];
+        if (chunk->tickCount == TRAJECTORY_CHUNK_TICKS ||
+            chunk->rowCount + SNAPSHOT_MAX_VEHICLES > TRAJECTORY_CHUNK_ROWS)
+            trajectorySubmit();
+    }
+    if (t->current < 0 && !trajectoryTakeChunk()) {
+        t->droppedTicks++;
+        return;
+    }
+    TrajectoryChunk* chunk = t->pool[t->current];
+    TrajectoryTick* tick = &chunk->ticks[chunk->tickCount++];
+    tick->timeMs = getSimTimeMs();
+    tick->greenMask = (uint8_t)readSignal(&sharedData->current).greenMask;
+    tick->rows = 0;
+    VehicleQueue* queues[NUM_ROADS] = { queueA, queueB, queueC, queueD };
+    for (int r = 0; r < NUM_ROADS; r++) {
+        VehicleQueue* queue = queues[r];
+        lockQueue(queue, LOCK_SITE_TRAJECTORY);
+        for (int i = 0; i < queue->size; i++) {
+            const Vehicle* v = queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+            TrajectoryRow* row = &chunk->rows[chunk->rowCount++];
+            row->plate = v->plate;
+            row->serial = v->serial;
+            row->roadLane = (uint8_t)((v->lane - 'A') << 2 | v->lane_number);
+            row->flags = (v->turning ? TRAJECTORY_TURNING : 0) | (v->isEmergency ? TRAJECTORY_EMERGENCY : 0);
+            row->animPos = v->animPos;
+            row->turnPosX = v->turnPosX;
+            row->turnPosY = v->turnPosY;
+            row->angle = v->angle;
+        }
+        tick->rows += queue->size;
+        unlockQueue(queue);
+    }
+    t->ticks++;
+    t->rows += tick->rows;
+}
+
+// Drains the pool, stops the writer and prints what was exported.
+void finishTrajectory() {
+    TrajectoryExport* t = &trajectory;
+    trajectorySubmit();
+    handoffStop(&t->chunks);
+    pthread_join(t->writer, NULL);
+    uint64_t bytes = t->bytesWritten + strlen(TRAJECTORY_MAGIC);
+    if (fclose(t->file) != 0) perror("Error writing trajectory");
+    t->file = NULL;
+
+    printf("\n=== Trajectory export (%s) ===\n", simConfig.trajectoryPath);
+    printf("Ticks: %llu, vehicle rows: %llu, %.1f MB (%.2f bytes per row)\n",
+           (unsigned long long)t->ticks, (unsigned long long)t->rows, bytes / 1e6,
+           t->rows ? (double)bytes / t->rows : 0.0);
+    printf("Writer: %.2f s encoding (%.1f M rows/s)\n", t->encodeUs / 1e6,
+           t->encodeUs ? t->rows / (double)t->encodeUs : 0.0);
+    if (t->chunks.stalls) printf("Simulation waited for the writer %llu times, %.2f s in all\n",
+                                 (unsigned long long)t->chunks.stalls, t->chunks.stallUs / 1e6);
+    if (t->droppedTicks) printf("Ticks dropped (writer behind): %llu\n", (unsigned long long)t->droppedTicks);
+    for (int i = 0; i < TRAJECTORY_CHUNKS; i++) free(t->pool[i]);
+    free(t->out);
+    free(t->tracks);
+}
+
+static bool getVarint(const uint8_t** p, const uint8_t* end, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// --trajectory-dump: one CSV line per vehicle per tick.
+bool dumpTrajectory(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror("Error opening trajectory file");
+        return false;
+    }
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, TRAJECTORY_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a trajectory file\n", path);
+        fclose(file);
+        return false;
+    }
+    static char outBuffer[1 << 20];
+    setvbuf(stdout, outBuffer, _IOFBF, sizeof(outBuffer));
+    printf("time_ms,green_mask,vehicle,plate,road,lane,anim_pos,turn_x,turn_y,angle,turning,emergency\n");
+
+    TrajectoryExport* t = &trajectory;  // reuses the writer's per-vehicle tracks
+    static uint8_t block[TRAJECTORY_MAX_BLOCK];
+    static uint32_t serials[SNAPSHOT_MAX_VEHICLES];
+    static PlateKey plates[SNAPSHOT_MAX_VEHICLES];
+    PlateKey* plateBySerial = NULL;
+    size_t plateCapacity = 0;
+    Uint32 timeMs = 0;
+    bool ok = true;
+    uint64_t blocks = 0;
+    while (true) {
+        uint64_t length = 0;
+        int c, shift = 0;
+        while ((c = fgetc(file)) != EOF) {
+            length |= (uint64_t)(c & 0x7f) << shift;
+            shift += 7;
+            if (!(c & 0x80)) break;
+        }
+        if (c == EOF) {
+            ok = shift == 0;
+            break;
+        }
+        if (length > sizeof(block) || fread(block, 1, length, file) != length) {
+            ok = false;
+            break;
+        }
+        const uint8_t* p = block;
+        const uint8_t* end = block + length;
+        uint64_t delta, rows, newCount, v;
+        if (!getVarint(&p, end, &delta) || p >= end) {
+            ok = false;
+            break;
+        }
+        timeMs += (Uint32)delta;
+        uint8_t greenMask = *p++;
+        if (!getVarint(&p, end, &rows) || !getVarint(&p, end, &newCount) || rows > SNAPSHOT_MAX_VEHICLES) {
+            ok = false;
+            break;
+        }
+        uint32_t previous = 0;
+        for (uint64_t i = 0; i < rows && ok; i++) {
+            ok = getVarint(&p, end, &v);
+            serials[i] = previous = (uint32_t)(previous + unzigzag(v));
+        }
+        for (uint64_t i = 0; i < rows && ok; i++) {
+            TrajectoryTrack* track = serials[i] < TRAJECTORY_MAX_SERIAL ? trajectoryTrack(serials[i]) : NULL;
+            if (!track) {
+                ok = false;
+                break;
+            }
+            if (serials[i] >= plateCapacity) {
+                PlateKey* grown = realloc(plateBySerial, t->trackCapacity * sizeof(PlateKey));
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                plateBySerial = grown;
+                plateCapacity = t->trackCapacity;
+            }
+            if (!track->seen) {
+                ok = getVarint(&p, end, &v);
+                plateBySerial[serials[i]] = v;
+            }
+            plates[i] = plateBySerial[serials[i]];
+        }
+        if (!ok || end - p < (ptrdiff_t)(2 * rows)) {
+            ok = false;
+            break;
+        }
+        const uint8_t* roadLanes = p;
+        const uint8_t* flags = p + rows;
+        p += 2 * rows;
+        for (int column = 0; column < 4 && ok; column++) {
+            for (uint64_t i = 0; i < rows && ok; i++) {
+                TrajectoryTrack* track = &t->tracks[serials[i]];
+                ok = getVarint(&p, end, &v);
+                track->value[column] = (int32_t)((track->seen ? track->value[column] : 0) + unzigzag(v));
+            }
+        }
+        if (!ok) break;
+        for (uint64_t i = 0; i < rows; i++) {
+            TrajectoryTrack* track = &t->tracks[serials[i]];
+            track->seen = true;
+            printf("%u,%u,%u,%s,%c,%d,%.3f,%.3f,%.3f,%.3f,%d,%d\n", timeMs, greenMask, serials[i],
+                   plateText(plates[i]).text, 'A' + (roadLanes[i] >> 2), roadLanes[i] & 3,
+                   track->value[0] / TRAJECTORY_SCALE, track->value[1] / TRAJECTORY_SCALE,
+                   track->value[2] / TRAJECTORY_SCALE, track->value[3] / TRAJECTORY_SCALE,
+                   (flags[i] & TRAJECTORY_TURNING) != 0, (flags[i] & TRAJECTORY_EMERGENCY) != 0);
+        }
+        blocks++;
+    }
+    fflush(stdout);
+    if (!ok) fprintf(stderr, "%s: corrupt block after %llu ticks\n", path, (unsigned long long)blocks);
+    free(plateBySerial);
+    free(t->tracks);
+    fclose(file);
+    return ok;
+}
+
+// Frame capture (--capture <dir>). Each rendered frame is read back with
+// SDL_RenderReadPixels() into an RGB buffer from a small pool and written by
+// a worker thread as dir/frame-NNNNNN.ppm, so the render loop only pays for
+// the read-back. Windowed runs capture every frame and drop one when the
+// worker is behind. Headless runs draw --capture-fps frames per simulated
+// second into an offscreen surface with the software renderer, and wait for
+// the worker instead.
+#define CAPTURE_BUFFERS 6
+
+typedef struct {
+    pthread_t writer;
+    HandoffPool buffers;
+    uint8_t* pool[CAPTURE_BUFFERS];
+    uint64_t frameNumbers[CAPTURE_BUFFERS];
+    int width, height;
+    SDL_Surface* surface;           // headless render target
+    double nextFrameMs;             // headless: sim time of the next frame
+    // render side
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t readbackUs;
+    // writer side
+    uint64_t bytesWritten;
+    uint64_t writeUs;
+    bool writeFailed;
+} FrameCapture;
+
+FrameCapture capture;
+
+void* writeCapturedFrames(void* arg) {
+    (void)arg;
+    traceRegisterThread("capture");
+    int index;
+    while ((index = handoffNext(&capture.buffers)) >= 0) {
+        TRACE_SCOPE("writeFrame");
+        uint64_t startUs = getTimeUs();
+        char path[512];
+        snprintf(path, sizeof(path), "%s/frame-%06llu.ppm", simConfig.capturePath,
+                 (unsigned long long)capture.frameNumbers[index]);
+        FILE* file = fopen(path, "wb");
+        size_t size = (size_t)capture.width * capture.height * 3;
+        if (file) {
+            fprintf(file, "P6\n%d %d\n255\n", capture.width, capture.height);
+            if (fwrite(capture.pool[index], 1, size, file) == size) capture.bytesWritten += size;
+            fclose(file);
+        } else if (!capture.writeFailed) {
+            perror("Error writing frame");
+            capture.writeFailed = true;
+        }
+        capture.writeUs += getTimeUs() - startUs;
+        handoffRelease(&capture.buffers, index);
+    }
+    return NULL;
+}
+
+// Headless: an offscreen surface and software renderer the size of the window.
+bool initializeCaptureRenderer(SDL_Renderer** renderer) {
+    if (TTF_Init() < 0) {
+        SDL_Log("SDL_ttf could not initialize! TTF_Error: %s\n", TTF_GetError());
+        return false;
+    }
+    capture.surface = SDL_CreateRGBSurfaceWithFormat(0, WINDOW_WIDTH*SCALE, WINDOW_HEIGHT*SCALE, 32,
+                                                     SDL_PIXELFORMAT_ARGB8888);
+    *renderer = capture.surface ? SDL_CreateSoftwareRenderer(capture.surface) : NULL;
+    if (!*renderer) {
+        SDL_Log("Failed to create capture renderer: %s", SDL_GetError());
+        return false;
+    }
+    SDL_RenderSetScale(*renderer, SCALE, SCALE);
+    return true;
+}
+
+bool startCapture(SDL_Renderer* renderer) {
+    DIR* dir = opendir(simConfig.capturePath);
+    if (!dir) {
+        perror("Error opening capture directory");
+        return false;
+    }
+    closedir(dir);
+    SDL_GetRendererOutputSize(renderer, &capture.width, &capture.height);
+    for (int i = 0; i < CAPTURE_BUFFERS; i++)
+        capture.pool[i] = malloc((size_t)capture.width * capture.height * 3);
+    handoffInit(&capture.buffers, CAPTURE_BUFFERS);
+    pthread_create(&capture.writer, NULL, writeCapturedFrames, NULL);
+    return true;
+}
+
+// Headless: true once per 1/--capture-fps of simulated time.
+bool captureDue() {
+    if (simClockMs < capture.nextFrameMs) return false;
+    capture.nextFrameMs += 1000.0 / simConfig.captureFps;
+    if (capture.nextFrameMs <= simClockMs) // first frame after a --seek
+        capture.nextFrameMs = simClockMs + 1000.0 / simConfig.captureFps;
+    return true;
+}
+
+// Reads back what has been drawn so far; call before SDL_RenderPresent().
+void captureFrame(SDL_Renderer* renderer) {
+    TRACE_SCOPE("captureFrame");
+    int index = handoffTake(&capture.buffers, simConfig.headless);
+    if (index < 0) {
+        capture.dropped++;
+        return;
+    }
+    uint64_t startUs = getTimeUs();
+    SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_RGB24, capture.pool[index], capture.width * 3);
+    capture.readbackUs += getTimeUs() - startUs;
+    capture.frameNumbers[index] = capture.frames++;
+    handoffSubmit(&capture.buffers, index);
+}
+
+void finishCapture() {
+    handoffStop(&capture.buffers);
+    pthread_join(capture.writer, NULL);
+    printf("\n=== Frame capture (%s) ===\n", simConfig.capturePath);
+    printf("Frames: %llu at %dx%d, %.1f MB of PPM\n", (unsigned long long)capture.frames,
+           capture.width, capture.height, capture.bytesWritten / 1e6);
+    printf("Read-back: %.2f ms per frame on the render thread, writer %.2f ms per frame\n",
+           capture.frames ? capture.readbackUs / 1000.0 / capture.frames : 0.0,
+           capture.frames ? capture.writeUs / 1000.0 / capture.frames : 0.0);
+    if (capture.dropped) printf("Frames dropped (writer behind): %llu\n", (unsigned long long)capture.dropped);
+    if (capture.buffers.stalls) printf("Waited for the writer %llu times, %.2f s in all\n",
+                                       (unsigned long long)capture.buffers.stalls, capture.buffers.stallUs / 1e6);
+    for (int i = 0; i < CAPTURE_BUFFERS; i++) free(capture.pool[i]);
+}
+
+// Performance HUD: a ring buffer of per-frame samples drawn next to the
+// Traffic Monitor panel. Toggled with 'H' (or --hud at startup).
+#define HUD_SAMPLES 120
+#define HUD_X 230
+#define HUD_Y 20
+#define HUD_WIDTH 220
+#define HUD_SPARK_HEIGHT 40
+
+typedef struct {
+    float frameMs;          // start of this frame to start of the next
+    float updateMs;
+    float drawMs;
+    int queued;             // in the queues, on screen or not
+    int drawn;              // drawn one by one, after culling and LOD
+    int culled;
+    int aggregated;         // in density bands instead (--lod)
+    int bands;
+    int allocations;
+    uint64_t ingested;      // running total, for the ingestion rate
+    Uint32 timeMs;
+} HudSample;
+
+typedef struct {
+    bool visible;
+    HudSample samples[HUD_SAMPLES];
+    int next;
+    int count;
+} PerfHud;
+
+PerfHud perfHud;
+
+// What drawVehicles() did with the vehicles of the last frame.
+typedef struct {
+    int drawn;              // drawn one by one
+    int culled;             // entirely outside the window
+    int aggregated;         // folded into density bands (--lod)
+    int bands;
+} VehicleDrawStats;
+
+int lodThreshold = LOD_DEFAULT_THRESHOLD;   // 0 = off, toggled with L
+VehicleDrawStats vehicleDrawStats;
+
+void hudRecord(const HudSample* sample) {
+    perfHud.samples[perfHud.next] = *sample;
+    perfHud.next = (perfHud.next + 1) % HUD_SAMPLES;
+    if (perfHud.count < HUD_SAMPLES) perfHud.count++;
+}
+
+// i = 0 is the oldest sample in the ring.
+const HudSample* hudSample(int i) {
+    int start = (perfHud.next - perfHud.count + HUD_SAMPLES) % HUD_SAMPLES;
+    return &perfHud.samples[(start + i) % HUD_SAMPLES];
+}
+
+// Vehicle records. One record per line, parsed in a single pass:
+//
+//   record := plate ':' road ['\r'] '\n'
+//   plate  := ["EMG"] body ["L" lane]    body: 1..PLATE_MAX_CHARS of [A-Za-z0-9-]
+//   road   := 'A' | 'B' | 'C' | 'D'
+//   lane   := '1' | '2' | '3'            (no suffix = lane 2)
+//
+// Only an "EMG" prefix marks an emergency vehicle and only a trailing L1-L3
+// picks the lane, so plates that merely contain those letters are not
+// mis-tagged. Anything else is rejected with a ParseError, never truncated.
+typedef enum {
+    PARSE_OK,
+    PARSE_EMPTY_LINE,
+    PARSE_NO_DELIMITER,
+    PARSE_EMPTY_PLATE,
+    PARSE_PLATE_TOO_LONG,
+    PARSE_BAD_PLATE_CHAR,
+    PARSE_BAD_ROAD,
+    PARSE_TRAILING_DATA,
+    PARSE_ERROR_COUNT
+} ParseError;
+
+const char* parseErrorNames[PARSE_ERROR_COUNT] = {
+    "ok", "empty line", "missing ':'", "empty plate", "plate too long",
+    "bad plate character", "bad road", "trailing data"
+};
+
+typedef struct {
+    PlateKey plate;
+    char road;
+    int laneNumber;
+    bool isEmergency;
+} ParsedVehicle;
+
+// Lines seen by parseRecordLine(), by result; only one ingestion thread runs.
+typedef struct {
+    unsigned long long lines;
+    unsigned long long results[PARSE_ERROR_COUNT];
+} ParseStats;
+
+ParseStats parseStats;
+#define MAX_REPORTED_PARSE_ERRORS 20
+
+// Inverse of plateCharset; 0 for characters a plate cannot contain.
+int plateCharCode(char c) {
+    if (c >= '0' && c <= '9') return 1 + (c - '0');
+    if (c >= 'A' && c <= 'Z') return 11 + (c - 'A');
+    if (c >= 'a' && c <= 'z') return 37 + (c - 'a');
+    return c == '-' ? 63 : 0;
+}
+
+// Packs plate text (EMG prefix, body, optional L1-L3 suffix) into a key.
+ParseError plateFromText(const char* text, size_t length, PlateKey* key) {
+    if (length == 0) return PARSE_EMPTY_PLATE;
+    PlateKey flags = 0;
+    size_t start = 0;
+    if (length > 3 && memcmp(text, "EMG", 3) == 0) {
+        flags |= PLATE_EMERGENCY_BIT;
+        start = 3;
+    }
+    if (length - start > 2 && text[length - 2] == 'L' && text[length - 1] >= '1' && text[length - 1] <= '3') {
+        flags |= (PlateKey)(text[length - 1] - '0') << PLATE_LANE_SHIFT;
+        length -= 2;
+    }
+    if (length - start > PLATE_MAX_CHARS) return PARSE_PLATE_TOO_LONG;
+    PlateKey body = 0;
+    for (size_t i = start; i < length; i++) {
+        int code = plateCharCode(text[i]);
+        if (code == 0) return PARSE_BAD_PLATE_CHAR;
+        body = (body << PLATE_CHAR_BITS) | code;
+    }
+    *key = (body << (PLATE_CHAR_BITS * (PLATE_MAX_CHARS - (length - start)))) | flags;
+    return PARSE_OK;
+}
+
+// Finds the first c in [p, end), eight bytes at a time (SWAR): XOR with c
+// zeroes the matching bytes and (v - 0x01..01) & ~v & 0x80..80 flags the
+// lowest zero byte exactly.
+const char* findByte(const char* p, const char* end, char c) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t pattern = ones * (unsigned char)c;
+    while (end - p >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= pattern;
+        uint64_t found = (v - ones) & ~v & (ones << 7);
+        if (found) return p + (__builtin_ctzll(found) >> 3);
+        p += 8;
+    }
+#endif
+    while (p < end && *p != c) p++;
+    return p < end ? p : NULL;
+}
+
+// Parses one line (without its '\n'); the line need not be NUL terminated.
+ParseError parseVehicleRecord(const char* line, size_t length, ParsedVehicle* out) {
+    if (length > 0 && line[length - 1] == '\r') length--;
+    if (length == 0) return PARSE_EMPTY_LINE;
+    size_t i = 0;
+    for (; i < length && line[i] != ':'; i++) {
+        if (i == MAX_VEHICLE_ID - 1) return PARSE_PLATE_TOO_LONG;
+        if (!plateCharCode(line[i])) return PARSE_BAD_PLATE_CHAR;
+    }
+    if (i == length) return PARSE_NO_DELIMITER;
+    ParseError plateError = plateFromText(line, i, &out->plate);
+    if (plateError != PARSE_OK) return plateError;
+    if (i + 1 == length || line[i + 1] < 'A' || line[i + 1] > 'D') return PARSE_BAD_ROAD;
+    if (i + 2 != length) return PARSE_TRAILING_DATA;
+    out->road = line[i + 1];
+    int lane = (out->plate >> PLATE_LANE_SHIFT) & 3;
+    out->laneNumber = lane ? lane : 2;
+    out->isEmergency = (out->plate & PLATE_EMERGENCY_BIT) != 0;
+    return PARSE_OK;
+}
+
+// Counts a parse result; the first few errors are printed with their source
+// and line number.
+void noteParseResult(const char* source, unsigned long long lineNumber, ParseError result,
+                     const char* line, size_t length) {
+    parseStats.lines++;
+    parseStats.results[result]++;
+    if (result == PARSE_OK || result == PARSE_EMPTY_LINE) return;
+    unsigned long long errors = parseStats.lines - parseStats.results[PARSE_OK] - parseStats.results[PARSE_EMPTY_LINE];
+    if (errors <= MAX_REPORTED_PARSE_ERRORS)
+        printf("%s:%llu: %s: \"%.*s\"%s\n", source, lineNumber, parseErrorNames[result],
+               (int)(length < 40 ? length : 40), line, length > 40 ? "..." : "");
+    if (errors == MAX_REPORTED_PARSE_ERRORS)
+        printf("Further record errors are only counted\n");
+}
+
+bool parseRecordLine(const char* source, unsigned long long lineNumber, const char* line,
+                     size_t length, ParsedVehicle* out) {
+    ParseError result = parseVehicleRecord(line, length, out);
+    noteParseResult(source, lineNumber, result, line, length);
+    return result == PARSE_OK;
+}
+
+void printParseReport() {
+    if (parseStats.lines == 0) return;
+    printf("\n=== Record parser ===\n");
+    printf("Lines: %llu, vehicles: %llu\n", parseStats.lines, parseStats.results[PARSE_OK]);
+    for (int i = PARSE_OK + 1; i < PARSE_ERROR_COUNT; i++)
+        if (parseStats.results[i] > 0)
+            printf("  %-20s %llu\n", parseErrorNames[i], parseStats.results[i]);
+    fflush(stdout);
+}
+
+// Splits a file into lines with findByte() over a large block buffer instead
+// of fgets() into a fixed line buffer. A line longer than the buffer is handed
+// out truncated once (the parser rejects it) and the rest of it is skipped.
+#define LINE_READER_BUFFER 65536
+
+typedef struct {
+    FILE* file;
+    char* buffer;
+    size_t start, end;
+    bool eof;
+    bool skipping;              // dropping the tail of an over-long line
+    unsigned long long lineNumber;
+} LineReader;
+
+void initLineReader(LineReader* reader, FILE* file) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    reader->buffer = malloc(LINE_READER_BUFFER);
+}
+
+void freeLineReader(LineReader* reader) {
+    free(reader->buffer);
+}
+
+bool readLine(LineReader* reader, const char** line, size_t* length) {
+    while (true) {
+        char* start = reader->buffer + reader->start;
+        char* end = reader->buffer + reader->end;
+        const char* newline = findByte(start, end, '\n');
+        if (reader->skipping) {
+            reader->start = newline ? (size_t)(newline - reader->buffer) + 1 : reader->end;
+            reader->skipping = newline == NULL;
+            if (newline) continue;
+        } else if (newline) {
+            *line = start;
+            *length = newline - start;
+            reader->start = newline - reader->buffer + 1;
+            reader->lineNumber++;
+            return true;
+        } else if (reader->eof || (reader->start == 0 && reader->end == LINE_READER_BUFFER)) {
+            if (start == end) return false;
+            *line = start;
+            *length = end - start;
+            reader->skipping = !reader->eof;
+            reader->start = reader->end;
+            reader->lineNumber++;
+            return true;
+        }
+        if (reader->eof) return false;
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        size_t n = fread(reader->buffer + reader->end, 1, LINE_READER_BUFFER - reader->end, reader->file);
+        if (n == 0) reader->eof = true;
+        reader->end += n;
+    }
+}
+
+// --dedup-window <ms>: the same plate arriving again within the window after
+// it was admitted is a re-ingest (the file read twice, a sensor repeating
+// itself), not a new vehicle. Admitted plates live in an open-addressing hash
+// set of PlateKeys with linear probing. Entries are
+// not deleted; an entry older than the window counts as expired, is reused by
+// the next insert that probes past it, and is dropped when the table is
+// rebuilt at half load. Only the ingestion thread touches the set.
+#define DEDUP_INITIAL_CAPACITY 1024
+
 typedef struct {
-    char id[MAX_VEHICLE_ID];
-    char lane;              // A/B/C/D
-    int arrivalTime;
-    bool isEmergency;
-    int lane_number;        // 1 for left, 2 for middle, 3 for right
-    float animPos;          // field for animation
-    bool turning;           // new: indicates if a turn is in progress
-    float turnProgress;     // new: progress value from 0.0 to 1.0 for a turn
-    float turnPosX;         // New fields for turning animation positions (x and y)
-    float turnPosY;
-    float angle;
-    float targetAngle;
-} Vehicle;
+    PlateKey key;               // 0 = empty slot
+    Uint32 admittedMs;
+} DedupEntry;
 
-// Queue structure
 typedef struct {
-    Vehicle* vehicles[MAX_QUEUE_SIZE];
-    int front;
-    int rear;
-    int size;
-    pthread_mutex_t lock;
-} VehicleQueue;
+    DedupEntry* entries;
+    size_t capacity;            // power of two
+    size_t used;                // non-empty slots, expired ones included
+} DedupSet;
 
-// global queue variables
-VehicleQueue* queueA;
-VehicleQueue* queueB;
-VehicleQueue* queueC;
-VehicleQueue* queueD;
+DedupSet dedupSet;
+atomic_ullong duplicatesSuppressed;
+unsigned long long dedupRebuilds;
 
-// queue operations:
-VehicleQueue* createQueue() {
-    VehicleQueue* queue = (VehicleQueue*)malloc(sizeof(VehicleQueue));
-    queue->front = 0;
-    queue->rear = -1;
-    queue->size = 0;
-    pthread_mutex_init(&queue->lock, NULL);
-    return queue;
+// Plates share long prefixes, so spread the key before masking (Fibonacci hashing).
+size_t dedupSlot(PlateKey key, size_t capacity) {
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    return (hash ^ (hash >> 32)) & (capacity - 1);
 }
 
-bool isQueueFull(VehicleQueue* queue) {
-    return queue->size >= MAX_QUEUE_SIZE;
+bool dedupExpired(const DedupEntry* entry, Uint32 now) {
+    return now - entry->admittedMs >= simConfig.dedupWindowMs;
 }
 
-bool isQueueEmpty(VehicleQueue* queue) {
-    return queue->size == 0;
+// Rehashes the live entries into a table sized for them.
+void dedupRebuild(Uint32 now) {
+    size_t live = 0;
+    for (size_t i = 0; i < dedupSet.capacity; i++)
+        if (dedupSet.entries[i].key && !dedupExpired(&dedupSet.entries[i], now)) live++;
+    size_t capacity = DEDUP_INITIAL_CAPACITY;
+    while (capacity < live * 4) capacity *= 2;
+    DedupEntry* entries = calloc(capacity, sizeof(DedupEntry));
+    for (size_t i = 0; i < dedupSet.capacity; i++) {
+        DedupEntry* entry = &dedupSet.entries[i];
+        if (!entry->key || dedupExpired(entry, now)) continue;
+        size_t slot = dedupSlot(entry->key, capacity);
+        while (entries[slot].key) slot = (slot + 1) & (capacity - 1);
+        entries[slot] = *entry;
+    }
+    free(dedupSet.entries);
+    dedupSet.entries = entries;
+    dedupSet.capacity = capacity;
+    dedupSet.used = live;
+    dedupRebuilds++;
 }
 
-void enqueue(VehicleQueue* queue, Vehicle* vehicle) {
-    pthread_mutex_lock(&queue->lock);
-    if (!isQueueFull(queue)) {
-        queue->rear = (queue->rear + 1) % MAX_QUEUE_SIZE;
-        queue->vehicles[queue->rear] = vehicle;
-        queue->size++;
-        printf("Enqueued vehicle %s to lane %c (size: %d)\n", 
-               vehicle->id, vehicle->lane, queue->size);
-    } else {
-        printf("Queue for lane %c is full!\n", vehicle->lane);
+// True if the plate is a new vehicle (and records it), false for a duplicate.
+bool admitPlate(PlateKey key) {
+    if (simConfig.dedupWindowMs == 0) return true;
+    Uint32 now = getSimTimeMs();
+    if (!dedupSet.entries || dedupSet.used * 2 >= dedupSet.capacity) dedupRebuild(now);
+    size_t mask = dedupSet.capacity - 1;
+    DedupEntry* reusable = NULL;
+    for (size_t slot = dedupSlot(key, dedupSet.capacity);; slot = (slot + 1) & mask) {
+        DedupEntry* entry = &dedupSet.entries[slot];
+        if (entry->key == key) {
+            if (!dedupExpired(entry, now)) {
+                atomic_fetch_add_explicit(&duplicatesSuppressed, 1, memory_order_relaxed);
+                return false;
+            }
+            entry->admittedMs = now;
+            return true;
+        }
+        if (!entry->key) {
+            if (!reusable) {
+                reusable = entry;
+                dedupSet.used++;
+            }
+            break;
+        }
+        if (!reusable && dedupExpired(entry, now)) reusable = entry;
     }
-    pthread_mutex_unlock(&queue->lock);
+    reusable->key = key;
+    reusable->admittedMs = now;
+    return true;
 }
 
-Vehicle* dequeue(VehicleQueue* queue) {
-    pthread_mutex_lock(&queue->lock);
-    Vehicle* vehicle = NULL;
-    if (!isQueueEmpty(queue)) {
-        vehicle = queue->vehicles[queue->front];
-        queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
-        queue->size--;
-        printf("Dequeued vehicle %s from lane %c (size: %d)\n", 
-               vehicle->id, vehicle->lane, queue->size);
-    }
-    pthread_mutex_unlock(&queue->lock);
-    return vehicle;
+void printDedupReport() {
+    if (simConfig.dedupWindowMs == 0) return;
+    printf("\n=== Plate dedup (window %u ms) ===\n", simConfig.dedupWindowMs);
+    printf("Duplicates suppressed: %llu\n", (unsigned long long)atomic_load(&duplicatesSuppressed));
+    printf("Hash set: %zu slots, %zu used, %llu rebuilds\n", dedupSet.capacity, dedupSet.used, dedupRebuilds);
+    fflush(stdout);
 }
 
-// Added unlocked dequeue version (assumes lock is held)
-Vehicle* dequeueUnlocked(VehicleQueue* queue) {
-    Vehicle* vehicle = NULL;
-    if (!isQueueEmpty(queue)) {
-        vehicle = queue->vehicles[queue->front];
-        queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
-        queue->size--;
-        printf("Dequeued vehicle %s from lane %c (size: %d) [unlocked]\n", 
-               vehicle->id, vehicle->lane, queue->size);
-    }
-    return vehicle;
+// --parse-bench <n>: builds n records in memory, a quarter of them fuzzed
+// (bytes replaced, dropped, duplicated, truncated or padded), times the
+// splitter + parser over the whole buffer and then checks every unfuzzed
+// record parsed back to what was generated, plate text included. Returns the process exit code.
+uint64_t benchRandomState = 0x9E3779B97F4A7C15ull;
+
+uint64_t benchRandom() {
+    benchRandomState ^= benchRandomState >> 12;
+    benchRandomState ^= benchRandomState << 25;
+    benchRandomState ^= benchRandomState >> 27;
+    return benchRandomState * 0x2545F4914F6CDD1Dull;
 }
 
-// queue cleanup
-void cleanupQueue(VehicleQueue* queue) {
-    pthread_mutex_lock(&queue->lock);
-    for (int i = 0; i < queue->size; i++) {
-        int idx = (queue->front + i) % MAX_QUEUE_SIZE;
-        free(queue->vehicles[idx]);
+typedef struct {
+    bool fuzzed;
+    bool isEmergency;
+    char road;
+    char laneNumber;
+} BenchExpectation;
+
+int runParseBench(long long count) {
+    const char* plateChars = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    size_t capacity = count * 64 + 64;
+    char* corpus = malloc(capacity);
+    BenchExpectation* expected = malloc(count * sizeof(BenchExpectation));
+    if (!corpus || !expected) {
+        printf("Not enough memory for %lld records\n", count);
+        return 1;
     }
-    pthread_mutex_unlock(&queue->lock);
-    pthread_mutex_destroy(&queue->lock);
-    free(queue);
-}
+    size_t size = 0;
+    for (long long i = 0; i < count; i++) {
+        char record[64];
+        int n = 0;
+        BenchExpectation* e = &expected[i];
+        e->isEmergency = benchRandom() % 20 == 0;
+        if (e->isEmergency) n += sprintf(record, "EMG");
+        // traffic_generator's AA0AA000 shape, which cannot be read as EMG or L1-L3
+        for (int j = 0; j < 8; j++)
+            record[n++] = (j == 2 || j >= 5) ? '0' + benchRandom() % 10 : 'A' + benchRandom() % 26;
+        uint64_t lane = benchRandom() % 4; // 0 = no suffix
+        e->laneNumber = lane == 0 ? 2 : (char)lane;
+        if (lane != 0) n += sprintf(record + n, "L%d", (int)lane);
+        e->road = 'A' + benchRandom() % 4;
+        n += sprintf(record + n, ":%c", e->road);
+        if (benchRandom() % 10 == 0) record[n++] = '\r';
 
-// Function to get queue size
-int getQueueSize(VehicleQueue *queue) {
-    return queue->size;
+        e->fuzzed = benchRandom() % 4 == 0;
+        if (e->fuzzed) {
+            int at = benchRandom() % n;
+            char junk = (char)(1 + benchRandom() % 255);
+            if (junk == '\n') junk = ' ';
+            switch (benchRandom() % 5) {
+                case 0: record[at] = junk; break;
+                case 1: memmove(record + at, record + at + 1, n - at - 1); n--; break;
+                case 2: memmove(record + at + 1, record + at, n - at); n++; break;
+                case 3: n = at; break;
+                default:
+                    while (n < 60) record[n++] = plateChars[benchRandom() % 36];
+            }
+        }
+        memcpy(corpus + size, record, n);
+        size += n;
+        corpus[size++] = '\n';
+    }
+
+    ParseStats stats = { 0 };
+    ParsedVehicle parsed;
+    unsigned long long checksum = 0;
+    uint64_t startUs = getTimeUs();
+    const char* p = corpus;
+    const char* end = corpus + size;
+    const char* newline;
+    while ((newline = findByte(p, end, '\n'))) {
+        ParseError result = parseVehicleRecord(p, newline - p, &parsed);
+        stats.lines++;
+        stats.results[result]++;
+        if (result == PARSE_OK) checksum += parsed.road + parsed.laneNumber;
+        p = newline + 1;
+    }
+    double seconds = (getTimeUs() - startUs) / 1e6;
+
+    unsigned long long mismatches = 0;
+    p = corpus;
+    for (long long i = 0; i < count; i++) {
+        newline = findByte(p, end, '\n');
+        ParseError result = parseVehicleRecord(p, newline - p, &parsed);
+        const BenchExpectation* e = &expected[i];
+        if (result == PARSE_OK) {
+            bool sane = parsed.plate != 0 && parsed.road >= 'A' && parsed.road <= 'D' &&
+                        parsed.laneNumber >= 1 && parsed.laneNumber <= 3;
+            if (!sane || (!e->fuzzed && (parsed.road != e->road || parsed.laneNumber != e->laneNumber ||
+                                         parsed.isEmergency != e->isEmergency)))
+                mismatches++;
+            // the packed plate must rebuild the exact text before ':'
+            PlateText text = plateText(parsed.plate);
+            size_t plateLength = strlen(text.text);
+            if (!e->fuzzed && (memcmp(text.text, p, plateLength) != 0 || p[plateLength] != ':'))
+                mismatches++;
+        } else if (!e->fuzzed) {
+            mismatches++;
+        }
+        p = newline + 1;
+    }
+
+    printf("Parsed %llu lines (%.1f MB) in %.3f s: %.1f M lines/s, %.0f MB/s (checksum %llu)\n",
+           stats.lines, size / 1e6, seconds, seconds > 0 ? stats.lines / seconds / 1e6 : 0.0,
+           seconds > 0 ? size / seconds / 1e6 : 0.0, checksum);
+    for (int i = 0; i < PARSE_ERROR_COUNT; i++)
+        if (stats.results[i] > 0)
+            printf("  %-20s %llu\n", parseErrorNames[i], stats.results[i]);
+    printf("Unfuzzed records parsed wrongly: %llu\n", mismatches);
+    free(corpus);
+    free(expected);
+    return mismatches == 0 ? 0 : 1;
 }
 
 // Function declarations
 bool initializeSDL(SDL_Window **window, SDL_Renderer **renderer);
 void drawRoadsAndLane(SDL_Renderer *renderer, TTF_Font *font);
 void displayText(SDL_Renderer *renderer, TTF_Font *font, const char *text, int x, int y);
-void drawLightForB(SDL_Renderer* renderer, bool isRed);
-void drawLightForA(SDL_Renderer* renderer, bool isRed);
-void drawLightForC(SDL_Renderer* renderer, bool isRed);
-void drawLightForD(SDL_Renderer* renderer, bool isRed);
-void refreshLight(SDL_Renderer *renderer, SharedData* sharedData);
+void drawLightForB(SDL_Renderer* renderer, LightColour colour);
+void drawLightForA(SDL_Renderer* renderer, LightColour colour);
+void drawLightForC(SDL_Renderer* renderer, LightColour colour);
+void drawLightForD(SDL_Renderer* renderer, LightColour colour);
+void drawLights(SDL_Renderer *renderer, const SignalState* signal);
+void initSignals(SharedData* sharedData);
+void advanceLight(SharedData* sharedData);
 void* chequeQueue(void* arg);
+void* runSignalPlan(void* arg);
+void* runMaxPressure(void* arg);
+void printControllerSummary();
+void printPredictionReport();
+bool loadSignalPlan(const char* path);
+void printPlanReport();
 void* readAndParseFile(void* arg);
-void drawVehicle(SDL_Renderer *renderer, TTF_Font *font, Vehicle *v, int pos);
-void drawVehiclesFromQueue(SDL_Renderer *renderer, TTF_Font *font, VehicleQueue *queue);
-void drawVehicles(SDL_Renderer *renderer, TTF_Font *font);
+void drawVehicle(SDL_Renderer *renderer, TTF_Font *font, const Vehicle *v);
+void drawVehicles(SDL_Renderer *renderer, TTF_Font *font, const RenderSnapshot* snapshot);
 void updateVehicles(SharedData* sharedData);
 void* processVehiclesSequentially(void* arg);
-void drawUI(SDL_Renderer *renderer, SharedData* sharedData);
+bool ingestNextLine(LineReader* reader, bool* valid);
+void drawUI(SDL_Renderer *renderer, const RenderSnapshot* snapshot);
+void simulationTick(SharedData* sharedData);
+void* runSimulation(void* arg);
+bool startLockstep(SharedData* sharedData);
+void seekLockstep(SharedData* sharedData);
+void writeCheckpoint(SharedData* sharedData);
+void checkpointIfDue(SharedData* sharedData);
+bool restoreNearestCheckpoint(SharedData* sharedData, Uint32 targetMs);
+void resumeRestoredController();
+bool startTrajectory(const char* path);
+void recordTrajectory(SharedData* sharedData);
+void finishTrajectory();
+bool dumpTrajectory(const char* path);
+void drawFrame(SDL_Renderer *renderer, TTF_Font *font, const RenderSnapshot* snapshot);
+void lockstepTick(SharedData* sharedData);
+bool lockstepFinished();
+void lockstepCatchUp(SharedData* sharedData);
+void printLockstepReport(SharedData* sharedData);
 void drawLaneCongestion(SDL_Renderer *renderer, int x, int y, int numVehicles, char lane);
 void rotateVehicle(Vehicle* vehicle, Uint32 delta);
+void displayDynamicText(SDL_Renderer *renderer, TTF_Font *font, const char *text, int x, int y);
+void trackStopLine(Vehicle* v, Uint32 now);
+void retireVehicle(Vehicle* v, Uint32 now);
+void printDelayReport();
+void printConflictReport();
+void initReservations();
+void buildMovementPaths();
+bool movementsConflict(int a, int b);
+void printReservationReport();
+void drawPerfHud(SDL_Renderer *renderer);
+void printDedupReport();
+void preemptionPhaseChange(const SignalState* current, const SignalState* requested, Uint32 now);
+void recordPreemptionLatency(int road);
+void printPreemptionReport();
+Vehicle* createVehicle(PlateKey plate, char road, int laneNumber, bool isEmergency);
+VehicleQueue* queueForRoad(char road);
+void* consumeVehicleRing(void* arg);
+void printRingReport();
+void* serveIngestionSocket(void* arg);
+void printProducerReport();
+void* mergeFeeds(void* arg);
+void printMergeReport();
 
 void printMessageHelper(const char* message, int count) {
     for (int i = 0; i < count; i++) printf("%s\n", message);
 }
 
+void printUsage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --throughput-csv <file>   write per-phase stop-line throughput as CSV\n");
+    printf("  --trace <file>            write a Chrome/Perfetto trace-event JSON file\n");
+    printf("  --lock-profile            time queue lock waits and holds per call site\n");
+    printf("  --hud                     show the performance overlay (toggle with H)\n");
+    printf("  --shm <name>              read vehicles from traffic_generator --shm <name>\n");
+    printf("  --listen <path>           accept vehicle producers on a Unix domain socket\n");
+    printf("  --merge <feed>...         replay timestamped text/binary feeds merged by time\n");
+    printf("  --replay-speed <x>        feed seconds per second for --merge (0 = unpaced)\n");
+    printf("  --parse-bench <n>         fuzz and time the record parser on n lines, then exit\n");
+    printf("  --dedup-window <ms>       drop a plate seen again within ms of its admission\n");
+    printf("  --sim-thread              simulate on its own thread, render from snapshots\n");
+    printf("  --tick-hz <n>             simulation ticks per second with --sim-thread or\n");
+    printf("                            --deterministic (240)\n");
+    printf("  --deterministic           fixed-tick lockstep: same input, same result\n");
+    printf("  --headless                deterministic without a window, as fast as possible\n");
+    printf("  --state-hash <n>          print a rolling state hash every n deterministic ticks\n");
+    printf("  --ticks <n>               stop a deterministic run after n ticks\n");
+    printf("  --checkpoint-dir <dir>    save deterministic checkpoints there (and seek from them)\n");
+    printf("  --checkpoint-every <s>    simulated seconds between checkpoints (60)\n");
+    printf("  --seek <s>                restore the nearest checkpoint, fast-forward to s seconds\n");
+    printf("  --trajectory <file>       stream every vehicle's position per tick (binary, columnar)\n");
+    printf("  --trajectory-dump <file>  decode a --trajectory file to CSV on stdout, then exit\n");
+    printf("  --capture <dir>           write each rendered frame to dir/frame-NNNNNN.ppm\n");
+    printf("  --capture-fps <n>         headless capture: frames per simulated second (30)\n");
+    printf("  --lod <n>                 draw approaches with over n queued vehicles as bands (20, 0 = off)\n");
+    printf("  --reservations            let lane 2 cross on junction tile reservations\n");
+    printf("  --controller <name>       signal controller: heuristic (default), plan, pressure\n");
+    printf("                            or predictive\n");
+    printf("  --plan <file>             stages for --controller plan/pressure (implies plan)\n");
+    printf("  --compare <file>          append served veh/h and delay to file, print all runs\n");
+}
+
+bool parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--throughput-csv") == 0 && i + 1 < argc) {
+            simConfig.throughputCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            simConfig.tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--lock-profile") == 0) {
+            simConfig.lockProfile = true;
+        } else if (strcmp(argv[i], "--hud") == 0) {
+            simConfig.showHud = true;
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            simConfig.shmName = argv[++i];
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            simConfig.listenPath = argv[++i];
+        } else if (strcmp(argv[i], "--merge") == 0 && i + 1 < argc) {
+            simConfig.mergePaths = &argv[i + 1];
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                simConfig.mergeCount++;
+                i++;
+            }
+        } else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) {
+            simConfig.replaySpeed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--parse-bench") == 0 && i + 1 < argc) {
+            simConfig.parseBench = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--dedup-window") == 0 && i + 1 < argc) {
+            simConfig.dedupWindowMs = (Uint32)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-thread") == 0) {
+            simConfig.simThread = true;
+        } else if (strcmp(argv[i], "--reservations") == 0) {
+            simConfig.reservations = true;
+        } else if (strcmp(argv[i], "--controller") == 0 && i + 1 < argc) {
+            int c = 0;
+            while (c < CONTROLLER_COUNT && strcmp(argv[i + 1], controllerNames[c]) != 0) c++;
+            if (c == CONTROLLER_COUNT) {
+                fprintf(stderr, "Unknown controller: %s\n", argv[i + 1]);
+                return false;
+            }
+            simConfig.controller = (ControllerPolicy)c;
+            i++;
+        } else if (strcmp(argv[i], "--plan") == 0 && i + 1 < argc) {
+            simConfig.planPath = argv[++i];
+            if (simConfig.controller == CONTROLLER_HEURISTIC)
+                simConfig.controller = CONTROLLER_PLAN;
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            simConfig.comparePath = argv[++i];
+        } else if (strcmp(argv[i], "--tick-hz") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            simConfig.tickHz = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--deterministic") == 0) {
+            simConfig.deterministic = true;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            simConfig.headless = simConfig.deterministic = true;
+        } else if (strcmp(argv[i], "--state-hash") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            simConfig.hashEvery = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc && atoll(argv[i + 1]) > 0) {
+            simConfig.maxTicks = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint-dir") == 0 && i + 1 < argc) {
+            simConfig.checkpointDir = argv[++i];
+            simConfig.deterministic = true;
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            simConfig.checkpointEveryMs = (Uint32)(atof(argv[++i]) * 1000);
+        } else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc && atof(argv[i + 1]) >= 0) {
+            simConfig.seekMs = (long long)(atof(argv[++i]) * 1000);
+            simConfig.deterministic = true;
+        } else if (strcmp(argv[i], "--trajectory") == 0 && i + 1 < argc) {
+            simConfig.trajectoryPath = argv[++i];
+        } else if (strcmp(argv[i], "--trajectory-dump") == 0 && i + 1 < argc) {
+            simConfig.trajectoryDumpPath = argv[++i];
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            simConfig.capturePath = argv[++i];
+        } else if (strcmp(argv[i], "--capture-fps") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            simConfig.captureFps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lod") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            simConfig.lodThreshold = atoi(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    if (simConfig.deterministic &&
+        (simConfig.simThread || simConfig.shmName || simConfig.listenPath || simConfig.mergeCount > 0)) {
+        fprintf(stderr, "--deterministic reads %s on the main thread; it can't be combined with "
+                        "--sim-thread, --shm, --listen or --merge\n", VEHICLE_FILE);
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
-    pthread_t tQueue, tReadFile;
+    pthread_t tQueue, tReadFile, tSimulation;
     SDL_Window* window = NULL;
     SDL_Renderer* renderer = NULL;    
     SDL_Event event;    
 
-    if (!initializeSDL(&window, &renderer)) {
+    if (!parseArguments(argc, argv)) {
+        return 1;
+    }
+    if (simConfig.parseBench > 0) {
+        return runParseBench(simConfig.parseBench);
+    }
+    if (simConfig.trajectoryDumpPath) {
+        return dumpTrajectory(simConfig.trajectoryDumpPath) ? 0 : 1;
+    }
+    if (simConfig.throughputCsvPath && !openThroughputCsv(simConfig.throughputCsvPath)) {
+        return 1;
+    }
+    if (simConfig.planPath && !loadSignalPlan(simConfig.planPath)) {
+        return 1;
+    }
+    if (simConfig.tracePath) {
+        traceEnabled = true;
+        traceStartUs = getTimeUs();
+    }
+    traceRegisterThread("main");
+    if (simConfig.trajectoryPath && !startTrajectory(simConfig.trajectoryPath)) {
+        return 1;
+    }
+
+    if (!simConfig.headless && !initializeSDL(&window, &renderer)) {
+        return -1;
+    }
+    // --headless --capture: frames are drawn offscreen
+    if (simConfig.headless && simConfig.capturePath && !initializeCaptureRenderer(&renderer)) {
         return -1;
     }
+    if (simConfig.capturePath && !startCapture(renderer)) {
+        return 1;
+    }
     SDL_mutex* mutex = SDL_CreateMutex();
-    SharedData sharedData = { 0, 0 }; // 0 => all red
+    SharedData sharedData;
+    initSignals(&sharedData); // all red
     
-    TTF_Font* font = TTF_OpenFont(MAIN_FONT, 24);
-    if (!font) SDL_Log("Failed to load font: %s", TTF_GetError());
-
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-    SDL_RenderClear(renderer);
-    drawRoadsAndLane(renderer, font);
-    drawLightForB(renderer, false);
-    SDL_RenderPresent(renderer);
+    TTF_Font* font = NULL;
+    if (renderer) {
+        font = TTF_OpenFont(MAIN_FONT, 24);
+        if (!font) SDL_Log("Failed to load font: %s", TTF_GetError());
+    }
+    if (!simConfig.headless) {
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        SDL_RenderClear(renderer);
+        drawRoadsAndLane(renderer, font);
+        drawLightForB(renderer, LIGHT_GREEN);
+        SDL_RenderPresent(renderer);
+    }
 
     // Initialize queues before creating threads
-    queueA = createQueue();
-    queueB = createQueue();
-    queueC = createQueue();
-    queueD = createQueue();
+    queueA = createQueue('A');
+    queueB = createQueue('B');
+    queueC = createQueue('C');
+    queueD = createQueue('D');
+    throughputBeginPhase(0, 0, getSimTimeMs());
+    if (simConfig.reservations)
+        initReservations();
+    if (simConfig.deterministic && !startLockstep(&sharedData))
+        return 1;
 
     // we need to create seprate long running thread for the queue processing and light
-    // pthread_create(&tLight, NULL, refreshLight, &sharedData);
-    pthread_create(&tQueue, NULL, chequeQueue, &sharedData);
-    pthread_create(&tReadFile, NULL, processVehiclesSequentially, NULL);
+    // (with --reservations lane 2 no longer follows the lights, so no controller)
+    lockstep.controllerStarted = simConfig.deterministic && !simConfig.reservations;
+    if (simConfig.reservations) {
+        // initReservations() already ran, before a checkpoint could restore the table
+    } else if (simConfig.controller == CONTROLLER_PLAN)
+        pthread_create(&tQueue, NULL, runSignalPlan, &sharedData);
+    else if (simConfig.controller == CONTROLLER_PRESSURE)
+        pthread_create(&tQueue, NULL, runMaxPressure, &sharedData);
+    else
+        pthread_create(&tQueue, NULL, chequeQueue, &sharedData);
+    if (simConfig.simThread) {
+        atomic_store(&simulationRunning, true);
+        pthread_create(&tSimulation, NULL, runSimulation, &sharedData);
+    }
+    if (simConfig.deterministic)
+        seekLockstep(&sharedData); // vehicles.data is read by lockstepTick()
+    else if (simConfig.mergeCount > 0)
+        pthread_create(&tReadFile, NULL, mergeFeeds, NULL);
+    else if (simConfig.listenPath)
+        pthread_create(&tReadFile, NULL, serveIngestionSocket, NULL);
+    else if (simConfig.shmName)
+        pthread_create(&tReadFile, NULL, consumeVehicleRing, NULL);
+    else
+        pthread_create(&tReadFile, NULL, processVehiclesSequentially, NULL);
     // readAndParseFile();
 
+    // --headless: no frames, just ticks (and offscreen frames for --capture)
+    while (simConfig.headless && !lockstepFinished()) {
+        lockstepTick(&sharedData);
+        if (simConfig.capturePath && captureDue()) {
+            publishSnapshot(&sharedData);
+            drawFrame(renderer, font, acquireSnapshot());
+            captureFrame(renderer);
+        }
+    }
+
     // Continue the UI thread
-    bool running = true;
+    bool running = !simConfig.headless;
+    perfHud.visible = simConfig.showHud;
+    lodThreshold = simConfig.lodThreshold;
+    uint64_t lastFrameUs = getTimeUs();
     while (running) {
-        while (SDL_PollEvent(&event))
+        TRACE_SCOPE("frame");
+        uint64_t frameStartUs = getTimeUs();
+        while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) running = false;
-        updateVehicles(&sharedData);  // now synced with traffic lightr animation
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        SDL_RenderClear(renderer);
-        drawRoadsAndLane(renderer, font);
-        refreshLight(renderer, &sharedData);
-        drawVehicles(renderer, font);
-        drawUI(renderer, &sharedData);
-        SDL_RenderPresent(renderer);
+            else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_h)
+                perfHud.visible = !perfHud.visible;
+            else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_l)
+                lodThreshold = lodThreshold ? 0 : (simConfig.lodThreshold ? simConfig.lodThreshold : LOD_DEFAULT_THRESHOLD);
+        }
+        if (simConfig.deterministic) {
+            lockstepCatchUp(&sharedData);
+            if (lockstepFinished()) running = false;
+        } else if (!simConfig.simThread)
+            simulationTick(&sharedData);  // now synced with traffic lightr animation
+        uint64_t updateEndUs = getTimeUs();
+        const RenderSnapshot* snapshot = acquireSnapshot();
+        drawFrame(renderer, font, snapshot);
+        uint64_t drawEndUs = getTimeUs();
+        if (simConfig.capturePath) captureFrame(renderer);
+        {
+            TRACE_SCOPE("present");
+            SDL_RenderPresent(renderer);
+        }
+
+        HudSample sample;
+        sample.frameMs = (frameStartUs - lastFrameUs) / 1000.0f;
+        sample.updateMs = simConfig.simThread ? atomic_load(&lastTickUs) / 1000.0f
+                                              : (updateEndUs - frameStartUs) / 1000.0f;
+        sample.drawMs = (drawEndUs - updateEndUs) / 1000.0f;
+        sample.queued = 0;
+        for (int road = 0; road < NUM_ROADS; road++) sample.queued += snapshot->queueSizes[road];
+        sample.drawn = vehicleDrawStats.drawn;
+        sample.culled = vehicleDrawStats.culled;
+        sample.aggregated = vehicleDrawStats.aggregated;
+        sample.bands = vehicleDrawStats.bands;
+        sample.allocations = atomic_exchange(&frameAllocations, 0);
+        sample.ingested = atomic_load(&vehiclesIngested);
+        sample.timeMs = SDL_GetTicks();
+        hudRecord(&sample);
+        lastFrameUs = frameStartUs;
+
         SDL_Delay(16); // ~60 FPS
     }
+    if (simConfig.simThread) {
+        atomic_store(&simulationRunning, false);
+        pthread_join(tSimulation, NULL); // it may be mid-update on the queues freed below
+    }
+    stopThreads(tQueue, tReadFile);
+    if (simConfig.trajectoryPath) finishTrajectory();
+    if (simConfig.capturePath) finishCapture();
+    if (simConfig.deterministic) printLockstepReport(&sharedData);
     SDL_DestroyMutex(mutex);
     if (renderer) SDL_DestroyRenderer(renderer);
+    if (capture.surface) SDL_FreeSurface(capture.surface);
     if (window) SDL_DestroyWindow(window);
     // Add cleanup before SDL_Quit
+    VehicleQueue* queues[] = { queueA, queueB, queueC, queueD };
+    printLockReport(queues, 4);
     cleanupQueue(queueA);
     cleanupQueue(queueB);
     cleanupQueue(queueC);
     cleanupQueue(queueD);
-    // pthread_kil
-    // Terminate threads before exiting
-    pthread_kill(tQueue, SIGTERM);
-    pthread_kill(tReadFile, SIGTERM);
+    printDelayReport();
+    printThroughputReport();
+    printParseReport();
+    printDedupReport();
+    printPreemptionReport();
+    printConflictReport();
+    printReservationReport();
+    printPlanReport();
+    printPredictionReport();
+    printControllerSummary();
+    if (simConfig.shmName) {
+        printRingReport();
+#ifdef __linux__
+        shm_unlink(simConfig.shmName); // unread records are dropped with the ring
+#endif
+    }
+    if (simConfig.mergeCount > 0) printMergeReport();
+    if (simConfig.listenPath) {
+        printProducerReport();
+        unlink(simConfig.listenPath);
+    }
+    if (simConfig.tracePath) traceWriteFile(simConfig.tracePath);
     return 0;
 }
 
@@ -354,13 +2800,20 @@ void drawLaneCongestion(SDL_Renderer *renderer, int x, int y, int numVehicles, c
     // Note: displayText implementation is assumed from the existing code
 }
 
+// 16pt font for the panels, opened once instead of every frame.
+TTF_Font* getSmallFont() {
+    static TTF_Font* smallFont = NULL;
+    if (!smallFont) smallFont = TTF_OpenFont(MAIN_FONT, 16);
+    return smallFont;
+}
+
 // Updated draw function to include lane congestion visualization and traffic statistics
-void drawUI(SDL_Renderer *renderer, SharedData *sharedData) {
-    TTF_Font* smallFont = TTF_OpenFont(MAIN_FONT, 16);
+void drawUI(SDL_Renderer *renderer, const RenderSnapshot* snapshot) {
+    TTF_Font* smallFont = getSmallFont();
     SDL_SetRenderDrawColor(renderer, 240, 240, 240, 200);
     
     // UI background panel
-    SDL_Rect uiPanel = {20, 20, 200, 200};
+    SDL_Rect uiPanel = {20, 20, 200, simConfig.dedupWindowMs ? 350 : 330};
     SDL_SetRenderDrawColor(renderer, 240, 240, 240, 220);
     SDL_RenderFillRect(renderer, &uiPanel);
     SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
@@ -372,14 +2825,13 @@ void drawUI(SDL_Renderer *renderer, SharedData *sharedData) {
     SDL_RenderFillRect(renderer, &titleRect);
     
     // Get queue sizes
-    int queueA_size = getQueueSize(queueA);
-    int queueB_size = getQueueSize(queueB);
-    int queueC_size = getQueueSize(queueC);
-    int queueD_size = getQueueSize(queueD);
+    int queueA_size = snapshot->queueSizes[0];
+    int queueB_size = snapshot->queueSizes[1];
+    int queueC_size = snapshot->queueSizes[2];
+    int queueD_size = snapshot->queueSizes[3];
     
     // Calculate total and average
     int totalVehicles = queueA_size + queueB_size + queueC_size + queueD_size;
-    float avgWaitingTime = 0; // This would require tracking entry/exit times
     
     // Draw congestion bars
     drawLaneCongestion(renderer, 30, 60, queueA_size, 'A');
@@ -395,22 +2847,53 @@ void drawUI(SDL_Renderer *renderer, SharedData *sharedData) {
         sprintf(statsText, "Total: %d vehicles", totalVehicles);
         displayText(renderer, smallFont, statsText, 30, 180);
         
-        // Display current active lane
-        char activeLaneText[20];
-        if (sharedData->currentLight == 1)
-            sprintf(activeLaneText, "Active: Lane A");
-        else if (sharedData->currentLight == 2)
-            sprintf(activeLaneText, "Active: Lane B");
-        else if (sharedData->currentLight == 3)
-            sprintf(activeLaneText, "Active: Lane C");
-        else if (sharedData->currentLight == 4)
-            sprintf(activeLaneText, "Active: Lane D");
-        else
+        // Display current active lanes and the time left on their green
+        char activeLaneText[48], label[24];
+        const SignalState* signal = &snapshot->signal;
+        int remainingMs = signalRemainingMs(signal, snapshot->timeMs);
+        signalLabel(signal, label, sizeof(label));
+        if (signal->greenMask == 0 && signal->amberMask == 0)
             sprintf(activeLaneText, "Active: None");
-        // This would need to be set based on the current traffic light state
-        displayText(renderer, smallFont, activeLaneText, 30, 200);
-        
-        TTF_CloseFont(smallFont);
+        else if (remainingMs >= 0)
+            snprintf(activeLaneText, sizeof(activeLaneText), "Active: %s (%ds)", label, (remainingMs + 999) / 1000);
+        else
+            snprintf(activeLaneText, sizeof(activeLaneText), "Active: %s", label);
+        displayDynamicText(renderer, smallFont, activeLaneText, 30, 200);
+
+        // Delay percentiles over all vehicles seen so far
+        char delayText[64];
+        displayText(renderer, smallFont, "p50 / p90 / p99 (s)", 30, 222);
+        snprintf(delayText, sizeof(delayText), "Wait %.1f / %.1f / %.1f",
+                 snapshot->waitMs[0] / 1000.0f, snapshot->waitMs[1] / 1000.0f, snapshot->waitMs[2] / 1000.0f);
+        displayDynamicText(renderer, smallFont, delayText, 30, 242);
+        snprintf(delayText, sizeof(delayText), "Trip %.1f / %.1f / %.1f",
+                 snapshot->tripMs[0] / 1000.0f, snapshot->tripMs[1] / 1000.0f, snapshot->tripMs[2] / 1000.0f);
+        displayDynamicText(renderer, smallFont, delayText, 30, 262);
+
+        // Measured stop-line discharge
+        char flowText[64];
+        if (snapshot->saturationFlowVph > 0.0f)
+            snprintf(flowText, sizeof(flowText), "Sat flow %.0f veh/h", snapshot->saturationFlowVph);
+        else
+            snprintf(flowText, sizeof(flowText), "Sat flow: measuring");
+        displayDynamicText(renderer, smallFont, flowText, 30, 284);
+        if (snapshot->lastUtilisation >= 0.0f) {
+            snprintf(flowText, sizeof(flowText), "Green used %.0f%%", snapshot->lastUtilisation * 100.0f);
+            displayDynamicText(renderer, smallFont, flowText, 30, 302);
+        }
+
+        // Queue lock contention over all queues and call sites
+        char lockText[64];
+        snprintf(lockText, sizeof(lockText), "Lock contention %.2f%%", snapshot->lockAcquisitions ?
+                 100.0 * snapshot->lockContended / snapshot->lockAcquisitions : 0.0);
+        displayDynamicText(renderer, smallFont, lockText, 30, 322);
+
+        if (simConfig.dedupWindowMs) {
+            char dedupText[64];
+            snprintf(dedupText, sizeof(dedupText), "Duplicates dropped %llu",
+                     (unsigned long long)atomic_load(&duplicatesSuppressed));
+            displayDynamicText(renderer, smallFont, dedupText, 30, 342);
+        }
     }
     
     // Draw real-time traffic flow indicator
@@ -441,9 +2924,76 @@ void drawUI(SDL_Renderer *renderer, SharedData *sharedData) {
     //     };
     //     SDL_RenderFillRect(renderer, &arcRect);
     // }
-    
-    // Update the renderer
-    SDL_RenderPresent(renderer);
+}
+
+void drawPerfHud(SDL_Renderer *renderer) {
+    if (!perfHud.visible || perfHud.count == 0) return;
+    TTF_Font* smallFont = getSmallFont();
+
+    float sumFrame = 0, sumUpdate = 0, sumDraw = 0, maxFrame = 0;
+    float sorted[HUD_SAMPLES];
+    for (int i = 0; i < perfHud.count; i++) {
+        const HudSample* s = hudSample(i);
+        sumFrame += s->frameMs;
+        sumUpdate += s->updateMs;
+        sumDraw += s->drawMs;
+        if (s->frameMs > maxFrame) maxFrame = s->frameMs;
+        // insertion sort, the ring is small
+        int j = i;
+        while (j > 0 && sorted[j - 1] > s->frameMs) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = s->frameMs;
+    }
+    int n = perfHud.count;
+    float p99 = sorted[(99 * n + 99) / 100 - 1];  // nearest rank, ceil(0.99 n), in integers
+    const HudSample* newest = hudSample(n - 1);
+    const HudSample* oldest = hudSample(0);
+    float seconds = (newest->timeMs - oldest->timeMs) / 1000.0f;
+    float ingestRate = seconds > 0 ? (newest->ingested - oldest->ingested) / seconds : 0;
+
+    SDL_Rect panel = {HUD_X, HUD_Y, HUD_WIDTH, 170 + HUD_SPARK_HEIGHT};
+    SDL_SetRenderDrawColor(renderer, 240, 240, 240, 220);
+    SDL_RenderFillRect(renderer, &panel);
+    SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
+    SDL_RenderDrawRect(renderer, &panel);
+
+    if (smallFont) {
+        char line[64];
+        displayText(renderer, smallFont, "Performance", HUD_X + 10, HUD_Y + 5);
+        snprintf(line, sizeof(line), "Frame %.1f ms  p99 %.1f", sumFrame / n, p99);
+        displayDynamicText(renderer, smallFont, line, HUD_X + 10, HUD_Y + 25);
+        snprintf(line, sizeof(line), "Update %.2f  Draw %.2f ms", sumUpdate / n, sumDraw / n);
+        displayDynamicText(renderer, smallFont, line, HUD_X + 10, HUD_Y + 45);
+        snprintf(line, sizeof(line), "Queued %d  drawn %d", newest->queued, newest->drawn);
+        displayDynamicText(renderer, smallFont, line, HUD_X + 10, HUD_Y + 65);
+        snprintf(line, sizeof(line), "Culled %d  %d in %d bands", newest->culled, newest->aggregated, newest->bands);
+        displayDynamicText(renderer, smallFont, line, HUD_X + 10, HUD_Y + 85);
+        snprintf(line, sizeof(line), "Allocs/frame %d", newest->allocations);
+        displayDynamicText(renderer, smallFont, line, HUD_X + 10, HUD_Y + 105);
+        snprintf(line, sizeof(line), "Ingest %.1f veh/s", ingestRate);
+        displayDynamicText(renderer, smallFont, line, HUD_X + 10, HUD_Y + 125);
+    }
+
+    // Frame time sparkline, scaled to at least two 60 FPS frames
+    int sparkX = HUD_X + 10, sparkY = HUD_Y + 155, sparkW = HUD_WIDTH - 20;
+    float scale = maxFrame > 33.3f ? maxFrame : 33.3f;
+    SDL_Rect sparkBox = {sparkX, sparkY, sparkW, HUD_SPARK_HEIGHT};
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderFillRect(renderer, &sparkBox);
+    SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
+    int budgetY = sparkY + HUD_SPARK_HEIGHT - (int)(16.7f / scale * HUD_SPARK_HEIGHT);
+    SDL_RenderDrawLine(renderer, sparkX, budgetY, sparkX + sparkW, budgetY);
+    SDL_SetRenderDrawColor(renderer, 50, 50, 100, 255);
+    int prevX = 0, prevY = 0;
+    for (int i = 0; i < n; i++) {
+        int x = sparkX + i * sparkW / HUD_SAMPLES;
+        int y = sparkY + HUD_SPARK_HEIGHT - (int)(hudSample(i)->frameMs / scale * HUD_SPARK_HEIGHT);
+        if (i > 0) SDL_RenderDrawLine(renderer, prevX, prevY, x, y);
+        prevX = x;
+        prevY = y;
+    }
 }
 
 void drawRoadsAndLane(SDL_Renderer *renderer, TTF_Font *font) {
@@ -522,7 +3072,16 @@ void drawRoadsAndLane(SDL_Renderer *renderer, TTF_Font *font) {
     displayText(renderer, font, "D", 10, WINDOW_HEIGHT/2);
 }
 
-void drawLightForA(SDL_Renderer* renderer, bool isRed) {
+void setLightColour(SDL_Renderer* renderer, LightColour colour) {
+    if (colour == LIGHT_RED)
+        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+    else if (colour == LIGHT_AMBER)
+        SDL_SetRenderDrawColor(renderer, 255, 170, 0, 255);
+    else
+        SDL_SetRenderDrawColor(renderer, 11, 156, 50, 255);
+}
+
+void drawLightForA(SDL_Renderer* renderer, LightColour colour) {
     SDL_Rect lightBox = {388, 288, 70, 30};
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(renderer, &lightBox);
@@ -537,15 +3096,12 @@ void drawLightForA(SDL_Renderer* renderer, bool isRed) {
     SDL_RenderFillRect(renderer, &right_Light);
     
     // Straight light - controlled by traffic signal
-    if(isRed) 
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-    else 
-        SDL_SetRenderDrawColor(renderer, 11, 156, 50, 255);
+    setLightColour(renderer, colour);
     SDL_Rect straight_Light = {393, 293, 20, 20};
     SDL_RenderFillRect(renderer, &straight_Light);
 }
 
-void drawLightForB(SDL_Renderer* renderer, bool isRed) {
+void drawLightForB(SDL_Renderer* renderer, LightColour colour) {
     SDL_Rect lightBox = {325, 488, 80, 30};
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(renderer, &lightBox);
@@ -559,15 +3115,12 @@ void drawLightForB(SDL_Renderer* renderer, bool isRed) {
     SDL_RenderFillRect(renderer, &left_Light);
     
     // middle lane light -> controlled by traffic signal
-    if(isRed) 
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-    else 
-        SDL_SetRenderDrawColor(renderer, 11, 156, 50, 255);
+    setLightColour(renderer, colour);
     SDL_Rect middle_Light = {380, 493, 20, 20};
     SDL_RenderFillRect(renderer, &middle_Light);
 }
 
-void drawLightForC(SDL_Renderer* renderer, bool isRed) {
+void drawLightForC(SDL_Renderer* renderer, LightColour colour) {
     SDL_Rect lightBox = {488, 388, 30, 70};
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(renderer, &lightBox);
@@ -581,15 +3134,12 @@ void drawLightForC(SDL_Renderer* renderer, bool isRed) {
     SDL_RenderFillRect(renderer, &right_Light);
     
     // straight light 
-    if(isRed) 
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-    else 
-        SDL_SetRenderDrawColor(renderer, 11, 156, 50, 255);
+    setLightColour(renderer, colour);
     SDL_Rect straight_Light = {493, 393, 20, 20};
     SDL_RenderFillRect(renderer, &straight_Light);
 }
 
-void drawLightForD(SDL_Renderer* renderer, bool isRed) {
+void drawLightForD(SDL_Renderer* renderer, LightColour colour) {
     SDL_Rect lightBox = {288, 325, 30, 90};
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(renderer, &lightBox);
@@ -603,16 +3153,13 @@ void drawLightForD(SDL_Renderer* renderer, bool isRed) {
     SDL_RenderFillRect(renderer, &left_turn_Light);
     
     // middle lane light
-    if(isRed) 
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-    else 
-        SDL_SetRenderDrawColor(renderer, 11, 156, 50, 255);
+    setLightColour(renderer, colour);
     SDL_Rect middle_Light = {293, 380, 20, 20};
     SDL_RenderFillRect(renderer, &middle_Light);
 }
 
 typedef struct {
-    char text[MAX_LINE_LENGTH];
+    char text[TEXT_CACHE_LENGTH];
     SDL_Texture *texture;
 } TextCache;
 
@@ -630,10 +3177,11 @@ SDL_Texture* getCachedTexture(SDL_Renderer *renderer, TTF_Font *font, const char
     SDL_Surface *textSurface = TTF_RenderText_Solid(font, text, textColor);
     SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, textSurface);
     SDL_FreeSurface(textSurface);
+    countAllocation();
 
     if (textCacheSize < MAX_QUEUE_SIZE) {
-        strncpy(textCache[textCacheSize].text, text, MAX_LINE_LENGTH - 1);
-        textCache[textCacheSize].text[MAX_LINE_LENGTH - 1] = '\0';
+        strncpy(textCache[textCacheSize].text, text, TEXT_CACHE_LENGTH - 1);
+        textCache[textCacheSize].text[TEXT_CACHE_LENGTH - 1] = '\0';
         textCache[textCacheSize].texture = texture;
         textCacheSize++;
     }
@@ -648,46 +3196,114 @@ void displayText(SDL_Renderer *renderer, TTF_Font *font, const char *text, int x
     SDL_RenderCopy(renderer, texture, NULL, &textRect);
 }
 
+// For text that changes every frame (stats): render without going through the cache.
+void displayDynamicText(SDL_Renderer *renderer, TTF_Font *font, const char *text, int x, int y) {
+    SDL_Color textColor = {0, 0, 0, 255};
+    SDL_Surface *textSurface = TTF_RenderText_Solid(font, text, textColor);
+    if (!textSurface) return;
+    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, textSurface);
+    SDL_FreeSurface(textSurface);
+    countAllocation();
+    if (!texture) return;
+    SDL_Rect textRect = {x, y, 0, 0};
+    SDL_QueryTexture(texture, NULL, NULL, &textRect.w, &textRect.h);
+    SDL_RenderCopy(renderer, texture, NULL, &textRect);
+    SDL_DestroyTexture(texture);
+}
+
 
-void refreshLight(SDL_Renderer *renderer, SharedData* sharedData) {
-    // Always display the traffic lights according to nextLight state
-    if (sharedData->nextLight == 0) {
-        drawLightForA(renderer, true);
-        drawLightForB(renderer, true);
-        drawLightForC(renderer, true);
-        drawLightForD(renderer, true);
-    }
-    else if (sharedData->nextLight == 1) {
-        drawLightForA(renderer, false);
-        drawLightForB(renderer, true);
-        drawLightForC(renderer, true);
-        drawLightForD(renderer, true);
-    }
-    else if (sharedData->nextLight == 2) {
-        drawLightForA(renderer, true);
-        drawLightForB(renderer, false);
-        drawLightForC(renderer, true);
-        drawLightForD(renderer, true);
-    }
-    else if (sharedData->nextLight == 3) {
-        drawLightForA(renderer, true);
-        drawLightForB(renderer, true);
-        drawLightForC(renderer, false);
-        drawLightForD(renderer, true);
-    }
-    else if (sharedData->nextLight == 4) {
-        drawLightForA(renderer, true);
-        drawLightForB(renderer, true);
-        drawLightForC(renderer, true);
-        drawLightForD(renderer, false);
+LightColour roadLight(const SignalState* signal, char road) {
+    if (roadGreen(signal->greenMask, road)) return LIGHT_GREEN;
+    if (roadGreen(signal->amberMask, road)) return LIGHT_AMBER;
+    return LIGHT_RED;
+}
+
+// Draws the lights for a signal state.
+void drawLights(SDL_Renderer *renderer, const SignalState* signal) {
+    drawLightForA(renderer, roadLight(signal, 'A'));
+    drawLightForB(renderer, roadLight(signal, 'B'));
+    drawLightForC(renderer, roadLight(signal, 'C'));
+    drawLightForD(renderer, roadLight(signal, 'D'));
+}
+
+void initSignals(SharedData* sharedData) {
+    SignalState state = { 0, 0, 0, getSimTimeMs(), 0, SWITCH_START, 0 };
+    memset(sharedData, 0, sizeof(*sharedData));
+    writeSignal(&sharedData->requested, &state);
+    writeSignal(&sharedData->current, &state);
+}
+
+// Controller side: asks for a set of green (or amber) roads for durationMs
+// (0 = open ended).
+void requestSignal(SharedData* sharedData, int phase, int greenMask, int amberMask,
+                   Uint32 durationMs, SwitchReason reason) {
+    SignalState state = readSignal(&sharedData->requested);
+    state.phase = phase;
+    state.greenMask = greenMask;
+    state.amberMask = amberMask;
+    state.phaseStartMs = getSimTimeMs();
+    state.durationMs = durationMs;
+    state.reason = reason;
+    state.version++;
+    writeSignal(&sharedData->requested, &state);
+}
+
+// One road green (phase 1-4), or all red for phase 0.
+void requestPhase(SharedData* sharedData, int phase, Uint32 durationMs, SwitchReason reason) {
+    requestSignal(sharedData, phase, phase ? 1 << (phase - 1) : 0, 0, durationMs, reason);
+}
+
+// Simulation side of the old refreshLight(): takes over the controller's
+// latest request and closes/opens throughput phases.
+void advanceLight(SharedData* sharedData) {
+    SignalState requested = readSignal(&sharedData->requested);
+    SignalState current = readSignal(&sharedData->current);
+    if (requested.version != current.version) {
+        Uint32 now = getSimTimeMs();
+        if (requested.phase != current.phase || requested.greenMask != current.greenMask ||
+            requested.amberMask != current.amberMask) {
+             // log only if there's a change in state.
+             char from[24], to[24];
+             printf("Light updated from %s to %s (%s)\n", signalLabel(&current, from, sizeof(from)),
+                    signalLabel(&requested, to, sizeof(to)), switchReasonNames[requested.reason]);
+             preemptionPhaseChange(&current, &requested, now);
+             throughputEndPhase(now);
+             throughputBeginPhase(requested.phase, requested.greenMask, now);
+             fflush(stdout);
+             current.phase = requested.phase;
+             current.greenMask = requested.greenMask;
+             current.amberMask = requested.amberMask;
+             current.phaseStartMs = now;
+             current.durationMs = requested.durationMs;
+        } else if (requested.durationMs == 0) {
+             current.durationMs = 0;
+        } else {
+             // Same phase again: the green runs on, so extend it from now.
+             current.durationMs = (now - current.phaseStartMs) + requested.durationMs;
+        }
+        current.reason = requested.reason;
+        current.version = requested.version;
+        writeSignal(&sharedData->current, &current);
     }
-    
-    // log only if there's a change in state.
-    if (sharedData->nextLight != sharedData->currentLight) {
-         printf("Light updated from %d to %d\n", sharedData->currentLight, sharedData->nextLight);
-         sharedData->currentLight = sharedData->nextLight;
-         fflush(stdout);
+    if (current.greenMask != 0 && atomic_load(&emergencyPending) > 0)
+        for (int r = 0; r < NUM_ROADS; r++)
+            if (current.greenMask & (1 << r)) recordPreemptionLatency(r);
+}
+
+// Green reached road: every emergency vehicle waiting there has been served.
+// The road's stamp says whether any arrived since its last green.
+void recordPreemptionLatency(int road) {
+    if (atomic_exchange(&emergencyArrivalUs[road], 0) == 0) return;
+    VehicleQueue* queue = queueForRoad('A' + road);
+    Uint32 now = getSimTimeMs();
+    lockQueue(queue, LOCK_SITE_PREEMPTION);
+    for (int i = 0; i < queue->size; i++) {
+        Vehicle* v = queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+        if (!v->awaitingGreen) continue;
+        histogramRecord(&preemption.latencyMs, now - v->enterTimeMs);
+        v->awaitingGreen = false;
     }
+    unlockQueue(queue);
 }
 
 // Define the estimated time (in seconds) for one vehicle to pass.
@@ -695,34 +3311,220 @@ void refreshLight(SDL_Renderer *renderer, SharedData* sharedData) {
 // New helper: Count vehicles in a given queue with a specific lane number.
 int countVehicles(VehicleQueue* queue, int lane_num) {
     int count = 0;
-    pthread_mutex_lock(&queue->lock);
+    lockQueue(queue, LOCK_SITE_COUNT);
     for (int i = 0; i < queue->size; i++) {
         int idx = (queue->front + i) % MAX_QUEUE_SIZE;
         if (queue->vehicles[idx]->lane_number == lane_num)
             count++;
         }
-    pthread_mutex_unlock(&queue->lock);
+    unlockQueue(queue);
     return count;
     }
 
 // New helper: Count all vehicles in Road A (queueA)
 int countVehiclesLaneA(VehicleQueue* queue) {
     int count = 0;
-    pthread_mutex_lock(&queue->lock);
+    lockQueue(queue, LOCK_SITE_COUNT);
     count = queue->size; // all vehicles in queueA are from Road A
-    pthread_mutex_unlock(&queue->lock);
+    unlockQueue(queue);
     return count;
 }
+// Predictive green split (--controller predictive). The cycle is a fixed
+// PREDICT_CYCLE_MS. The green left after lost time is split in proportion to
+// each queue predicted at the end of its turn (queued now + arrivals over
+// C / phases). No road gets more than it needs to discharge that queue: what a
+// road can't use is split again among the others until every share fits. No
+// road gets less than PREDICT_MIN_GREEN_MS. The flow ratio Y (the sum of
+// arrival / discharge rate over the lanes with vehicles) is only reported.
+#define PREDICT_LOST_MS 1000        // start-up loss per phase
+#define PREDICT_MIN_GREEN_MS 1000
+#define PREDICT_CYCLE_MS 10000
+
+typedef struct {
+    int cycles;
+    double lastFlowRatio;           // Y of the last cycle
+    uint64_t greenMs;               // green handed out
+    uint64_t neededMs;              // green the predicted queues needed
+} PredictionStats;
+
+PredictionStats prediction;
+
+void planGreenTimes(const int counts[NUM_ROADS], int greenMs[NUM_ROADS], Uint32 now) {
+    double predicted[NUM_ROADS], needMs[NUM_ROADS], flowRatio = 0, total = 0;
+    int phases = 0;
+    double arrival[NUM_ROADS], discharge[NUM_ROADS];
+    for (int r = 0; r < NUM_ROADS; r++) {
+        readLaneRates(r * LANES_PER_ROAD + 1, now, &arrival[r], &discharge[r]);
+        if (discharge[r] <= 0) discharge[r] = 1.0 / T_PASS_TIME; // no sample yet
+        if (counts[r] == 0) continue;
+        phases++;
+        flowRatio += arrival[r] / discharge[r];
+    }
+    double lostMs = phases * PREDICT_LOST_MS;
+    double cycleMs = PREDICT_CYCLE_MS;
+    for (int r = 0; r < NUM_ROADS; r++) {
+        predicted[r] = counts[r] > 0 ? counts[r] + arrival[r] * cycleMs / phases / 1000.0 : 0;
+        needMs[r] = predicted[r] / discharge[r] * 1000.0;
+        total += predicted[r];
+    }
+    // Roads whose proportional share is more than they need get their need;
+    // the others share what is left, in proportion again.
+    double leftMs = cycleMs - lostMs, openQueued = total;
+    bool capped[NUM_ROADS] = { false };
+    bool changed = true;
+    while (changed && openQueued > 0) {
+        changed = false;
+        for (int r = 0; r < NUM_ROADS; r++) {
+            if (counts[r] == 0 || capped[r] || leftMs * predicted[r] / openQueued <= needMs[r]) continue;
+            capped[r] = true;
+            leftMs -= needMs[r];
+            openQueued -= predicted[r];
+            changed = true;
+        }
+    }
+    for (int r = 0; r < NUM_ROADS; r++) {
+        greenMs[r] = 0;
+        if (counts[r] == 0) continue;
+        double share = capped[r] ? needMs[r] : leftMs * predicted[r] / openQueued;
+        greenMs[r] = share < PREDICT_MIN_GREEN_MS ? PREDICT_MIN_GREEN_MS : (int)share;
+        prediction.greenMs += greenMs[r];
+        prediction.neededMs += (uint64_t)needMs[r];
+    }
+    prediction.cycles++;
+    prediction.lastFlowRatio = flowRatio;
+}
+
+void printPredictionReport() {
+    if (simConfig.controller != CONTROLLER_PREDICTIVE || simConfig.reservations) return;
+    Uint32 now = getSimTimeMs();
+    printf("\n=== Predicted green split ===\n");
+    printf("Cycles: %d of %.1f s, last flow ratio %.2f\n", prediction.cycles,
+           PREDICT_CYCLE_MS / 1000.0, prediction.lastFlowRatio);
+    printf("Green given %.1f s for a predicted need of %.1f s\n",
+           prediction.greenMs / 1000.0, prediction.neededMs / 1000.0);
+    printf("Lane  arrivals/min  discharge veh/s\n");
+    for (int r = 0; r < NUM_ROADS; r++) {
+        double arrival, discharge;
+        readLaneRates(r * LANES_PER_ROAD + 1, now, &arrival, &discharge);
+        printf("%cL2   %12.1f  %15.2f\n", 'A' + r, arrival * 60, discharge);
+    }
+    fflush(stdout);
+}
+
 // Modified chequeQueue to serve Road A with highest priority.
 
+// What preemption costs the other roads, counted at the phase changes into
+// and out of an emergency green. The green cut short is counted where it
+// ends: at the emergency green itself, or at the clearance run before it.
+void preemptionPhaseChange(const SignalState* current, const SignalState* requested, Uint32 now) {
+    if (preemption.active) {
+        Uint32 duration = now - current->phaseStartMs;
+        preemption.emergencyGreenMs += duration;
+        preemption.heldVehicleMs += (uint64_t)preemption.heldVehicles * duration;
+    }
+    int remainingMs = signalRemainingMs(current, now);
+    if ((requested->reason == SWITCH_EMERGENCY || requested->reason == SWITCH_EMERGENCY_CLEARANCE) &&
+        current->greenMask != 0 && remainingMs > 0)
+        preemption.greenCutMs += remainingMs;
+    preemption.active = requested->reason == SWITCH_EMERGENCY;
+    if (!preemption.active) return;
+    preemption.preemptions++;
+    preemption.activeSinceMs = now;
+    VehicleQueue* queues[NUM_ROADS] = { queueA, queueB, queueC, queueD };
+    preemption.heldVehicles = 0;
+    for (int r = 0; r < NUM_ROADS; r++)
+        if (!(requested->greenMask & (1 << r)))
+            preemption.heldVehicles += countVehicles(queues[r], 2);
+}
+
+void printPreemptionReport() {
+    if (preemption.arrivals == 0) return;
+    printf("\n=== Emergency preemption ===\n");
+    printf("Emergency vehicles (lane 2): %d, preemptions: %d\n", preemption.arrivals, preemption.preemptions);
+    const Histogram* h = &preemption.latencyMs;
+    if (h->total > 0)
+        printf("Arrival to green (s): p50 %.2f  p99 %.2f  max %.2f  (%llu served)\n",
+               histogramPercentile(h, 0.50) / 1000.0, histogramPercentile(h, 0.99) / 1000.0,
+               h->max / 1000.0, (unsigned long long)h->total);
+    // A preemption still running at exit counts up to now.
+    Uint32 runningMs = preemption.active ? getSimTimeMs() - preemption.activeSinceMs : 0;
+    printf("Emergency green: %.1f s%s, planned green cut short: %.1f s\n",
+           (preemption.emergencyGreenMs + runningMs) / 1000.0,
+           preemption.active ? " (1 still running)" : "", preemption.greenCutMs / 1000.0);
+    if (preemption.expired > 0)
+        printf("Preemptions given up after %d s: %d\n", EMERGENCY_MAX_PREEMPT_MS / 1000, preemption.expired);
+    printf("Lane 2 vehicles held on other roads: %.1f vehicle-s\n",
+           (preemption.heldVehicleMs + (uint64_t)preemption.heldVehicles * runningMs) / 1000.0);
+    fflush(stdout);
+}
+
+bool holdLightMs(int ms) {
+    TRACE_SCOPE("hold light");
+    return waitForController(ms);
+}
+
+// Keeps the current light for the given number of seconds. Returns true when
+// cut short because an emergency vehicle is waiting.
+bool holdLight(int seconds) {
+    return holdLightMs(seconds * 1000);
+}
+
+// The road's emergency vehicles are still waiting after the longest
+// preemption: stop counting them, so the controller goes back to its cycle.
+void expirePreemption(int road) {
+    VehicleQueue* queue = queueForRoad('A' + road);
+    int expired = 0;
+    lockQueue(queue, LOCK_SITE_PREEMPTION);
+    for (int i = 0; i < queue->size; i++) {
+        Vehicle* v = queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+        if (isSignalledEmergency(v) && !v->crossedStopLine && !v->preemptExpired) {
+            v->preemptExpired = true;
+            expired++;
+        }
+    }
+    atomic_fetch_sub(&emergencyWaiting[road], expired);
+    atomic_fetch_sub(&emergencyPending, expired);
+    unlockQueue(queue);
+    preemption.expired++;
+    printf("Emergency green on road %c gave up after %d s with %d vehicle(s) still waiting\n",
+           'A' + road, EMERGENCY_MAX_PREEMPT_MS / 1000, expired);
+    fflush(stdout);
+}
+
+// Gives road green until its emergency vehicles have crossed the stop line,
+// for at most EMERGENCY_MAX_PREEMPT_MS.
+void serveEmergency(SharedData* sharedData, int road) {
+    TRACE_SCOPE("emergency preemption");
+    printf("Preempting for emergency vehicle on road %c\n", 'A' + road);
+    fflush(stdout);
+    requestPhase(sharedData, road + 1, 0, SWITCH_EMERGENCY);
+    Uint32 start = getSimTimeMs();
+    while (atomic_load(&emergencyWaiting[road]) > 0) {
+        if (getSimTimeMs() - start >= EMERGENCY_MAX_PREEMPT_MS) {
+            expirePreemption(road);
+            return;
+        }
+        pauseController(EMERGENCY_POLL_MS);
+    }
+}
+
 void* chequeQueue(void* arg) {
     SharedData* sharedData = (SharedData*)arg;
+    traceRegisterThread("chequeQueue");
+    resumeRestoredController();
     while (1) {
+        TRACE_SCOPE("controller cycle");
+        // Emergency vehicles preempt everything else.
+        int emergency = emergencyRoad();
+        if (emergency >= 0) {
+            serveEmergency(sharedData, emergency);
+            continue;
+        }
         // Priority: Serve Road A if any vehicles waiting.
         int countA = countVehiclesLaneA(queueA);
             if (countA > 5) {
-                sharedData->nextLight = 1; // 1 corresponds to Road A.
-                sleep(3);  // Fixed green time for Road A priority.
+                requestPhase(sharedData, 1, 3000, SWITCH_PRIORITY_A); // 1 corresponds to Road A.
+                waitAtPassEnd(3000);  // Fixed green time for Road A priority.
             } else {
                 // Normal lanes
                 // Check for priority condition first (>10 vehicles)
@@ -732,19 +3534,19 @@ void* chequeQueue(void* arg) {
 
                 // Handle priority roads first
                 if (priorityB > 10) {
-                    sharedData->nextLight = 2; // B lane
+                    requestPhase(sharedData, 2, 0, SWITCH_PRIORITY_QUEUE); // B lane
                     while (countVehicles(queueB, 2) > 5) {
-                        sleep(T_PASS_TIME);
+                        if (holdLight(T_PASS_TIME)) break;
                     }
                 } else if (priorityC > 10) {
-                    sharedData->nextLight = 3; // C lane
+                    requestPhase(sharedData, 3, 0, SWITCH_PRIORITY_QUEUE); // C lane
                     while (countVehicles(queueC, 2) > 5) {
-                        sleep(T_PASS_TIME);
+                        if (holdLight(T_PASS_TIME)) break;
                     }
                 } else if (priorityD > 10) {
-                    sharedData->nextLight = 4; // D lane
+                    requestPhase(sharedData, 4, 0, SWITCH_PRIORITY_QUEUE); // D lane
                     while (countVehicles(queueD, 2) > 5) {
-                        sleep(T_PASS_TIME);
+                        if (holdLight(T_PASS_TIME)) break;
                     }
                 } else {
                     // Normal operation when no priority condition
@@ -760,29 +3562,383 @@ void* chequeQueue(void* arg) {
                     int greenTime = (int)(V * T_PASS_TIME);
                     if (greenTime < 1) greenTime = 1;
                     
-                     // Serve each lane based on calculated time
-                    if (L1 > 0) {
-                        sharedData->nextLight = 1; // A lane
-                        sleep(greenTime);
-                    }
-                    if (L2 > 0) {
-                        sharedData->nextLight = 2; // B lane
-                        sleep(greenTime);
+                    // Or split the fixed cycle by predicted queue
+                    int counts[NUM_ROADS] = { L1, L2, L3, L4 };
+                    int greenMs[NUM_ROADS] = { greenTime * 1000, greenTime * 1000, greenTime * 1000, greenTime * 1000 };
+                    SwitchReason reason = SWITCH_NORMAL_CYCLE;
+                    if (simConfig.controller == CONTROLLER_PREDICTIVE) {
+                        planGreenTimes(counts, greenMs, getSimTimeMs());
+                        reason = SWITCH_PREDICTED_CYCLE;
                     }
-                    if (L3 > 0) {
-                        sharedData->nextLight = 3; // C lane
-                        sleep(greenTime);
-                    }
-                    if (L4 > 0) {
-                        sharedData->nextLight = 4; // D lane
-                        sleep(greenTime);
+
+                     // Serve each lane based on calculated time, stopping
+                     // early if an emergency vehicle turns up
+                    int lastRoad = -1;
+                    for (int r = 0; r < NUM_ROADS; r++)
+                        if (counts[r] > 0) lastRoad = r;
+                    bool preempted = false;
+                    for (int r = 0; r < NUM_ROADS && !preempted; r++) {
+                        if (counts[r] == 0) continue;
+                        requestPhase(sharedData, r + 1, greenMs[r], reason); // A, B, C, D lane
+                        preempted = r == lastRoad ? waitAtPassEnd(greenMs[r]) : holdLightMs(greenMs[r]);
                     }
+                    if (L1 + L2 + L3 + L4 == 0)
+                        waitAtPassEnd(CONTROLLER_IDLE_MS); // nothing queued: don't spin
                 }
             }
     }
     return NULL;
 }
 
+// Signal plans (--controller plan). A stage is a set of roads whose lane 2
+// turns never cross (see Tile Reservations), so they can be green together.
+// Stages run in order, skipping ones with nobody waiting. Each gets at least
+// minGreen, then is extended in PLAN_EXTENSION_MS steps while its roads still
+// have vehicles waiting (gap-out) up to maxGreen (max-out), and is followed by
+// amber and all-red clearance before a different stage starts.
+#define MAX_PLAN_STAGES 8
+#define PLAN_EXTENSION_MS 500
+
+typedef struct {
+    int greenMask;
+    Uint32 minGreenMs;
+    Uint32 maxGreenMs;
+    Uint32 greenMs;         // stats: green handed out
+    int served;             // times it ran
+    int gapOuts;            // ended because its queues emptied
+    int maxOuts;            // ended at maxGreen with vehicles still waiting
+} PlanStage;
+
+typedef struct {
+    PlanStage stages[MAX_PLAN_STAGES];
+    int stageCount;
+    Uint32 amberMs;
+    Uint32 allRedMs;
+    int cycles;             // passes through the stage list
+    Uint32 startMs;
+} SignalPlan;
+
+// Default: A, then B, then C and D together. The turns of A and B share tiles
+// when B starts as A finishes. --controller pressure picks among the same stages.
+SignalPlan signalPlan = {
+    .stages = {
+        { .greenMask = 0x1, .minGreenMs = 3000, .maxGreenMs = 12000 },
+        { .greenMask = 0x2, .minGreenMs = 3000, .maxGreenMs = 12000 },
+        { .greenMask = 0xC, .minGreenMs = 3000, .maxGreenMs = 12000 },
+    },
+    .stageCount = 3,
+    .amberMs = 2000,
+    .allRedMs = 1000,
+};
+
+// Plan file: one setting per line, '#' starts a comment. Times in seconds.
+// A stage whose roads' lane 2 turns can share a tile is refused.
+//   amber 2
+//   all-red 1
+//   stage CD min 3 max 12
+bool loadSignalPlan(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror("Error opening signal plan");
+        return false;
+    }
+    buildMovementPaths();
+    SignalPlan plan = { .amberMs = signalPlan.amberMs, .allRedMs = signalPlan.allRedMs };
+    char line[128];
+    int lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        char problem[48] = "bad plan line";
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char word[16], roads[8];
+        double a, b;
+        if (sscanf(line, "%15s", word) != 1) continue;
+        if (strcmp(word, "amber") == 0 && sscanf(line, "%*s %lf", &a) == 1 && a >= 0) {
+            plan.amberMs = (Uint32)(a * 1000);
+        } else if (strcmp(word, "all-red") == 0 && sscanf(line, "%*s %lf", &a) == 1 && a >= 0) {
+            plan.allRedMs = (Uint32)(a * 1000);
+        } else if (strcmp(word, "stage") == 0 && plan.stageCount < MAX_PLAN_STAGES &&
+                   sscanf(line, "%*s %7s min %lf max %lf", roads, &a, &b) == 3 && a > 0 && b >= a) {
+            PlanStage* stage = &plan.stages[plan.stageCount++];
+            stage->minGreenMs = (Uint32)(a * 1000);
+            stage->maxGreenMs = (Uint32)(b * 1000);
+            for (const char* c = roads; *c && ok; c++) {
+                if (*c < 'A' || *c > 'D') ok = false;
+                else stage->greenMask |= 1 << (*c - 'A');
+            }
+            for (int r = 0; r < NUM_ROADS && ok; r++)
+                for (int o = r + 1; o < NUM_ROADS && ok; o++)
+                    if ((stage->greenMask >> r & 1) && (stage->greenMask >> o & 1) && movementsConflict(r, o)) {
+                        snprintf(problem, sizeof(problem), "the lane 2 turns of %c and %c cross", 'A' + r, 'A' + o);
+                        ok = false;
+                    }
+        } else {
+            ok = false;
+        }
+        if (!ok) fprintf(stderr, "%s:%d: %s\n", path, lineNumber, problem);
+    }
+    fclose(file);
+    if (ok && plan.stageCount == 0) {
+        fprintf(stderr, "%s: no stages\n", path);
+        ok = false;
+    }
+    if (ok) signalPlan = plan;
+    return ok;
+}
+
+// Lane 2 vehicles of a queue still short of the stop line.
+int countWaitingVehicles(VehicleQueue* queue) {
+    int count = 0;
+    lockQueue(queue, LOCK_SITE_COUNT);
+    for (int i = 0; i < queue->size; i++) {
+        const Vehicle* v = queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+        if (v->lane_number == 2 && !v->turning && !v->crossedStopLine)
+            count++;
+    }
+    unlockQueue(queue);
+    return count;
+}
+
+int stageDemand(int greenMask) {
+    VehicleQueue* queues[NUM_ROADS] = { queueA, queueB, queueC, queueD };
+    int waiting = 0;
+    for (int r = 0; r < NUM_ROADS; r++)
+        if (greenMask & (1 << r))
+            waiting += countWaitingVehicles(queues[r]);
+    return waiting;
+}
+
+// Amber, then all red, after the roads in greenMask had green. Not cut short
+// by an emergency vehicle: preemption waits for the junction to clear too.
+void runClearance(SharedData* sharedData, int greenMask, SwitchReason reason) {
+    TRACE_SCOPE("clearance");
+    if (signalPlan.amberMs > 0) {
+        requestSignal(sharedData, 0, 0, greenMask, signalPlan.amberMs, reason);
+        pauseController(signalPlan.amberMs);
+    }
+    if (signalPlan.allRedMs > 0) {
+        requestSignal(sharedData, 0, 0, 0, signalPlan.allRedMs, reason);
+        pauseController(signalPlan.allRedMs);
+    }
+}
+
+void* runSignalPlan(void* arg) {
+    SharedData* sharedData = (SharedData*)arg;
+    traceRegisterThread("signalPlan");
+    resumeRestoredController();
+    signalPlan.startMs = getSimTimeMs();
+    ControllerState* state = &controllerState;
+    while (1) {
+        // The running stage: extended while its roads still have vehicles
+        // waiting, up to its maximum, unless an emergency vehicle cut it short.
+        if (state->activeStage >= 0) {
+            PlanStage* stage = &signalPlan.stages[state->activeStage];
+            if (!state->preempted && getSimTimeMs() - state->stageStartMs + PLAN_EXTENSION_MS <= stage->maxGreenMs &&
+                stageDemand(state->greenMask) > 0) {
+                requestSignal(sharedData, state->activeStage + 1, state->greenMask, 0, PLAN_EXTENSION_MS, SWITCH_PLAN_STAGE);
+                state->preempted = waitAtPassEnd(PLAN_EXTENSION_MS);
+                continue;
+            }
+            stage->served++;
+            stage->greenMs += getSimTimeMs() - state->stageStartMs;
+            if (!state->preempted) {
+                if (stageDemand(state->greenMask) > 0) stage->maxOuts++;
+                else stage->gapOuts++;
+            }
+            state->activeStage = -1;
+        }
+        // Emergency vehicles preempt the plan, as they do chequeQueue().
+        int emergency = emergencyRoad();
+        if (emergency >= 0) {
+            // Clear what is actually shown: a green only just requested may never have been.
+            int shown = readSignal(&sharedData->current).greenMask;
+            if (shown != 0 && shown != 1 << emergency)
+                runClearance(sharedData, shown, SWITCH_EMERGENCY_CLEARANCE);
+            serveEmergency(sharedData, emergency);
+            state->greenMask = 1 << emergency;
+            continue;
+        }
+        int stageIndex = -1;
+        for (int k = 0; k < signalPlan.stageCount && stageIndex < 0; k++)
+            if (stageDemand(signalPlan.stages[(state->next + k) % signalPlan.stageCount].greenMask) > 0)
+                stageIndex = (state->next + k) % signalPlan.stageCount;
+        if (stageIndex < 0) {
+            waitAtPassEnd(CONTROLLER_IDLE_MS); // nothing waiting: keep the lights as they are
+            continue;
+        }
+        if (stageIndex <= state->lastStage) signalPlan.cycles++; // wrapped round the list
+        state->lastStage = stageIndex;
+        state->next = (stageIndex + 1) % signalPlan.stageCount;
+
+        PlanStage* stage = &signalPlan.stages[stageIndex];
+        if (state->greenMask != 0 && state->greenMask != stage->greenMask)
+            runClearance(sharedData, state->greenMask, SWITCH_CLEARANCE);
+        TRACE_SCOPE("plan stage");
+        state->greenMask = stage->greenMask;
+        requestSignal(sharedData, stageIndex + 1, state->greenMask, 0, stage->minGreenMs, SWITCH_PLAN_STAGE);
+        state->activeStage = stageIndex;
+        state->stageStartMs = getSimTimeMs();
+        state->preempted = waitAtPassEnd(stage->minGreenMs);
+    }
+    return NULL;
+}
+
+void printPlanReport() {
+    if (simConfig.controller != CONTROLLER_PLAN) return;
+    uint64_t lane2 = 0;
+    for (int r = 0; r < NUM_ROADS; r++)
+        lane2 += throughput.laneCrossings[r * LANES_PER_ROAD + 1];
+    double minutes = (getSimTimeMs() - signalPlan.startMs) / 60000.0;
+    printf("\n=== Signal plan ===\n");
+    printf("Cycles: %d, amber %.1f s, all red %.1f s\n", signalPlan.cycles,
+           signalPlan.amberMs / 1000.0, signalPlan.allRedMs / 1000.0);
+    printf("Stage  roads  runs  green s  gap-outs  max-outs\n");
+    for (int i = 0; i < signalPlan.stageCount; i++) {
+        const PlanStage* stage = &signalPlan.stages[i];
+        char roads[8];
+        int n = 0;
+        for (int r = 0; r < NUM_ROADS; r++)
+            if (stage->greenMask & (1 << r)) roads[n++] = 'A' + r;
+        roads[n] = '\0';
+        printf("%5d  %-5s  %4d  %7.1f  %8d  %8d\n", i + 1, roads, stage->served,
+               stage->greenMs / 1000.0, stage->gapOuts, stage->maxOuts);
+    }
+    printf("Lane 2 crossings: %llu (%.1f per minute, %.1f per cycle)\n", (unsigned long long)lane2,
+           minutes > 0 ? lane2 / minutes : 0.0, signalPlan.cycles > 0 ? (double)lane2 / signalPlan.cycles : 0.0);
+    fflush(stdout);
+}
+
+// Max-pressure control (--controller pressure). Every MAX_PRESSURE_STEP_MS the
+// controller gives green to the plan stage with the largest pressure, summed
+// over its roads: lane 2 vehicles waiting minus lane 2 vehicles already out on
+// the road that turn leaves on. It only reads the incremental lane counts.
+// Keeping the same stage extends its green; changing stage goes through amber
+// and all red as in runSignalPlan().
+#define MAX_PRESSURE_STEP_MS 2000
+
+typedef struct {
+    int decisions;
+    int switches;           // decisions that changed stage
+} PressureStats;
+
+PressureStats pressureStats;
+
+int stageWaiting(int greenMask) {
+    int waiting = 0;
+    for (int r = 0; r < NUM_ROADS; r++)
+        if (greenMask & (1 << r))
+            waiting += atomic_load(&laneWaiting[r * LANES_PER_ROAD + 1]);
+    return waiting;
+}
+
+int stagePressure(int greenMask) {
+    int pressure = 0;
+    for (int r = 0; r < NUM_ROADS; r++)
+        if (greenMask & (1 << r))
+            pressure += atomic_load(&laneWaiting[r * LANES_PER_ROAD + 1]) -
+                        atomic_load(&exitOccupancy[laneTwoExit(r)]);
+    return pressure;
+}
+
+void* runMaxPressure(void* arg) {
+    SharedData* sharedData = (SharedData*)arg;
+    traceRegisterThread("maxPressure");
+    resumeRestoredController();
+    ControllerState* state = &controllerState;
+    while (1) {
+        int emergency = emergencyRoad();
+        if (emergency >= 0) {
+            // Clear what is actually shown: a green only just requested may never have been.
+            int shown = readSignal(&sharedData->current).greenMask;
+            if (shown != 0 && shown != 1 << emergency)
+                runClearance(sharedData, shown, SWITCH_EMERGENCY_CLEARANCE);
+            serveEmergency(sharedData, emergency);
+            state->greenMask = 1 << emergency;
+            continue;
+        }
+        int best = -1, bestPressure = 0;
+        for (int i = 0; i < signalPlan.stageCount; i++) {
+            if (stageWaiting(signalPlan.stages[i].greenMask) == 0) continue;
+            int pressure = stagePressure(signalPlan.stages[i].greenMask);
+            if (best < 0 || pressure > bestPressure) {
+                best = i;
+                bestPressure = pressure;
+            }
+        }
+        if (best < 0) {
+            waitAtPassEnd(CONTROLLER_IDLE_MS);
+            continue;
+        }
+        TRACE_SCOPE("pressure decision");
+        PlanStage* stage = &signalPlan.stages[best];
+        pressureStats.decisions++;
+        if (stage->greenMask != state->greenMask) {
+            pressureStats.switches++;
+            if (state->greenMask != 0)
+                runClearance(sharedData, state->greenMask, SWITCH_CLEARANCE);
+        }
+        state->greenMask = stage->greenMask;
+        requestSignal(sharedData, best + 1, state->greenMask, 0, MAX_PRESSURE_STEP_MS, SWITCH_MAX_PRESSURE);
+        stage->served++;
+        stage->greenMs += MAX_PRESSURE_STEP_MS;  // as requested: an emergency vehicle can cut it short
+        waitAtPassEnd(MAX_PRESSURE_STEP_MS);
+    }
+    return NULL;
+}
+
+// Served lane 2 vehicles per hour and their mean stop-line delay, for whichever
+// controller ran. With --compare the row is appended to a file and every row
+// in it is printed, so running each policy in turn gives a side-by-side table.
+// A reservations run is also set against the file's last heuristic (fixed
+// cycle) row.
+void printControllerSummary() {
+    uint64_t served = 0, waits = 0, waitMs = 0;
+    for (int r = 0; r < NUM_ROADS; r++) {
+        int lane = r * LANES_PER_ROAD + 1;
+        served += throughput.laneCrossings[lane];
+        waits += laneDelayStats[lane].waitTime.total;
+        waitMs += laneDelayStats[lane].waitTime.sum;
+    }
+    double hours = getSimTimeMs() / 3600000.0;
+    double perHour = hours > 0 ? served / hours : 0.0;
+    double meanDelay = waits > 0 ? waitMs / 1000.0 / waits : 0.0;
+    const char* policy = simConfig.reservations ? "reservations" : controllerNames[simConfig.controller];
+
+    printf("\n=== Controller: %s ===\n", policy);
+    if (simConfig.controller == CONTROLLER_PRESSURE && !simConfig.reservations)
+        printf("Decisions: %d, stage changes: %d\n", pressureStats.decisions, pressureStats.switches);
+    printf("Lane 2 served: %llu (%.0f veh/h), mean delay %.2f s\n",
+           (unsigned long long)served, perHour, meanDelay);
+    if (!simConfig.comparePath) {
+        fflush(stdout);
+        return;
+    }
+    FILE* file = fopen(simConfig.comparePath, "a+");
+    if (!file) {
+        perror("Error opening comparison file");
+        return;
+    }
+    fprintf(file, "%s %.1f %.3f %.2f\n", policy, perHour, meanDelay, hours * 60);
+    rewind(file);
+    printf("Policy          veh/h  mean delay s  minutes\n");
+    char name[32];
+    double rowPerHour, rowDelay, rowMinutes, cyclePerHour = 0, cycleDelay = 0;
+    while (fscanf(file, "%31s %lf %lf %lf", name, &rowPerHour, &rowDelay, &rowMinutes) == 4) {
+        printf("%-12s  %7.0f  %12.2f  %7.1f\n", name, rowPerHour, rowDelay, rowMinutes);
+        if (strcmp(name, "heuristic") == 0) {
+            cyclePerHour = rowPerHour;
+            cycleDelay = rowDelay;
+        }
+    }
+    fclose(file);
+    if (simConfig.reservations && cyclePerHour > 0)
+        printf("Reservations vs fixed cycle: %+.0f%% lane 2 veh/h, mean delay %.2f s vs %.2f s\n",
+               (perHour / cyclePerHour - 1.0) * 100.0, meanDelay, cycleDelay);
+    fflush(stdout);
+}
+
 void* readAndParseFile(void* arg) {
     while (1) {
         FILE* file = fopen(VEHICLE_FILE, "r");
@@ -791,49 +3947,19 @@ void* readAndParseFile(void* arg) {
             sleep(2);
             continue;
         }
-        char line[MAX_LINE_LENGTH];
-        while (fgets(line, sizeof(line), file)) {
-            // Remove newline if present
-            line[strcspn(line, "\n")] = 0;
-            // Split using ':'
-            char* vehicleNumber = strtok(line, ":");
-            char* road = strtok(NULL, ":");
-            if (vehicleNumber && road) {
-                Vehicle* newVehicle = (Vehicle*)malloc(sizeof(Vehicle));
-                strncpy(newVehicle->id, vehicleNumber, MAX_VEHICLE_ID - 1);
-                newVehicle->id[MAX_VEHICLE_ID - 1] = '\0';
-                newVehicle->lane = road[0];
-                newVehicle->arrivalTime = time(NULL);
-                newVehicle->isEmergency = (strstr(vehicleNumber, "EMG") != NULL);
-
-                if (strstr(vehicleNumber, "L1"))
-                    newVehicle->lane_number = 1;
-                else if (strstr(vehicleNumber, "L2"))
-                    newVehicle->lane_number = 2;
-                else if (strstr(vehicleNumber, "L3"))
-                    newVehicle->lane_number = 3;
-                else 
-                    newVehicle->lane_number = 2; // default
-
-                // Initialize animPos based on lane:
-                if (road[0] == 'A')
-                    newVehicle->animPos = 0.0f;                
-                else if (road[0] == 'B')
-                    newVehicle->animPos = (float)WINDOW_HEIGHT;
-                else if (road[0] == 'C')
-                    newVehicle->animPos = (float)WINDOW_WIDTH;
-                else if (road[0] == 'D')
-                    newVehicle->animPos = 0.0f;
-
-                switch(newVehicle->lane) {
-                    case 'A': enqueue(queueA, newVehicle); break;
-                    case 'B': enqueue(queueB, newVehicle); break;
-                    case 'C': enqueue(queueC, newVehicle); break;
-                    case 'D': enqueue(queueD, newVehicle); break;
-                    default: free(newVehicle);
-                }
-            }
+        LineReader reader;
+        initLineReader(&reader, file);
+        const char* line;
+        size_t length;
+        ParsedVehicle parsed;
+        while (readLine(&reader, &line, &length)) {
+            if (!parseRecordLine(VEHICLE_FILE, reader.lineNumber, line, length, &parsed)) continue;
+            if (!admitPlate(parsed.plate)) continue; // already queued on an earlier pass
+            Vehicle* newVehicle = createVehicle(parsed.plate, parsed.road, parsed.laneNumber, parsed.isEmergency);
+            if (!enqueue(queueForRoad(newVehicle->lane), newVehicle))
+                free(newVehicle);
         }
+        freeLineReader(&reader);
         fclose(file);
         sleep(2);
     }
@@ -841,11 +3967,11 @@ void* readAndParseFile(void* arg) {
 }
 
 // drwaing a single vehicle as a colored rectangle and optionally display its ID.
-void drawVehicle(SDL_Renderer *renderer, TTF_Font *font, Vehicle *v, int pos) {
+// Screen rectangle a vehicle is drawn in; also its footprint for conflict
+// detection. Turning vehicles are centred on turnPosX/turnPosY.
+SDL_Rect getVehicleRect(const Vehicle *v) {
     int w = 20, h = 10;
     int x = 0, y = 0;
-    // Lateral separation offset based on queue position
-    int offset = (pos % 2 == 0) ? -10 : 10;
 
     if (v->turning) {
         // Use the turning coordinates if the vehicle is turning
@@ -886,19 +4012,29 @@ void drawVehicle(SDL_Renderer *renderer, TTF_Font *font, Vehicle *v, int pos) {
                 }
             }
     }
-    
+    if (v->turning) {
+        x -= w/2;
+        y -= h/2;
+    }
+    SDL_Rect rect = { x, y, w, h };
+    return rect;
+}
+
+void drawVehicle(SDL_Renderer *renderer, TTF_Font *font, const Vehicle *v) {
+    // Create the vehicle rectangle
+    SDL_Rect vehicleRect = getVehicleRect(v);
+    int w = vehicleRect.w, h = vehicleRect.h;
+
     if(v->isEmergency)
         SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
     else
         SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
 
-    // Create the vehicle rectangle
-    SDL_Rect vehicleRect = { x, y, w, h };
-    
     // If vehicle is rotating, use SDL's rotation capabilities
     if (v->turning && fabs(v->angle) > 0.1f) {
         // Create a texture for the rotated vehicle
         SDL_Surface* vehicleSurface = SDL_CreateRGBSurface(0, w, h, 32, 0, 0, 0, 0);
+        countAllocation();
         if (vehicleSurface) {
             // Fill the surface with the vehicle color
             SDL_FillRect(vehicleSurface, NULL, 
@@ -908,87 +4044,1149 @@ void drawVehicle(SDL_Renderer *renderer, TTF_Font *font, Vehicle *v, int pos) {
             // Create texture from surface
             SDL_Texture* vehicleTexture = SDL_CreateTextureFromSurface(renderer, vehicleSurface);
             if (vehicleTexture) {
-                // Define destination rectangle
-                SDL_Rect dstRect = { x - w/2, y - h/2, w, h };
-                
                 // Render the rotated vehicle
-                SDL_RenderCopyEx(renderer, vehicleTexture, NULL, &dstRect, 
+                SDL_RenderCopyEx(renderer, vehicleTexture, NULL, &vehicleRect, 
                                 v->angle, NULL, SDL_FLIP_NONE);
                 
                 // Clean up
                 SDL_DestroyTexture(vehicleTexture);
             }
-            SDL_FreeSurface(vehicleSurface);
+            SDL_FreeSurface(vehicleSurface);
+        }
+    } else {
+        // Draw normally for non-rotating vehicles
+        SDL_RenderFillRect(renderer, &vehicleRect);
+    }
+    // SDL_Rect rect = { x, y, w, h };
+    // SDL_RenderFillRect(renderer, &rect);
+    
+    // PlateText idLabel = plateText(v->plate);
+    // // displayText(renderer, font, idLabel, x, y - h - 2);
+}
+
+// Level of detail for long queues. Vehicles entirely outside the window are
+// never drawn. Above lodThreshold vehicles waiting short of the stop line on
+// one approach (--lod n, toggled with L), those are drawn as one band per
+// lane instead: the union of their rectangles clipped to the window, with the
+// count beside it. Emergency vehicles and anything past the stop line are
+// still drawn one by one. Drawing then costs what fits on screen, however
+// long the queues get.
+
+// Clips rect to the window; false when nothing is left.
+bool clipToWindow(SDL_Rect* rect) {
+    int x1 = rect->x > 0 ? rect->x : 0;
+    int y1 = rect->y > 0 ? rect->y : 0;
+    int x2 = rect->x + rect->w < WINDOW_WIDTH ? rect->x + rect->w : WINDOW_WIDTH;
+    int y2 = rect->y + rect->h < WINDOW_HEIGHT ? rect->y + rect->h : WINDOW_HEIGHT;
+    if (x2 <= x1 || y2 <= y1) return false;
+    *rect = (SDL_Rect){ x1, y1, x2 - x1, y2 - y1 };
+    return true;
+}
+
+void growRect(SDL_Rect* bounds, const SDL_Rect* rect) {
+    int x2 = bounds->x + bounds->w > rect->x + rect->w ? bounds->x + bounds->w : rect->x + rect->w;
+    int y2 = bounds->y + bounds->h > rect->y + rect->h ? bounds->y + bounds->h : rect->y + rect->h;
+    if (rect->x < bounds->x) bounds->x = rect->x;
+    if (rect->y < bounds->y) bounds->y = rect->y;
+    bounds->w = x2 - bounds->x;
+    bounds->h = y2 - bounds->y;
+}
+
+// Still queued on its approach, so it may be folded into a band.
+bool lodQueued(const Vehicle* v) {
+    return !v->turning && !v->crossedStopLine && !v->isEmergency;
+}
+
+// drawing vehicles from all queues, as copied into the snapshot.
+void drawVehicles(SDL_Renderer *renderer, TTF_Font *font, const RenderSnapshot* snapshot) {
+    VehicleDrawStats stats = { 0 };
+    int queued[NUM_ROADS] = { 0 };
+    if (lodThreshold > 0)
+        for (int i = 0; i < snapshot->vehicleCount; i++) {
+            const Vehicle* v = &snapshot->vehicles[i].vehicle;
+            if (lodQueued(v)) queued[v->lane - 'A']++;
+        }
+    SDL_Rect bands[NUM_ROADS][3];
+    int bandCounts[NUM_ROADS][3] = { { 0 } };
+    for (int i = 0; i < snapshot->vehicleCount; i++) {
+        const Vehicle* v = &snapshot->vehicles[i].vehicle;
+        SDL_Rect rect = getVehicleRect(v);
+        int road = v->lane - 'A';
+        if (lodThreshold > 0 && queued[road] > lodThreshold && lodQueued(v)) {
+            int lane = v->lane_number - 1;
+            if (bandCounts[road][lane]++ == 0) bands[road][lane] = rect;
+            else growRect(&bands[road][lane], &rect);
+            stats.aggregated++;
+            continue;
+        }
+        if (!clipToWindow(&rect)) {
+            stats.culled++;
+            continue;
+        }
+        drawVehicle(renderer, font, v);
+        stats.drawn++;
+    }
+
+    TTF_Font* smallFont = getSmallFont();
+    for (int road = 0; road < NUM_ROADS; road++) {
+        if (queued[road] <= lodThreshold || lodThreshold == 0) continue;
+        bool labelled = false;
+        for (int lane = 0; lane < 3; lane++) {
+            SDL_Rect band = bands[road][lane];
+            if (bandCounts[road][lane] == 0 || !clipToWindow(&band)) continue;
+            SDL_SetRenderDrawColor(renderer, 120, 120, 220, 255);
+            SDL_RenderFillRect(renderer, &band);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
+            SDL_RenderDrawRect(renderer, &band);
+            stats.bands++;
+            if (!labelled && smallFont) {
+                char label[16];
+                snprintf(label, sizeof(label), "%d", queued[road]);
+                displayDynamicText(renderer, smallFont, label, band.x + 2, band.y + 2);
+                labelled = true;
+            }
+        }
+    }
+    vehicleDrawStats = stats;
+}
+
+// Draws one frame of the snapshot; the caller presents it.
+void drawFrame(SDL_Renderer *renderer, TTF_Font *font, const RenderSnapshot* snapshot) {
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderClear(renderer);
+    {
+        TRACE_SCOPE("drawRoadsAndLane");
+        drawRoadsAndLane(renderer, font);
+    }
+    {
+        TRACE_SCOPE("drawLights");
+        drawLights(renderer, &snapshot->signal);
+    }
+    {
+        TRACE_SCOPE("drawVehicles");
+        drawVehicles(renderer, font, snapshot);
+    }
+    {
+        TRACE_SCOPE("drawUI");
+        drawUI(renderer, snapshot);
+        drawPerfHud(renderer);
+    }
+}
+
+// One simulation step: move vehicles, apply the controller's light and
+// publish the result for the renderer.
+void simulationTick(SharedData* sharedData) {
+    {
+        TRACE_SCOPE("updateVehicles");
+        updateVehicles(sharedData);
+    }
+    advanceLight(sharedData);
+    if (trajectory.file) recordTrajectory(sharedData);
+    {
+        TRACE_SCOPE("publishSnapshot");
+        publishSnapshot(sharedData);
+    }
+}
+
+// --sim-thread: ticks the simulation at --tick-hz on its own thread, so the
+// display rate no longer limits it and drawing no longer delays it.
+void* runSimulation(void* arg) {
+    SharedData* sharedData = (SharedData*)arg;
+    traceRegisterThread("simulation");
+    uint64_t periodUs = 1000000 / simConfig.tickHz;
+    uint64_t nextTickUs = getTimeUs();
+    while (atomic_load(&simulationRunning)) {
+        uint64_t startUs = getTimeUs();
+        simulationTick(sharedData);
+        uint64_t now = getTimeUs();
+        atomic_store(&lastTickUs, now - startUs);
+        nextTickUs += periodUs;
+        if (nextTickUs > now)
+            usleep(nextTickUs - now);
+        else
+            nextTickUs = now; // fell behind: carry on rather than burst to catch up
+    }
+    return NULL;
+}
+
+// --deterministic: one ordered schedule per tick on the main thread. The clock
+// moves by a fixed 1000 / --tick-hz ms. Vehicles from vehicles.data arrive one
+// per LOCKSTEP_ARRIVAL_MS of simulated time, as processVehiclesSequentially()
+// paces them. Then the controller runs, then vehicles move and the light is
+// applied. Nothing in the simulation draws random numbers, so there is no
+// seed: two runs of the same build and input reach the same state. With
+// --state-hash n a rolling FNV-1a hash of that state is printed every n
+// ticks. Diffing those lines shows the first tick where two builds diverge,
+// and the ticks/s at exit compares their speed.
+#define LOCKSTEP_ARRIVAL_MS 1000
+#define LOCKSTEP_MAX_TICKS_PER_FRAME 64
+#define LOCKSTEP_IDLE_STOP_MS 60000     // headless: stop when nothing has crossed or left for this long
+
+typedef struct {
+    Uint32 tickMs;
+    unsigned long long ticks;
+    uint64_t vehicleTicks;
+    uint64_t hash;
+    FILE* feed;
+    LineReader reader;
+    bool feedDone;
+    Uint32 nextArrivalMs;
+    uint64_t progress;          // stop-line crossings + vehicles retired
+    Uint32 progressMs;          // when progress last changed
+    Uint32 nextCheckpointMs;
+    bool restored;              // started from a checkpoint
+    unsigned long long baseTicks; // ticks already done when the wall clock started
+    uint64_t startUs;
+} LockstepRun;
+
+LockstepRun lockstepRun;
+
+// Before the controller starts, so a restored state is the first it sees.
+bool startLockstep(SharedData* sharedData) {
+    lockstepRun.tickMs = simConfig.tickHz < 1000 ? 1000 / simConfig.tickHz : 1;
+    lockstepRun.hash = 14695981039346656037ull;
+    lockstepRun.feed = fopen(VEHICLE_FILE, "r");
+    if (lockstepRun.feed)
+        initLineReader(&lockstepRun.reader, lockstepRun.feed);
+    else
+        perror("Error opening file");
+    lockstepRun.feedDone = !lockstepRun.feed;
+    if (simConfig.seekMs >= 0 && simConfig.checkpointDir)
+        return restoreNearestCheckpoint(sharedData, (Uint32)simConfig.seekMs);
+    return true;
+}
+
+// After the controller has started: --seek fast-forwards from wherever
+// startLockstep() left the clock, then the wall clock starts.
+void seekLockstep(SharedData* sharedData) {
+    lockstepWaitForController();
+    LockstepRun* run = &lockstepRun;
+    if (simConfig.seekMs >= 0) {
+        uint64_t seekStartUs = getTimeUs();
+        Uint32 fromMs = simClockMs;
+        while ((long long)simClockMs + run->tickMs <= simConfig.seekMs)
+            lockstepTick(sharedData);
+        printf("Seek: fast-forwarded %.1f s to %.3f s in %.2f s\n", (simClockMs - fromMs) / 1000.0,
+               simClockMs / 1000.0, (getTimeUs() - seekStartUs) / 1e6);
+        fflush(stdout);
+    }
+    if (simConfig.checkpointDir && simClockMs == 0) {
+        run->nextCheckpointMs = 0;
+        checkpointIfDue(sharedData);
+    }
+    run->baseTicks = run->ticks;
+    run->startUs = getTimeUs();
+}
+
+uint64_t hashBytes(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+#define HASH_FIELD(h, field) ((h) = hashBytes((h), &(field), sizeof(field)))
+
+// Everything that decides what happens next: clock, light, the emergency
+// vehicles waiting per road, and every vehicle in queue order. Field by field,
+// so struct padding never gets in.
+uint64_t hashSimulationState(uint64_t h, SharedData* sharedData) {
+    SignalState signal = readSignal(&sharedData->current);
+    HASH_FIELD(h, simClockMs);
+    HASH_FIELD(h, signal.phase);
+    HASH_FIELD(h, signal.greenMask);
+    HASH_FIELD(h, signal.amberMask);
+    HASH_FIELD(h, signal.phaseStartMs);
+    HASH_FIELD(h, signal.durationMs);
+    HASH_FIELD(h, signal.reason);
+    VehicleQueue* queues[NUM_ROADS] = { queueA, queueB, queueC, queueD };
+    for (int r = 0; r < NUM_ROADS; r++) {
+        int waiting = atomic_load(&emergencyWaiting[r]);
+        uint64_t arrivalUs = atomic_load(&emergencyArrivalUs[r]);
+        HASH_FIELD(h, waiting);
+        HASH_FIELD(h, arrivalUs);
+        VehicleQueue* queue = queues[r];
+        HASH_FIELD(h, queue->size);
+        for (int i = 0; i < queue->size; i++) {
+            const Vehicle* v = queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+            HASH_FIELD(h, v->plate);
+            HASH_FIELD(h, v->lane);
+            HASH_FIELD(h, v->lane_number);
+            HASH_FIELD(h, v->animPos);
+            HASH_FIELD(h, v->turning);
+            HASH_FIELD(h, v->turnProgress);
+            HASH_FIELD(h, v->turnPosX);
+            HASH_FIELD(h, v->turnPosY);
+            HASH_FIELD(h, v->angle);
+            HASH_FIELD(h, v->targetAngle);
+            HASH_FIELD(h, v->enterTimeMs);
+            HASH_FIELD(h, v->stopLineTimeMs);
+            HASH_FIELD(h, v->crossedStopLine);
+            HASH_FIELD(h, v->yieldingSinceMs);
+            HASH_FIELD(h, v->awaitingGreen);
+            HASH_FIELD(h, v->preemptExpired);
+        }
+    }
+    return h;
+}
+
+// Writes the checkpoint that is due, unless the controller is parked mid-pass:
+// then it stays due until a tick where the controller is at the end of one.
+void checkpointIfDue(SharedData* sharedData) {
+    LockstepRun* run = &lockstepRun;
+    if (!simConfig.checkpointDir || (Sint32)(simClockMs - run->nextCheckpointMs) < 0) return;
+    if (lockstep.controllerStarted && !lockstep.atPassEnd) return;
+    writeCheckpoint(sharedData);
+    run->nextCheckpointMs = simClockMs - simClockMs % simConfig.checkpointEveryMs + simConfig.checkpointEveryMs;
+}
+
+void lockstepTick(SharedData* sharedData) {
+    TRACE_SCOPE("lockstep tick");
+    LockstepRun* run = &lockstepRun;
+    simClockMs += run->tickMs;
+    while (!run->feedDone && (Sint32)(simClockMs - run->nextArrivalMs) >= 0) {
+        bool valid;
+        if (!ingestNextLine(&run->reader, &valid))
+            run->feedDone = true;
+        else if (valid)
+            run->nextArrivalMs += LOCKSTEP_ARRIVAL_MS;
+    }
+    lockstepResumeController();
+    {
+        TRACE_SCOPE("updateVehicles");
+        updateVehicles(sharedData);
+    }
+    advanceLight(sharedData);
+    if (trajectory.file) recordTrajectory(sharedData);
+    if (!simConfig.headless) {
+        TRACE_SCOPE("publishSnapshot");
+        publishSnapshot(sharedData);
+    }
+    run->ticks++;
+    run->vehicleTicks += queueA->size + queueB->size + queueC->size + queueD->size;
+    if (simConfig.hashEvery > 0 && run->ticks % simConfig.hashEvery == 0) {
+        run->hash = hashSimulationState(run->hash, sharedData);
+        printf("State hash at tick %llu (%u ms): %016llx\n", run->ticks, simClockMs,
+               (unsigned long long)run->hash);
+    }
+    checkpointIfDue(sharedData);
+}
+
+// A run ends at --ticks. Headless, it also ends once the file is read and
+// either every vehicle has left or none has crossed a stop line or left the
+// screen for LOCKSTEP_IDLE_STOP_MS (some can wait forever).
+bool lockstepFinished() {
+    LockstepRun* run = &lockstepRun;
+    if (simConfig.maxTicks > 0 && run->ticks >= (unsigned long long)simConfig.maxTicks) return true;
+    if (!simConfig.headless || !run->feedDone) return false;
+    uint64_t progress = totalDelayStats.waitTime.total + totalDelayStats.travelTime.total;
+    if (progress != run->progress) {
+        run->progress = progress;
+        run->progressMs = simClockMs;
+    }
+    return queueA->size + queueB->size + queueC->size + queueD->size == 0 ||
+           simClockMs - run->progressMs > LOCKSTEP_IDLE_STOP_MS;
+}
+
+// With a window: the ticks that wall time calls for since the start, at
+// most LOCKSTEP_MAX_TICKS_PER_FRAME a frame. How they are spread over frames
+// doesn't change the result.
+void lockstepCatchUp(SharedData* sharedData) {
+    uint64_t dueTicks = lockstepRun.baseTicks + (getTimeUs() - lockstepRun.startUs) / 1000 / lockstepRun.tickMs;
+    for (int n = 0; n < LOCKSTEP_MAX_TICKS_PER_FRAME && lockstepRun.ticks < dueTicks && !lockstepFinished(); n++)
+        lockstepTick(sharedData);
+}
+
+void printLockstepReport(SharedData* sharedData) {
+    LockstepRun* run = &lockstepRun;
+    double wallSeconds = (getTimeUs() - run->startUs) / 1e6;
+    uint64_t finalHash = hashSimulationState(run->hash, sharedData);
+    printf("\n=== Deterministic run ===\n");
+    printf("Ticks: %llu x %u ms (%.1f s simulated) in %.2f s\n", run->ticks, run->tickMs,
+           simClockMs / 1000.0, wallSeconds);
+    if (wallSeconds > 0)
+        printf("Speed: %.0f ticks/s, %.0f vehicle-ticks/s\n", run->ticks / wallSeconds,
+               run->vehicleTicks / wallSeconds);
+    printf("Final state hash: %016llx\n", (unsigned long long)finalHash);
+    fflush(stdout);
+}
+
+float easeInOutQuad(float t) {
+    return t < 0.5f ? 2.0f * t * t : -1.0f + (4.0f - 2.0f * t) * t;
+}
+
+void calculateTurnCurve(float t, float startX, float startY, float controlX, float controlY, 
+                       float endX, float endY, float* outX, float* outY) {
+    *outX = (1-t)*(1-t)*startX + 2*(1-t)*t*controlX + t*t*endX;
+    *outY = (1-t)*(1-t)*startY + 2*(1-t)*t*controlY + t*t*endY;
+}
+
+bool processTurn(Vehicle* v, Uint32 delta, 
+                 float startX, float startY, float controlX, float controlY, 
+                 float endX, float endY, char newLane, int newLaneNum, float newAnimPos) {
+    v->turnProgress += delta * TURN_SPEED;
+    if (v->turnProgress > 1.0f)
+        v->turnProgress = 1.0f;
+    float t = easeInOutQuad(v->turnProgress);
+    calculateTurnCurve(t, startX, startY, controlX, controlY, endX, endY,
+                         &v->turnPosX, &v->turnPosY);
+    if (v->turnProgress >= 1.0f) {
+        v->lane = newLane;
+        v->lane_number = newLaneNum;
+        v->animPos = newAnimPos;
+        v->turning = false;
+        v->turnProgress = 0.0f;
+        return true;
+    }
+    return false;
+}
+
+// Intersection conflict detection. At the start of every tick the footprint
+// of every vehicle goes into a uniform spatial hash (CONFLICT_CELL px cells
+// hashed into CONFLICT_BUCKETS lists). After a queue has moved, a vehicle whose
+// new footprint inside the junction comes within JUNCTION_CLEARANCE of crossing
+// traffic that has priority over it yields: its move is undone for this tick.
+// Vehicles held at a red light are not given way to (they would never clear);
+// running into one shows up as a collision. A query only visits the cells under
+// one footprint, so the whole pass is O(n) however many queues there are.
+// Overlapping pairs are tracked everywhere, but only a pair that first touches
+// inside the junction counts as a collision: the queue spacing can leave two
+// vehicles on top of each other at a red light, and that is not a conflict.
+#define CONFLICT_CELL 32
+#define CONFLICT_BUCKETS 512
+#define CONFLICT_MAX_FOOTPRINTS (2 * NUM_ROADS * MAX_QUEUE_SIZE)   // old + new per vehicle
+#define CONFLICT_MAX_LINKS (4 * CONFLICT_MAX_FOOTPRINTS)           // a footprint spans <= 2x2 cells
+#define CONFLICT_MAX_PAIRS 256
+#define JUNCTION_CLEARANCE 10   // gap kept to crossing traffic with priority
+#define YIELD_TIMEOUT_MS 3000   // then go anyway, so a ring of yields can't deadlock
+#define JUNCTION_LEFT (WINDOW_WIDTH/2 - ROAD_WIDTH/2)
+#define JUNCTION_TOP (WINDOW_HEIGHT/2 - ROAD_WIDTH/2)
+
+typedef struct {
+    const Vehicle* vehicle;     // compared only, never dereferenced
+    SDL_Rect rect;
+    bool live;                  // false once the vehicle has moved on
+    bool crossing;              // past its stop line or turning: traffic to give way to
+    Uint32 priorityMs;          // when it crossed its stop line, earlier goes first
+    PlateKey plate;             // then the lower plate: addresses differ after a restore
+    char lane;                  // lane it was in when the footprint was taken
+    int laneNumber;
+} Footprint;
+
+typedef struct {
+    int footprint;
+    int next;                   // next link in the bucket, -1 = end
+} CellLink;
+
+typedef struct {
+    const Vehicle* first;       // lower address first
+    const Vehicle* second;
+} CollisionPair;
+
+typedef struct {
+    int buckets[CONFLICT_BUCKETS];
+    Footprint footprints[CONFLICT_MAX_FOOTPRINTS];
+    int footprintCount;
+    CellLink links[CONFLICT_MAX_LINKS];
+    int linkCount;
+    CollisionPair pairs[2][CONFLICT_MAX_PAIRS];     // overlapping now / last tick
+    int pairCount[2];
+    int currentPairs;
+    Uint32 startMs;
+    uint64_t yields;            // vehicle-ticks spent giving way
+    uint64_t forcedEntries;     // yields abandoned after YIELD_TIMEOUT_MS
+    uint64_t collisions;        // overlaps that began in the junction
+} ConflictGrid;
+
+ConflictGrid conflictGrid;
+
+// Position state the movement code changes, so a yield can undo a move.
+typedef struct {
+    char lane;
+    int lane_number;
+    float animPos;
+    bool turning;
+    float turnProgress;
+    float turnPosX;
+    float turnPosY;
+    float angle;
+} VehicleMotion;
+
+bool rectsOverlap(const SDL_Rect* a, const SDL_Rect* b) {
+    return a->x < b->x + b->w && b->x < a->x + a->w &&
+           a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+bool inJunction(const SDL_Rect* r) {
+    SDL_Rect junction = { JUNCTION_LEFT, JUNCTION_TOP, ROAD_WIDTH, ROAD_WIDTH };
+    return rectsOverlap(r, &junction);
+}
+
+int conflictBucket(int cellX, int cellY) {
+    return (int)(((unsigned)cellX * 73856093u ^ (unsigned)cellY * 19349663u) & (CONFLICT_BUCKETS - 1));
+}
+
+int floorCell(int coordinate) {
+    return coordinate >= 0 ? coordinate / CONFLICT_CELL : -((-coordinate + CONFLICT_CELL - 1) / CONFLICT_CELL);
+}
+
+Uint32 junctionPriority(const Vehicle* v) {
+    return v->crossedStopLine ? v->stopLineTimeMs : UINT32_MAX;
+}
+
+// Whether v must give way to the vehicle behind footprint f: crossing
+// traffic that got to the junction first. The order is strict, so two
+// vehicles can never wait for each other.
+bool mustGiveWay(const Vehicle* v, const Footprint* f) {
+    Uint32 mine = junctionPriority(v);
+    return f->crossing && (f->priorityMs < mine || (f->priorityMs == mine &&
+                           (f->plate < v->plate || (f->plate == v->plate && f->vehicle < v))));
+}
+
+void addFootprint(Vehicle* v) {
+    ConflictGrid* g = &conflictGrid;
+    if (g->footprintCount == CONFLICT_MAX_FOOTPRINTS) return;
+    int index = g->footprintCount++;
+    Footprint* f = &g->footprints[index];
+    f->vehicle = v;
+    f->rect = getVehicleRect(v);
+    f->live = true;
+    f->crossing = v->crossedStopLine || v->turning;
+    f->priorityMs = junctionPriority(v);
+    f->plate = v->plate;
+    f->lane = v->lane;
+    f->laneNumber = v->lane_number;
+    v->footprint = index;
+    for (int cy = floorCell(f->rect.y); cy <= floorCell(f->rect.y + f->rect.h - 1); cy++)
+        for (int cx = floorCell(f->rect.x); cx <= floorCell(f->rect.x + f->rect.w - 1); cx++) {
+            if (g->linkCount == CONFLICT_MAX_LINKS) return;
+            int bucket = conflictBucket(cx, cy);
+            g->links[g->linkCount] = (CellLink){ index, g->buckets[bucket] };
+            g->buckets[bucket] = g->linkCount++;
+        }
+}
+
+// The vehicle's live footprint, or NULL if it was queued after the grid was built.
+Footprint* currentFootprint(const Vehicle* v) {
+    ConflictGrid* g = &conflictGrid;
+    if (v->footprint < 0 || v->footprint >= g->footprintCount) return NULL;
+    Footprint* f = &g->footprints[v->footprint];
+    return f->vehicle == v && f->live ? f : NULL;
+}
+
+// Live footprint other than self's that overlaps rect, lowest first and
+// after the footprint passed as after (NULL = from the start), or NULL.
+const Footprint* findOverlap(const SDL_Rect* rect, const Vehicle* self, const Footprint* after) {
+    ConflictGrid* g = &conflictGrid;
+    const Footprint* found = NULL;
+    for (int cy = floorCell(rect->y); cy <= floorCell(rect->y + rect->h - 1); cy++)
+        for (int cx = floorCell(rect->x); cx <= floorCell(rect->x + rect->w - 1); cx++)
+            for (int l = g->buckets[conflictBucket(cx, cy)]; l >= 0; l = g->links[l].next) {
+                const Footprint* f = &g->footprints[g->links[l].footprint];
+                if (!f->live || f->vehicle == self || (after && f <= after) || (found && f >= found)) continue;
+                if (rectsOverlap(rect, &f->rect)) found = f;
+            }
+    return found;
+}
+
+// Rebuilds the grid from every queue at the start of a tick.
+void beginConflictTick(Uint32 now) {
+    ConflictGrid* g = &conflictGrid;
+    if (g->startMs == 0) g->startMs = now;
+    memset(g->buckets, -1, sizeof(g->buckets));
+    g->footprintCount = 0;
+    g->linkCount = 0;
+    VehicleQueue* queues[NUM_ROADS] = { queueA, queueB, queueC, queueD };
+    for (int r = 0; r < NUM_ROADS; r++) {
+        lockQueue(queues[r], LOCK_SITE_UPDATE);
+        for (int i = 0; i < queues[r]->size; i++)
+            addFootprint(queues[r]->vehicles[(queues[r]->front + i) % MAX_QUEUE_SIZE]);
+        unlockQueue(queues[r]);
+    }
+}
+
+void saveMotion(VehicleQueue* queue, VehicleMotion* saved) {
+    for (int i = 0; i < queue->size; i++) {
+        const Vehicle* v = queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+        saved[i] = (VehicleMotion){ v->lane, v->lane_number, v->animPos, v->turning,
+                                    v->turnProgress, v->turnPosX, v->turnPosY, v->angle };
+    }
+}
+
+// After queue has moved: undo the move of every vehicle that would run into
+// another in the junction, and record the new footprints of the rest. Caller
+// holds the queue lock; saved is what saveMotion() stored before the move.
+void resolveConflicts(VehicleQueue* queue, const VehicleMotion* saved, Uint32 now) {
+    ConflictGrid* g = &conflictGrid;
+    for (int i = 0; i < queue->size; i++) {
+        Vehicle* v = queue->vehicles[(queue->front + i) % MAX_QUEUE_SIZE];
+        Footprint* old = currentFootprint(v);
+        SDL_Rect rect = getVehicleRect(v);
+        if (old && old->rect.x == rect.x && old->rect.y == rect.y) continue;
+
+        const Footprint* blocker = NULL;
+        SDL_Rect clearance = { rect.x - JUNCTION_CLEARANCE, rect.y - JUNCTION_CLEARANCE,
+                               rect.w + 2 * JUNCTION_CLEARANCE, rect.h + 2 * JUNCTION_CLEARANCE };
+        if (old && inJunction(&clearance)) {
+            for (const Footprint* f = findOverlap(&clearance, v, NULL); f; f = findOverlap(&clearance, v, f)) {
+                // A new conflict, or the vehicle ahead in our own lane that we
+                // queued on top of; other conflicts we were already in don't hold us.
+                bool sameLane = f->lane == saved[i].lane && f->laneNumber == saved[i].lane_number;
+                if (mustGiveWay(v, f) && (sameLane || !rectsOverlap(&old->rect, &f->rect))) {
+                    blocker = f;
+                    break;
+                }
+            }
         }
-    } else {
-        // Draw normally for non-rotating vehicles
-        SDL_RenderFillRect(renderer, &vehicleRect);
+        if (blocker) {
+            if (v->yieldingSinceMs == 0) v->yieldingSinceMs = now;
+            if (now - v->yieldingSinceMs < YIELD_TIMEOUT_MS) {
+                const VehicleMotion* m = &saved[i];
+                v->lane = m->lane;
+                v->lane_number = m->lane_number;
+                v->animPos = m->animPos;
+                v->turning = m->turning;
+                v->turnProgress = m->turnProgress;
+                v->turnPosX = m->turnPosX;
+                v->turnPosY = m->turnPosY;
+                v->angle = m->angle;
+                g->yields++;
+                continue;
+            }
+            g->forcedEntries++;
+        }
+        v->yieldingSinceMs = 0;
+        if (old) old->live = false;
+        addFootprint(v);
     }
-    // SDL_Rect rect = { x, y, w, h };
-    // SDL_RenderFillRect(renderer, &rect);
-    
-    // char idLabel[MAX_VEHICLE_ID];
-    // strncpy(idLabel, v->id, MAX_VEHICLE_ID);
-    // idLabel[MAX_VEHICLE_ID-1] = '\0';
-    // // displayText(renderer, font, idLabel, x, y - h - 2);
 }
 
-// drawing vehicles from a given queue.
-void drawVehiclesFromQueue(SDL_Renderer *renderer, TTF_Font *font, VehicleQueue *queue) {
-    pthread_mutex_lock(&queue->lock);
-    for (int i = 0; i < queue->size; i++) {
-        int idx = (queue->front + i) % MAX_QUEUE_SIZE;
-        drawVehicle(renderer, font, queue->vehicles[idx], i);
+bool knownPair(const CollisionPair* pairs, int count, const CollisionPair* pair) {
+    for (int i = 0; i < count; i++)
+        if (pairs[i].first == pair->first && pairs[i].second == pair->second) return true;
+    return false;
+}
+
+// End of tick: every pair of overlapping footprints, counting the ones that
+// were not overlapping the tick before and touch in the junction as collisions.
+void detectCollisions() {
+    ConflictGrid* g = &conflictGrid;
+    int cur = g->currentPairs ^= 1;
+    const CollisionPair* before = g->pairs[cur ^ 1];
+    g->pairCount[cur] = 0;
+    for (int i = 0; i < g->footprintCount; i++) {
+        const Footprint* f = &g->footprints[i];
+        if (!f->live) continue;
+        for (const Footprint* o = findOverlap(&f->rect, f->vehicle, f); o; o = findOverlap(&f->rect, f->vehicle, o)) {
+            CollisionPair pair = { f->vehicle < o->vehicle ? f->vehicle : o->vehicle,
+                                   f->vehicle < o->vehicle ? o->vehicle : f->vehicle };
+            if (knownPair(g->pairs[cur], g->pairCount[cur], &pair)) continue;
+            if (g->pairCount[cur] == CONFLICT_MAX_PAIRS) break;
+            g->pairs[cur][g->pairCount[cur]++] = pair;
+            if (!knownPair(before, g->pairCount[cur ^ 1], &pair) && inJunction(&f->rect) && inJunction(&o->rect)) {
+                g->collisions++;
+                printf("Collision in the junction at (%d, %d)\n", f->rect.x, f->rect.y);
+            }
+        }
     }
-    pthread_mutex_unlock(&queue->lock);
 }
 
-// drawing vehicles from all queues.
-void drawVehicles(SDL_Renderer *renderer, TTF_Font *font) {
-    drawVehiclesFromQueue(renderer, font, queueA);
-    drawVehiclesFromQueue(renderer, font, queueB);
-    drawVehiclesFromQueue(renderer, font, queueC);
-    drawVehiclesFromQueue(renderer, font, queueD);
+void printConflictReport() {
+    ConflictGrid* g = &conflictGrid;
+    if (g->startMs == 0) return;
+    double hours = (getSimTimeMs() - g->startMs) / 3600000.0;
+    printf("\n=== Intersection conflicts ===\n");
+    printf("Yields: %llu vehicle-ticks, %llu gave up after %d s\n",
+           (unsigned long long)g->yields, (unsigned long long)g->forcedEntries, YIELD_TIMEOUT_MS / 1000);
+    printf("Collisions: %llu (%.1f per hour over %.1f min)\n", (unsigned long long)g->collisions,
+           hours > 0 ? g->collisions / hours : 0.0, hours * 60.0);
+    fflush(stdout);
 }
 
-float easeInOutQuad(float t) {
-    return t < 0.5f ? 2.0f * t * t : -1.0f + (4.0f - 2.0f * t) * t;
+// Tile-reservation intersection manager (--reservations). The junction box is
+// split into RESERVATION_TILE px tiles and time into RESERVATION_SLOT_MS
+// slots. Each lane 2 movement's path is sampled once from its Bezier curve
+// into the tiles it covers per slot. A vehicle at its stop line asks to
+// start now: if none of those tiles is taken in those slots it claims them
+// and goes, whatever the lights show; otherwise it asks again next tick. So
+// movements that never share a tile (A2 and B2, or C2 and D2) cross together.
+#define RESERVATION_TILE 15
+#define RESERVATION_TILES_X (ROAD_WIDTH / RESERVATION_TILE)
+#define RESERVATION_TILE_COUNT (RESERVATION_TILES_X * RESERVATION_TILES_X)
+#define RESERVATION_SLOT_MS 50
+#define RESERVATION_HORIZON 64          // slots in the table, must cover a crossing
+#define RESERVATION_MARGIN 4            // px added around the vehicle when sampling
+#define LANE2_TURN_RATE (0.001f * 0.75f) // turnProgress per ms, as in updateVehicles()
+#define LANE2_TURN_MS 1334             // 1 / LANE2_TURN_RATE, rounded up
+#define RESERVATION_PATH_SLOTS (LANE2_TURN_MS / RESERVATION_SLOT_MS + 2)
+#define MAX_ACTIVE_CROSSINGS 16
+
+typedef struct {
+    uint64_t bits[(RESERVATION_TILE_COUNT + 63) / 64];
+} TileMask;
+
+// Lane 2 turn of each road: start, control and end point, the same curves
+// updateVehicles() follows.
+typedef struct {
+    float startX, startY, controlX, controlY, endX, endY;
+} Movement;
+
+typedef struct {
+    Movement movements[NUM_ROADS];
+    TileMask path[NUM_ROADS][RESERVATION_PATH_SLOTS];   // tiles per slot after the start
+    TileMask table[RESERVATION_HORIZON];                // claimed tiles, ring by slot
+    uint64_t lastSlot;
+    Uint32 activeUntilMs[MAX_ACTIVE_CROSSINGS];         // granted crossings still under way
+    int activeCount;
+    Uint32 lastTickMs;
+    uint64_t busyMs;            // time with at least one crossing under way
+    uint64_t crossingMs;        // sum over crossings of their time under way
+    uint64_t granted;
+    uint64_t denied;            // requests refused (one per waiting tick)
+    Uint32 startMs;
+} ReservationManager;
+
+ReservationManager reservations;
+
+bool maskIntersects(const TileMask* a, const TileMask* b) {
+    for (int i = 0; i < (int)(sizeof(a->bits) / sizeof(a->bits[0])); i++)
+        if (a->bits[i] & b->bits[i]) return true;
+    return false;
 }
 
-void calculateTurnCurve(float t, float startX, float startY, float controlX, float controlY, 
-                       float endX, float endY, float* outX, float* outY) {
-    *outX = (1-t)*(1-t)*startX + 2*(1-t)*t*controlX + t*t*endX;
-    *outY = (1-t)*(1-t)*startY + 2*(1-t)*t*controlY + t*t*endY;
+void maskAdd(TileMask* a, const TileMask* b) {
+    for (int i = 0; i < (int)(sizeof(a->bits) / sizeof(a->bits[0])); i++)
+        a->bits[i] |= b->bits[i];
 }
 
-bool processTurn(Vehicle* v, Uint32 delta, 
-                 float startX, float startY, float controlX, float controlY, 
-                 float endX, float endY, char newLane, int newLaneNum, float newAnimPos) {
-    v->turnProgress += delta * TURN_SPEED;
-    if (v->turnProgress > 1.0f)
-        v->turnProgress = 1.0f;
-    float t = easeInOutQuad(v->turnProgress);
-    calculateTurnCurve(t, startX, startY, controlX, controlY, endX, endY,
-                         &v->turnPosX, &v->turnPosY);
-    if (v->turnProgress >= 1.0f) {
-        v->lane = newLane;
-        v->lane_number = newLaneNum;
-        v->animPos = newAnimPos;
-        v->turning = false;
-        v->turnProgress = 0.0f;
-        return true;
+// Marks the tiles under a vehicle centred on (x, y), clipped to the junction.
+void markTiles(TileMask* mask, float x, float y) {
+    int left = (int)(x - VEHICLE_LENGTH / 2 - RESERVATION_MARGIN) - JUNCTION_LEFT;
+    int right = (int)(x + VEHICLE_LENGTH / 2 + RESERVATION_MARGIN) - JUNCTION_LEFT;
+    int top = (int)(y - VEHICLE_WIDTH / 2 - RESERVATION_MARGIN) - JUNCTION_TOP;
+    int bottom = (int)(y + VEHICLE_WIDTH / 2 + RESERVATION_MARGIN) - JUNCTION_TOP;
+    if (right < 0 || bottom < 0 || left >= ROAD_WIDTH || top >= ROAD_WIDTH) return;
+    if (left < 0) left = 0;
+    if (top < 0) top = 0;
+    if (right >= ROAD_WIDTH) right = ROAD_WIDTH - 1;
+    if (bottom >= ROAD_WIDTH) bottom = ROAD_WIDTH - 1;
+    for (int ty = top / RESERVATION_TILE; ty <= bottom / RESERVATION_TILE; ty++)
+        for (int tx = left / RESERVATION_TILE; tx <= right / RESERVATION_TILE; tx++) {
+            int tile = ty * RESERVATION_TILES_X + tx;
+            mask->bits[tile / 64] |= 1ull << (tile % 64);
+        }
+}
+
+// Samples each road's lane 2 turn into the tiles it covers per slot. Also
+// used by loadSignalPlan(), so it may run more than once.
+void buildMovementPaths() {
+    const float stopA = WINDOW_HEIGHT/2 - ROAD_WIDTH/2 - 20;
+    const float stopB = WINDOW_HEIGHT/2 + ROAD_WIDTH/2 + 20;
+    const float stopC = WINDOW_WIDTH/2 + ROAD_WIDTH/2 + 20;
+    const float stopD = WINDOW_WIDTH/2 - ROAD_WIDTH/2 - 20;
+    const float midX = WINDOW_WIDTH/2, midY = WINDOW_HEIGHT/2;
+    ReservationManager* m = &reservations;
+    m->movements[0] = (Movement){ midX, stopA, midX + 50.0f, (stopA + stopB) / 2, midX, stopB };
+    m->movements[1] = (Movement){ midX, stopB, midX - 50.0f, (stopB + stopA) / 2, midX - LANE_WIDTH, stopA };
+    m->movements[2] = (Movement){ stopC, midY, stopC - 50.0f, midY + 50.0f, stopD, midY + LANE_WIDTH };
+    m->movements[3] = (Movement){ stopD, midY, stopD + 50.0f, midY - 50.0f, stopC, midY - LANE_WIDTH };
+    // Slot k covers the path from a slot before to a slot after, since a
+    // crossing can start anywhere inside its first slot.
+    for (int r = 0; r < NUM_ROADS; r++) {
+        const Movement* mv = &m->movements[r];
+        for (int ms = 0; ms <= LANE2_TURN_MS; ms += 5) {
+            float t = ms * LANE2_TURN_RATE;
+            if (t > 1.0f) t = 1.0f;
+            float x, y;
+            calculateTurnCurve(t, mv->startX, mv->startY, mv->controlX, mv->controlY, mv->endX, mv->endY, &x, &y);
+            TileMask tiles = { { 0 } };
+            markTiles(&tiles, x, y);
+            int slot = ms / RESERVATION_SLOT_MS;
+            for (int k = slot; k <= slot + 1 && k < RESERVATION_PATH_SLOTS; k++)
+                maskAdd(&m->path[r][k], &tiles);
+        }
     }
+}
+
+// Whether the lane 2 turns of roads a and b can share a tile, however far
+// apart they start. On a green stage vehicles start whenever they get there.
+bool movementsConflict(int a, int b) {
+    const ReservationManager* m = &reservations;
+    for (int k = 0; k < RESERVATION_PATH_SLOTS; k++)
+        for (int j = 0; j < RESERVATION_PATH_SLOTS; j++)
+            if (maskIntersects(&m->path[a][k], &m->path[b][j])) return true;
     return false;
 }
 
+void initReservations() {
+    ReservationManager* m = &reservations;
+    buildMovementPaths();
+    m->startMs = m->lastTickMs = getSimTimeMs();
+    m->lastSlot = m->startMs / RESERVATION_SLOT_MS;
+}
+
+// Once per tick: frees slots that have passed and accounts crossings under way.
+void reservationTick(Uint32 now) {
+    ReservationManager* m = &reservations;
+    uint64_t slot = now / RESERVATION_SLOT_MS;
+    for (; m->lastSlot < slot; m->lastSlot++)
+        memset(&m->table[m->lastSlot % RESERVATION_HORIZON], 0, sizeof(TileMask));
+    Uint32 from = m->lastTickMs;
+    m->lastTickMs = now;
+    Uint32 busy = 0;
+    int kept = 0;
+    for (int i = 0; i < m->activeCount; i++) {
+        Uint32 until = m->activeUntilMs[i];
+        Uint32 end = (int32_t)(until - now) < 0 ? until : now;
+        Uint32 underWay = (int32_t)(end - from) > 0 ? end - from : 0;
+        m->crossingMs += underWay;
+        if (underWay > busy) busy = underWay;
+        if ((int32_t)(until - now) > 0) m->activeUntilMs[kept++] = until;
+    }
+    m->busyMs += busy;
+    m->activeCount = kept;
+}
+
+// A lane 2 vehicle at its stop line asks to cross now.
+bool requestReservation(const Vehicle* v, Uint32 now) {
+    ReservationManager* m = &reservations;
+    int road = v->lane - 'A';
+    uint64_t slot = now / RESERVATION_SLOT_MS;
+    for (int k = 0; k < RESERVATION_PATH_SLOTS; k++)
+        if (maskIntersects(&m->table[(slot + k) % RESERVATION_HORIZON], &m->path[road][k])) {
+            m->denied++;
+            return false;
+        }
+    for (int k = 0; k < RESERVATION_PATH_SLOTS; k++)
+        maskAdd(&m->table[(slot + k) % RESERVATION_HORIZON], &m->path[road][k]);
+    if (m->activeCount < MAX_ACTIVE_CROSSINGS)
+        m->activeUntilMs[m->activeCount++] = now + LANE2_TURN_MS;
+    m->granted++;
+    return true;
+}
+
+// Whether a lane 2 vehicle may cross: it is already turning (it clears the
+// junction whatever the light does), its road has green, or with
+// --reservations it gets a reservation at its stop line.
+bool laneMayGo(const Vehicle* v, int greenMask, bool atStopLine, Uint32 now) {
+    if (v->turning) return true;
+    if (!simConfig.reservations) return roadGreen(greenMask, v->lane);
+    return atStopLine && requestReservation(v, now);
+}
+
+void printReservationReport() {
+    ReservationManager* m = &reservations;
+    if (!simConfig.reservations) return;
+    double minutes = (getSimTimeMs() - m->startMs) / 60000.0;
+    uint64_t lane2 = 0;
+    for (int r = 0; r < NUM_ROADS; r++)
+        lane2 += throughput.laneCrossings[r * LANES_PER_ROAD + 1];
+    printf("\n=== Tile reservations ===\n");
+    printf("Granted: %llu, refused: %llu (vehicle-ticks waiting)\n",
+           (unsigned long long)m->granted, (unsigned long long)m->denied);
+    printf("Lane 2 stop-line crossings: %llu (%.1f per minute)\n",
+           (unsigned long long)lane2, minutes > 0 ? lane2 / minutes : 0.0);
+    // Concurrency only: the throughput gain is measured against a heuristic
+    // run by printControllerSummary() with --compare.
+    if (m->busyMs > 0)
+        printf("Crossings under way together: %.2f on average while any is\n",
+               (double)m->crossingMs / m->busyMs);
+    fflush(stdout);
+}
+
+// Checkpoints (--checkpoint-dir, deterministic runs only). Every
+// --checkpoint-every simulated seconds, lockstepTick() writes
+// checkpoint-<ms>.bin: a header with the clock, the position in
+// vehicles.data, both signal states and the lane counters, then one 64-byte
+// record per queued vehicle, then the dedup table and, with --reservations,
+// the reservation table. --seek restores the newest checkpoint at or before
+// the target and fast-forwards tick by tick from there.
+//
+// A checkpoint that falls due while the controller is mid-pass waits for the
+// next tick it is parked in waitAtPassEnd(). The header then holds its
+// ControllerState and wake-up, so the restored run is the same run: a restore
+// whose state hash doesn't match is refused. Statistics and reports are not
+// saved, so they cover only what ran after the restore.
+#define CHECKPOINT_MAGIC "TJCKPT03"
+
+typedef struct {
+    char magic[8];
+    uint32_t tickMs;
+    uint32_t controller;
+    uint32_t reservations;
+    uint32_t clockMs;
+    uint32_t lastUpdateMs;
+    uint32_t nextArrivalMs;
+    uint64_t ticks;
+    uint64_t rollingHash;
+    uint64_t stateHash;         // hashSimulationState() here, checked on restore
+    uint64_t feedOffset;        // byte offset of the next unread line of vehicles.data
+    uint64_t feedLine;
+    uint32_t feedDone;
+    SignalState current;
+    SignalState requested;
+    ControllerState controllerState;
+    uint32_t wakeMs;            // the controller's, parked at the end of a pass
+    uint32_t wakeOnEmergency;
+    int32_t emergencyPending;
+    int32_t emergencyWaiting[NUM_ROADS];
+    uint64_t emergencyArrivalUs[NUM_ROADS];
+    uint64_t lastEmergencyArrivalUs;
+    int32_t laneWaiting[NUM_LANES];
+    int32_t exitOccupancy[NUM_ROADS];
+    LaneRates laneRates[NUM_LANES];
+    uint32_t vehicleCounts[NUM_ROADS];
+    uint64_t dedupCapacity;
+    uint64_t dedupUsed;
+    uint32_t vehicleSerials;
+} CheckpointHeader;
+
+typedef struct {
+    uint64_t plate;
+    float animPos, turnProgress, turnPosX, turnPosY, angle, targetAngle;
+    uint32_t enterTimeMs, stopLineTimeMs, exitTimeMs, yieldingSinceMs;
+    uint32_t serial;
+    char lane, originLane;
+    uint8_t laneNumber, originLaneNumber;
+    uint8_t flags;              // CHECKPOINT_*
+    uint8_t reserved[7];
+} CheckpointVehicle;
+
+_Static_assert(sizeof(CheckpointVehicle) == 64, "CheckpointVehicle must stay 64 bytes");
+
+#define CHECKPOINT_EMERGENCY 0x01
+#define CHECKPOINT_TURNING 0x02
+#define CHECKPOINT_CROSSED 0x04
+#define CHECKPOINT_PREEMPT_EXPIRED 0x08
+#define CHECKPOINT_AWAITING_GREEN 0x10
+
+void writeCheckpoint(SharedData* sharedData) {
+    TRACE_SCOPE("checkpoint");
+    LockstepRun* run = &lockstepRun;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/checkpoint-%010u.bin", simConfig.checkpointDir, simClockMs);
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        perror("Error writing checkpoint");
+        return;
+    }
+    VehicleQueue* queues[NUM_ROADS] = { queueA, queueB, queueC, queueD };
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.tickMs = run->tickMs;
+    h.controller = simConfig.controller;
+    h.reservations = simConfig.reservations;
+    h.clockMs = simClockMs;
+    h.lastUpdateMs = lastUpdateMs;
+    h.nextArrivalMs = run->nextArrivalMs;
+    h.ticks = run->ticks;
+    h.rollingHash = run->hash;
+    h.stateHash = hashSimulationState(14695981039346656037ull, sharedData);
+    h.feedDone = run->feedDone;
+    if (run->feed) {
+        h.feedOffset = (uint64_t)ftell(run->feed) - (run->reader.end - run->reader.start);
+        h.feedLine = run->reader.lineNumber;
+    }
+    h.current = readSignal(&sharedData->current);
+    h.requested = readSignal(&sharedData->requested);
+    h.controllerState = controllerState;
+    h.wakeMs = lockstep.wakeMs;
+    h.wakeOnEmergency = lockstep.wakeOnEmergency;
+    h.emergencyPending = atomic_load(&emergencyPending);
+    h.lastEmergencyArrivalUs = lastEmergencyArrivalUs;
+    for (int r = 0; r < NUM_ROADS; r++) {
+        h.emergencyWaiting[r] = atomic_load(&emergencyWaiting[r]);
+        h.emergencyArrivalUs[r] = atomic_load(&emergencyArrivalUs[r]);
+        h.exitOccupancy[r] = atomic_load(&exitOccupancy[r]);
+        h.vehicleCounts[r] = queues[r]->size;
+    }
+    for (int i = 0; i < NUM_LANES; i++) {
+        h.laneWaiting[i] = atomic_load(&laneWaiting[i]);
+        h.laneRates[i] = laneRates[i];
+    }
+    h.dedupCapacity = dedupSet.capacity;
+    h.dedupUsed = dedupSet.used;
+    h.vehicleSerials = atomic_load(&vehicleSerials);
+    fwrite(&h, sizeof(h), 1, file);
+    for (int r = 0; r < NUM_ROADS; r++) {
+        for (int i = 0; i < queues[r]->size; i++) {
+            const Vehicle* v = queues[r]->vehicles[(queues[r]->front + i) % MAX_QUEUE_SIZE];
+            CheckpointVehicle c = {
+                v->plate, v->animPos, v->turnProgress, v->turnPosX, v->turnPosY, v->angle, v->targetAngle,
+                v->enterTimeMs, v->stopLineTimeMs, v->exitTimeMs, v->yieldingSinceMs, v->serial,
+                v->lane, v->originLane, (uint8_t)v->lane_number, (uint8_t)v->originLaneNumber,
+                (v->isEmergency ? CHECKPOINT_EMERGENCY : 0) | (v->turning ? CHECKPOINT_TURNING : 0) |
+                (v->crossedStopLine ? CHECKPOINT_CROSSED : 0) |
+                (v->preemptExpired ? CHECKPOINT_PREEMPT_EXPIRED : 0) |
+                (v->awaitingGreen ? CHECKPOINT_AWAITING_GREEN : 0), { 0 }
+            };
+            fwrite(&c, sizeof(c), 1, file);
+        }
+    }
+    if (dedupSet.capacity > 0)
+        fwrite(dedupSet.entries, sizeof(DedupEntry), dedupSet.capacity, file);
+    if (simConfig.reservations)
+        fwrite(&reservations, sizeof(reservations), 1, file);
+    if (fclose(file) != 0) perror("Error writing checkpoint");
+}
+
+// Newest checkpoint in --checkpoint-dir at or before targetMs, or false.
+bool findCheckpoint(Uint32 targetMs, char* path, size_t size) {
+    DIR* dir = opendir(simConfig.checkpointDir);
+    if (!dir) {
+        perror("Error opening checkpoint directory");
+        return false;
+    }
+    bool found = false;
+    Uint32 bestMs = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned ms;
+        if (sscanf(entry->d_name, "checkpoint-%u.bin", &ms) != 1 || ms > targetMs) continue;
+        if (!found || ms > bestMs) {
+            found = true;
+            bestMs = ms;
+        }
+    }
+    closedir(dir);
+    if (found) snprintf(path, size, "%s/checkpoint-%010u.bin", simConfig.checkpointDir, bestMs);
+    return found;
+}
+
+bool restoreNearestCheckpoint(SharedData* sharedData, Uint32 targetMs) {
+    char path[512];
+    if (!findCheckpoint(targetMs, path, sizeof(path))) {
+        printf("Seek: no checkpoint at or before %.3f s, starting from the beginning\n", targetMs / 1000.0);
+        return true;
+    }
+    FILE* file = fopen(path, "rb");
+    CheckpointHeader h;
+    if (!file || fread(&h, sizeof(h), 1, file) != 1 || memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "%s: not a checkpoint\n", path);
+        if (file) fclose(file);
+        return false;
+    }
+    LockstepRun* run = &lockstepRun;
+    if (h.tickMs != run->tickMs || h.controller != (uint32_t)simConfig.controller ||
+        h.reservations != (uint32_t)simConfig.reservations) {
+        fprintf(stderr, "%s: written with a different --tick-hz, --controller or --reservations\n", path);
+        fclose(file);
+        return false;
+    }
+    simClockMs = h.clockMs;
+    lastUpdateMs = h.lastUpdateMs;
+    run->ticks = h.ticks;
+    run->hash = h.rollingHash;
+    run->nextArrivalMs = h.nextArrivalMs;
+    run->feedDone = h.feedDone || !run->feed;
+    if (run->feed) {
+        fseek(run->feed, (long)h.feedOffset, SEEK_SET);
+        freeLineReader(&run->reader);
+        initLineReader(&run->reader, run->feed);
+        run->reader.lineNumber = h.feedLine;
+    }
+    writeSignal(&sharedData->current, &h.current);
+    writeSignal(&sharedData->requested, &h.requested);
+    controllerState = h.controllerState;
+    lockstep.wakeMs = h.wakeMs;
+    lockstep.wakeOnEmergency = h.wakeOnEmergency;
+    throughputBeginPhase(h.current.phase, h.current.greenMask, simClockMs);
+    atomic_store(&emergencyPending, h.emergencyPending);
+    atomic_store(&vehicleSerials, h.vehicleSerials);
+    VehicleQueue* queues[NUM_ROADS] = { queueA, queueB, queueC, queueD };
+    bool ok = true;
+    lastEmergencyArrivalUs = h.lastEmergencyArrivalUs;
+    for (int r = 0; r < NUM_ROADS; r++) {
+        atomic_store(&emergencyWaiting[r], h.emergencyWaiting[r]);
+        atomic_store(&emergencyArrivalUs[r], h.emergencyArrivalUs[r]);
+        atomic_store(&exitOccupancy[r], h.exitOccupancy[r]);
+        if (h.vehicleCounts[r] > MAX_QUEUE_SIZE) ok = false;
+    }
+    for (int i = 0; i < NUM_LANES; i++) {
+        atomic_store(&laneWaiting[i], h.laneWaiting[i]);
+        laneRates[i] = h.laneRates[i];
+    }
+    for (int r = 0; r < NUM_ROADS && ok; r++) {
+        for (uint32_t i = 0; i < h.vehicleCounts[r] && ok; i++) {
+            CheckpointVehicle c;
+            if (fread(&c, sizeof(c), 1, file) != 1) {
+                ok = false;
+                break;
+            }
+            Vehicle* v = (Vehicle*)calloc(1, sizeof(Vehicle));
+            v->plate = c.plate;
+            v->lane = c.lane;
+            v->lane_number = c.laneNumber;
+            v->isEmergency = c.flags & CHECKPOINT_EMERGENCY;
+            v->animPos = c.animPos;
+            v->turning = c.flags & CHECKPOINT_TURNING;
+            v->turnProgress = c.turnProgress;
+            v->turnPosX = c.turnPosX;
+            v->turnPosY = c.turnPosY;
+            v->angle = c.angle;
+            v->targetAngle = c.targetAngle;
+            v->originLane = c.originLane;
+            v->originLaneNumber = c.originLaneNumber;
+            v->enterTimeMs = c.enterTimeMs;
+            v->stopLineTimeMs = c.stopLineTimeMs;
+            v->exitTimeMs = c.exitTimeMs;
+            v->crossedStopLine = c.flags & CHECKPOINT_CROSSED;
+            v->preemptExpired = c.flags & CHECKPOINT_PREEMPT_EXPIRED;
+            v->awaitingGreen = c.flags & CHECKPOINT_AWAITING_GREEN;
+            v->yieldingSinceMs = c.yieldingSinceMs;
+            v->serial = c.serial;
+            queues[r]->rear = (queues[r]->rear + 1) % MAX_QUEUE_SIZE;
+            queues[r]->vehicles[queues[r]->rear] = v;
+            queues[r]->size++;
+        }
+    }
+    if (ok && h.dedupCapacity > 0) {
+        free(dedupSet.entries);
+        dedupSet.entries = calloc(h.dedupCapacity, sizeof(DedupEntry));
+        dedupSet.capacity = h.dedupCapacity;
+        dedupSet.used = h.dedupUsed;
+        ok = fread(dedupSet.entries, sizeof(DedupEntry), dedupSet.capacity, file) == dedupSet.capacity;
+    }
+    if (ok && simConfig.reservations)
+        ok = fread(&reservations, sizeof(reservations), 1, file) == 1;
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s: truncated checkpoint\n", path);
+        return false;
+    }
+    if (hashSimulationState(14695981039346656037ull, sharedData) != h.stateHash) {
+        fprintf(stderr, "%s: state hash differs after the restore (written by another build?)\n", path);
+        return false;
+    }
+    run->restored = true;
+    run->progressMs = simClockMs;
+    run->nextCheckpointMs = simClockMs - simClockMs % simConfig.checkpointEveryMs + simConfig.checkpointEveryMs;
+    printf("Seek: restored %s (%.1f s, %u vehicles), state hash matches\n", path, simClockMs / 1000.0,
+           h.vehicleCounts[0] + h.vehicleCounts[1] + h.vehicleCounts[2] + h.vehicleCounts[3]);
+    fflush(stdout);
+    return true;
+}
+
+// Controllers call this first. After a restore it parks the controller with
+// the wake-up it had in waitAtPassEnd() when the checkpoint was written, and
+// the controller carries on from the top of its loop with the restored
+// ControllerState.
+void resumeRestoredController() {
+    if (!lockstepRun.restored) return;
+    controllerState.preempted = lockstepParkUntil(lockstep.wakeMs, lockstep.wakeOnEmergency);
+}
+
 void updateVehicles(SharedData* sharedData) {
     float speed = 0.2f;
-    Uint32 currentTime = SDL_GetTicks();
-    static Uint32 lastTime = 0;
+    Uint32 currentTime = getSimTimeMs();
+    Uint32 lastTime = lastUpdateMs;
     if (lastTime == 0) 
         lastTime = currentTime;
     Uint32 delta = currentTime - lastTime;
-    lastTime = currentTime;
+    lastUpdateMs = currentTime;
 
     // Define stop positions for each lane
     const int stopA = WINDOW_HEIGHT/2 - ROAD_WIDTH/2 - 20;
@@ -996,15 +5194,16 @@ void updateVehicles(SharedData* sharedData) {
     const int stopC = WINDOW_WIDTH/2 + ROAD_WIDTH/2 + 20;
     const int stopD = WINDOW_WIDTH/2 - ROAD_WIDTH/2 - 20;
     
-    char activeLane = '\0';
-    if (sharedData->currentLight == 1) activeLane = 'A';
-    else if (sharedData->currentLight == 2) activeLane = 'B';
-    else if (sharedData->currentLight == 3) activeLane = 'C';
-    else if (sharedData->currentLight == 4) activeLane = 'D';
+    int greenMask = readSignal(&sharedData->current).greenMask;
+    VehicleMotion saved[MAX_QUEUE_SIZE];
+    beginConflictTick(currentTime);
+    if (simConfig.reservations)
+        reservationTick(currentTime);
 
 
     // Lane A (north to south)
-    pthread_mutex_lock(&queueA->lock);
+    lockQueue(queueA, LOCK_SITE_UPDATE);
+    saveMotion(queueA, saved);
     for (int i = 0; i < queueA->size; i++) {
         int idx = (queueA->front + i) % MAX_QUEUE_SIZE;
         Vehicle *v = queueA->vehicles[idx];
@@ -1018,7 +5217,7 @@ void updateVehicles(SharedData* sharedData) {
             
             if ((int)v->animPos % 50 == 0) {
                 printf("[POST-TURN] DL3->AL1 Vehicle %s moving upward at pos %.1f\n", 
-                       v->id, v->animPos);
+                       plateText(v->plate).text, v->animPos);
             }
             
             // If it reaches the top of the screen, it will be dequeued below
@@ -1065,7 +5264,7 @@ void updateVehicles(SharedData* sharedData) {
             
             // Begin turning upon reaching threshold - independent from other lanes
             if (!v->turning && v->animPos >= (WINDOW_HEIGHT/2 - ROAD_WIDTH/2 - 20)) {
-                printf("Vehicle %s (AL3) reached turning threshold. Starting turn.\n", v->id);
+                printf("Vehicle %s (AL3) reached turning threshold. Starting turn.\n", plateText(v->plate).text);
                 v->turning = true;
                 v->turnProgress = 0.0f;
                 // Use the vehicle's current position as turning start.
@@ -1101,7 +5300,7 @@ void updateVehicles(SharedData* sharedData) {
                     v->turnProgress = 0.0f;
                     // Set animPos to the final x-position on road C.
                     v->animPos = targetX;
-                    printf("AL3 Vehicle %s completed turn into road C.\n", v->id);
+                    printf("AL3 Vehicle %s completed turn into road C.\n", plateText(v->plate).text);
                 }
                 // Draw using computed turning coordinates (handled in drawVehicle).
                 continue;
@@ -1119,7 +5318,7 @@ void updateVehicles(SharedData* sharedData) {
             // L2 vehicles have larger spacing requirements
             float l2_vehicle_gap = a_l2_vehicle_gap; // 50% larger gap
             
-            if (activeLane != 'A') {
+            if (!laneMayGo(v, greenMask, v->animPos >= stopA, currentTime)) {
                 float nextPos = v->animPos + speed * delta;
                 // Check for vehicle ahead with increased spacing
                 if (i > 0) {
@@ -1142,7 +5341,7 @@ void updateVehicles(SharedData* sharedData) {
             
             // When light is green, begin turning from AL2 to BL1 - independent of AL3
             if (!v->turning && v->animPos >= stopA) {
-                 printf("Vehicle %s from AL2 reached stop position. Starting turn to BL1.\n", v->id);
+                 printf("Vehicle %s from AL2 reached stop position. Starting turn to BL1.\n", plateText(v->plate).text);
                  v->turning = true;
                  v->turnProgress = 0.0f;
                  // initializing turning start position using current drawing position.
@@ -1177,7 +5376,7 @@ void updateVehicles(SharedData* sharedData) {
                       v->turnProgress = 0.0f;
                       // Set animPos for road B (vertical position)
                       v->animPos = eY;
-                      printf("Vehicle %s completed turning into BL1. Final pos: %f\n", v->id, eY);
+                      printf("Vehicle %s completed turning into BL1. Final pos: %f\n", plateText(v->plate).text, eY);
                  }
                  continue; // Skip normal forward motion while turning.
             }
@@ -1198,7 +5397,7 @@ void updateVehicles(SharedData* sharedData) {
                 }
             }
             
-            if (activeLane == 'A' || v->animPos > WINDOW_HEIGHT/2 || v->animPos > stopA) {
+            if (roadGreen(greenMask, 'A') || v->animPos > WINDOW_HEIGHT/2 || v->animPos > stopA) {
                 v->animPos = nextPos;
             } else if (v->animPos < stopA) {
                 v->animPos = (nextPos > stopA) ? stopA : nextPos;
@@ -1224,7 +5423,7 @@ void updateVehicles(SharedData* sharedData) {
         }
 
         if (canMove) {
-            if (activeLane == 'A' || v->animPos > WINDOW_HEIGHT/2 || v->animPos > stopA) {
+            if (roadGreen(greenMask, 'A') || v->animPos > WINDOW_HEIGHT/2 || v->animPos > stopA) {
                 v->animPos = nextPos;
             } else if (v->animPos < stopA) {
                 v->animPos = (nextPos > stopA) ? stopA : nextPos;
@@ -1234,6 +5433,10 @@ void updateVehicles(SharedData* sharedData) {
         }
     }
     
+    resolveConflicts(queueA, saved, currentTime);
+    for (int i = 0; i < queueA->size; i++)
+        trackStopLine(queueA->vehicles[(queueA->front + i) % MAX_QUEUE_SIZE], currentTime);
+
     // Enhanced dequeuing logic - check if any vehicles at front of queueA have moved off screen
     while (!isQueueEmpty(queueA) && 
            (queueA->vehicles[queueA->front]->animPos > WINDOW_HEIGHT ||  // Regular movement
@@ -1242,14 +5445,15 @@ void updateVehicles(SharedData* sharedData) {
         Vehicle* v = queueA->vehicles[queueA->front];
         if (v->animPos < 0) {
             printf("[DEQUEUE] Vehicle %s reached end of AL1 and has been removed (pos=%.1f)\n", 
-                   v->id, v->animPos);
+                   plateText(v->plate).text, v->animPos);
         }
-        dequeueUnlocked(queueA);
+        retireVehicle(dequeueUnlocked(queueA), currentTime);
     }
-    pthread_mutex_unlock(&queueA->lock);
+    unlockQueue(queueA);
     
     // Lane B (south to north)
-    pthread_mutex_lock(&queueB->lock);
+    lockQueue(queueB, LOCK_SITE_UPDATE);
+    saveMotion(queueB, saved);
     for (int i = 0; i < queueB->size; i++) {
         int idx = (queueB->front + i) % MAX_QUEUE_SIZE;
         Vehicle *v = queueB->vehicles[idx];
@@ -1272,13 +5476,13 @@ void updateVehicles(SharedData* sharedData) {
 if (v->lane == 'B' && v->lane_number == 3) {
     // Only log occasionally to reduce console spam
     if ((int)v->animPos % 50 == 0) {
-        printf("Vehicle %s is in BL3, animPos: %.1f\n", v->id, v->animPos);
+        printf("Vehicle %s is in BL3, animPos: %.1f\n", plateText(v->plate).text, v->animPos);
     }
     
     // Begin turning upon reaching threshold
     if (!v->turning && v->animPos <= (WINDOW_HEIGHT/2 + ROAD_WIDTH/2 + 20)) {
         printf("[TURN-START] BL3 Vehicle %s starting rotation to DL1 at pos=%.1f\n", 
-              v->id, v->animPos);
+              plateText(v->plate).text, v->animPos);
         v->turning = true;
         v->turnProgress = 0.0f;
         v->angle = 0.0f;
@@ -1316,7 +5520,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
 
         
         if (v->lane == 'B' && v->lane_number == 2) {
-            if (activeLane != 'B') {
+            if (!laneMayGo(v, greenMask, v->animPos <= stopB, currentTime)) {
                 float nextPos = v->animPos - speed * delta;
                 if (i > 0) {
                     int prevIdx = (queueB->front + i - 1) % MAX_QUEUE_SIZE;
@@ -1338,7 +5542,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
 
             // When light is green, begin turning from BL2 to AL1
             if (!v->turning && v->animPos <= stopB) {
-                printf("BL2 Vehicle %s reached threshold. Starting turn to AL1.\n", v->id);
+                printf("BL2 Vehicle %s reached threshold. Starting turn to AL1.\n", plateText(v->plate).text);
                 v->turning = true;
                 v->turnProgress = 0.0f;
                 v->turnPosX = WINDOW_WIDTH/2;
@@ -1365,7 +5569,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
                     v->turning = false;
                     v->turnProgress = 0.0f;
                     v->animPos = targetY;
-                    printf("BL2 Vehicle %s completed turn into AL1. Final pos: %f\n", v->id, targetY);
+                    printf("BL2 Vehicle %s completed turn into AL1. Final pos: %f\n", plateText(v->plate).text, targetY);
                 }
                 continue;
             }
@@ -1399,7 +5603,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
         }
 
         if (canMove) {
-            if (activeLane == 'B' || v->animPos < WINDOW_HEIGHT/2 || v->animPos > stopB) {
+            if (roadGreen(greenMask, 'B') || v->animPos < WINDOW_HEIGHT/2 || v->animPos > stopB) {
                 v->animPos = nextPos;
             } else if (v->animPos > stopB) {
                 v->animPos = (nextPos < stopB) ? stopB : nextPos;
@@ -1408,12 +5612,16 @@ if (v->lane == 'B' && v->lane_number == 3) {
             v->animPos = nextPos;
         }
     }
+    resolveConflicts(queueB, saved, currentTime);
+    for (int i = 0; i < queueB->size; i++)
+        trackStopLine(queueB->vehicles[(queueB->front + i) % MAX_QUEUE_SIZE], currentTime);
     while (!isQueueEmpty(queueB) && queueB->vehicles[queueB->front]->animPos < 0)
-        dequeueUnlocked(queueB);
-    pthread_mutex_unlock(&queueB->lock);
+        retireVehicle(dequeueUnlocked(queueB), currentTime);
+    unlockQueue(queueB);
 
     // Lane C (east to west)
-    pthread_mutex_lock(&queueC->lock);
+    lockQueue(queueC, LOCK_SITE_UPDATE);
+    saveMotion(queueC, saved);
     for (int i = 0; i < queueC->size; i++) {
         int idx = (queueC->front + i) % MAX_QUEUE_SIZE;
         Vehicle *v = queueC->vehicles[idx];
@@ -1426,7 +5634,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
             
             // Optional debugging
             if ((int)v->animPos % 50 == 0) {
-                printf("[POST-TURN] Vehicle %s moving along CL1 at pos %.1f\n", v->id, v->animPos);
+                printf("[POST-TURN] Vehicle %s moving along CL1 at pos %.1f\n", plateText(v->plate).text, v->animPos);
             }
             continue;
         }
@@ -1450,7 +5658,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
     
             if (!v->turning && v->animPos <= stopC) {
                 printf("[TURN-START] CL3 Vehicle %s starting rotation to AL1 at pos=%.1f\n", 
-                       v->id, v->animPos);
+                       plateText(v->plate).text, v->animPos);
                 v->turning = true;
                 v->turnProgress = 0.0f;
                 v->angle = 0.0f;
@@ -1475,7 +5683,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
         }
         
         if (v->lane == 'C' && v->lane_number == 2) {
-            if (activeLane != 'C') {
+            if (!laneMayGo(v, greenMask, v->animPos <= stopC, currentTime)) {
                 float nextPos = v->animPos - speed * delta;
                 if (i > 0) {
                     int prevIdx = (queueC->front + i - 1) % MAX_QUEUE_SIZE;
@@ -1492,7 +5700,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
             
             // When light is green, turn from CL2 to DL1
             if (!v->turning && v->animPos <= stopC) {
-                printf("CL2 Vehicle %s reached threshold. Starting turn to DL1.\n", v->id);
+                printf("CL2 Vehicle %s reached threshold. Starting turn to DL1.\n", plateText(v->plate).text);
                 v->turning = true;
                 v->turnProgress = 0.0f;
                 v->turnPosX = stopC;
@@ -1518,7 +5726,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
                     v->turning = false;
                     v->turnProgress = 0.0f;
                     v->animPos = targetX;
-                    printf("CL2 Vehicle %s completed turn into DL1.\n", v->id);
+                    printf("CL2 Vehicle %s completed turn into DL1.\n", plateText(v->plate).text);
                 }
                 continue;
             }
@@ -1538,7 +5746,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
         }
 
         if (canMove) {
-            if (activeLane == 'C' || v->animPos < WINDOW_WIDTH/2 || v->animPos > stopC) {
+            if (roadGreen(greenMask, 'C') || v->animPos < WINDOW_WIDTH/2 || v->animPos > stopC) {
                 v->animPos = nextPos;
             } else if (v->animPos > stopC) {
                 v->animPos = (nextPos < stopC) ? stopC : nextPos;
@@ -1547,12 +5755,16 @@ if (v->lane == 'B' && v->lane_number == 3) {
             v->animPos = nextPos;
         }
     }
+    resolveConflicts(queueC, saved, currentTime);
+    for (int i = 0; i < queueC->size; i++)
+        trackStopLine(queueC->vehicles[(queueC->front + i) % MAX_QUEUE_SIZE], currentTime);
     while (!isQueueEmpty(queueC) && queueC->vehicles[queueC->front]->animPos < 0)
-        dequeueUnlocked(queueC);
-    pthread_mutex_unlock(&queueC->lock);
+        retireVehicle(dequeueUnlocked(queueC), currentTime);
+    unlockQueue(queueC);
 
     // Lane D (west to east)
-    pthread_mutex_lock(&queueD->lock);
+    lockQueue(queueD, LOCK_SITE_UPDATE);
+    saveMotion(queueD, saved);
     for (int i = 0; i < queueD->size; i++) {
         int idx = (queueD->front + i) % MAX_QUEUE_SIZE;
         Vehicle *v = queueD->vehicles[idx];
@@ -1561,7 +5773,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
             // For vehicles from road D (DL3) turning into AL1:
         if (v->lane == 'D' && v->lane_number == 3) {
             if (!v->turning && v->animPos >= stopD) {
-                printf("DL3 Vehicle %s starting turn to AL1\n", v->id);
+                printf("DL3 Vehicle %s starting turn to AL1\n", plateText(v->plate).text);
                 v->turning = true;
                 v->turnProgress = 0.0f;
                 v->turnPosX = stopD;
@@ -1591,7 +5803,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
                 // Debug log for tracking position during turn
                 if (t == 0.0f || t == 0.5f || t == 1.0f) {
                     printf("DL3 Vehicle %s turn progress: %.2f, pos: (%.1f, %.1f)\n", 
-                           v->id, t, v->turnPosX, v->turnPosY);
+                           plateText(v->plate).text, t, v->turnPosX, v->turnPosY);
                 }
                 if (v->turnProgress >= 1.0f) {
                     v->lane = 'A';
@@ -1599,14 +5811,14 @@ if (v->lane == 'B' && v->lane_number == 3) {
                     v->turning = false;
                     v->turnProgress = 0.0f;
                     v->animPos = stopA - 50;
-                    printf("DL3 Vehicle %s completed turn into AL1\n", v->id);
+                    printf("DL3 Vehicle %s completed turn into AL1\n", plateText(v->plate).text);
                 }
                 continue;
             }
         }
         
         if (v->lane == 'D' && v->lane_number == 2) {
-            if (activeLane != 'D') {
+            if (!laneMayGo(v, greenMask, v->animPos >= stopD, currentTime)) {
                 float nextPos = v->animPos + speed * delta;
                 if (i > 0) {
                     int prevIdx = (queueD->front + i - 1) % MAX_QUEUE_SIZE;
@@ -1623,7 +5835,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
             
             // When light is green, turn from DL2 to CL1
             if (!v->turning && v->animPos >= stopD) {
-                printf("DL2 Vehicle %s reached threshold. Starting turn to CL1.\n", v->id);
+                printf("DL2 Vehicle %s reached threshold. Starting turn to CL1.\n", plateText(v->plate).text);
                 v->turning = true;
                 v->turnProgress = 0.0f;
                 v->turnPosX = stopD;
@@ -1649,7 +5861,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
                     v->turning = false;
                     v->turnProgress = 0.0f;
                     v->animPos = targetX;
-                    printf("DL2 Vehicle %s completed turn into CL1.\n", v->id);
+                    printf("DL2 Vehicle %s completed turn into CL1.\n", plateText(v->plate).text);
                 }
                 continue;
             }
@@ -1669,7 +5881,7 @@ if (v->lane == 'B' && v->lane_number == 3) {
         }
 
         if (canMove) {
-            if (activeLane == 'D' || v->animPos > WINDOW_WIDTH/2 || v->animPos > stopD) {
+            if (roadGreen(greenMask, 'D') || v->animPos > WINDOW_WIDTH/2 || v->animPos > stopD) {
                 v->animPos = nextPos;
             } else if (v->animPos < stopD) {
                 v->animPos = (nextPos > stopD) ? stopD : nextPos;
@@ -1678,60 +5890,660 @@ if (v->lane == 'B' && v->lane_number == 3) {
             v->animPos = nextPos;
         }
     }
+    resolveConflicts(queueD, saved, currentTime);
+    for (int i = 0; i < queueD->size; i++)
+        trackStopLine(queueD->vehicles[(queueD->front + i) % MAX_QUEUE_SIZE], currentTime);
     while (!isQueueEmpty(queueD) && queueD->vehicles[queueD->front]->animPos > WINDOW_WIDTH)
-        dequeueUnlocked(queueD);
-    pthread_mutex_unlock(&queueD->lock);
+        retireVehicle(dequeueUnlocked(queueD), currentTime);
+    unlockQueue(queueD);
+    detectCollisions();
+}
+
+// A vehicle has crossed its stop line once it starts a turn, has been handed
+// over to another road, or has moved past the stop position of its own road.
+void trackStopLine(Vehicle* v, Uint32 now) {
+    const int stopA = WINDOW_HEIGHT/2 - ROAD_WIDTH/2 - 20;
+    const int stopB = WINDOW_HEIGHT/2 + ROAD_WIDTH/2 + 20;
+    const int stopC = WINDOW_WIDTH/2 + ROAD_WIDTH/2 + 20;
+    const int stopD = WINDOW_WIDTH/2 - ROAD_WIDTH/2 - 20;
+
+    if (v->crossedStopLine) return;
+    bool crossed = v->turning || v->lane != v->originLane;
+    if (!crossed) {
+        switch (v->originLane) {
+            case 'A': crossed = v->animPos > stopA; break;
+            case 'B': crossed = v->animPos < stopB; break;
+            case 'C': crossed = v->animPos < stopC; break;
+            case 'D': crossed = v->animPos > stopD; break;
+        }
+    }
+    if (!crossed) return;
+
+    v->crossedStopLine = true;
+    v->stopLineTimeMs = now;
+    int lane = laneIndex(v->originLane, v->originLaneNumber);
+    int stillWaiting = atomic_fetch_sub(&laneWaiting[lane], 1) - 1;
+    noteLaneDischarge(lane, now, stillWaiting > 0);
+    if (v->originLaneNumber == 2)
+        atomic_fetch_add(&exitOccupancy[laneTwoExit(v->originLane - 'A')], 1);
+    if (isSignalledEmergency(v))
+        noteEmergencyCleared(v);
+    recordStopLineCrossing(v, now);
+    Uint32 wait = now - v->enterTimeMs;
+    histogramRecord(&laneDelayStats[laneIndex(v->originLane, v->originLaneNumber)].waitTime, wait);
+    histogramRecord(&totalDelayStats.waitTime, wait);
+}
+
+// Called for every vehicle leaving the screen: record its trip and free it.
+void retireVehicle(Vehicle* v, Uint32 now) {
+    if (!v) return;
+    trackStopLine(v, now);
+    if (v->originLaneNumber == 2)
+        atomic_fetch_sub(&exitOccupancy[laneTwoExit(v->originLane - 'A')], 1);
+    v->exitTimeMs = now;
+    Uint32 travel = now - v->enterTimeMs;
+    histogramRecord(&laneDelayStats[laneIndex(v->originLane, v->originLaneNumber)].travelTime, travel);
+    histogramRecord(&totalDelayStats.travelTime, travel);
+    free(v);
+}
+
+void printDelayReport() {
+    printf("\n=== Vehicle delay report (seconds) ===\n");
+    printf("Lane  vehicles   wait p50    p90    p99 |  trip p50    p90    p99\n");
+    for (int i = 0; i < NUM_LANES; i++) {
+        LaneDelayStats* s = &laneDelayStats[i];
+        if (s->waitTime.total == 0 && s->travelTime.total == 0) continue;
+        printf("%cL%d  %8llu   %8.2f %6.2f %6.2f | %8.2f %6.2f %6.2f\n",
+               'A' + i / LANES_PER_ROAD, i % LANES_PER_ROAD + 1,
+               (unsigned long long)s->travelTime.total,
+               histogramPercentile(&s->waitTime, 0.50) / 1000.0,
+               histogramPercentile(&s->waitTime, 0.90) / 1000.0,
+               histogramPercentile(&s->waitTime, 0.99) / 1000.0,
+               histogramPercentile(&s->travelTime, 0.50) / 1000.0,
+               histogramPercentile(&s->travelTime, 0.90) / 1000.0,
+               histogramPercentile(&s->travelTime, 0.99) / 1000.0);
+    }
+    printf("All  %8llu   %8.2f %6.2f %6.2f | %8.2f %6.2f %6.2f\n",
+           (unsigned long long)totalDelayStats.travelTime.total,
+           histogramPercentile(&totalDelayStats.waitTime, 0.50) / 1000.0,
+           histogramPercentile(&totalDelayStats.waitTime, 0.90) / 1000.0,
+           histogramPercentile(&totalDelayStats.waitTime, 0.99) / 1000.0,
+           histogramPercentile(&totalDelayStats.travelTime, 0.50) / 1000.0,
+           histogramPercentile(&totalDelayStats.travelTime, 0.90) / 1000.0,
+           histogramPercentile(&totalDelayStats.travelTime, 0.99) / 1000.0);
+    fflush(stdout);
+}
+
+// New vehicle at the start of its road; returns NULL for an unknown road.
+Vehicle* createVehicle(PlateKey plate, char road, int laneNumber, bool isEmergency) {
+    if (road < 'A' || road > 'D') return NULL;
+    Vehicle* vehicle = (Vehicle*)calloc(1, sizeof(Vehicle));
+    countAllocation();
+    vehicle->plate = plate;
+    vehicle->serial = atomic_fetch_add(&vehicleSerials, 1) + 1;
+    vehicle->lane = road;
+    vehicle->lane_number = laneNumber;
+    vehicle->isEmergency = isEmergency;
+    if (road == 'B')
+        vehicle->animPos = (float)WINDOW_HEIGHT;
+    else if (road == 'C')
+        vehicle->animPos = (float)WINDOW_WIDTH - 10.0f; // Start slightly in view
+    else
+        vehicle->animPos = 0.0f;
+    return vehicle;
+}
+
+VehicleQueue* queueForRoad(char road) {
+    switch (road) {
+        case 'A': return queueA;
+        case 'B': return queueB;
+        case 'C': return queueC;
+        case 'D': return queueD;
+        default: return NULL;
+    }
+}
+
+typedef enum { INGEST_QUEUED, INGEST_REJECTED, INGEST_QUEUE_FULL, INGEST_DUPLICATE } IngestResult;
+
+// Queues a parsed vehicle unless its road is unknown, its lane queue is full
+// or the plate is a duplicate.
+// Only one ingestion thread runs, so the size check cannot go stale.
+IngestResult ingestVehicle(PlateKey plate, char road, int laneNumber, bool isEmergency) {
+    VehicleQueue* queue = queueForRoad(road);
+    if (!queue || laneNumber < 1 || laneNumber > LANES_PER_ROAD) return INGEST_REJECTED;
+    if (getQueueSize(queue) >= MAX_QUEUE_SIZE) return INGEST_QUEUE_FULL;
+    if (!admitPlate(plate)) return INGEST_DUPLICATE;
+    Vehicle* vehicle = createVehicle(plate, road, laneNumber, isEmergency);
+    if (!enqueue(queue, vehicle)) {
+        free(vehicle);
+        return INGEST_QUEUE_FULL;
+    }
+    return INGEST_QUEUED;
+}
+
+// Parses the next line of vehicles.data and queues its vehicle. Returns false
+// at the end of the file; *valid is false for a line that was rejected.
+bool ingestNextLine(LineReader* reader, bool* valid) {
+    const char* line;
+    size_t length;
+    if (!readLine(reader, &line, &length)) return false;
+    TRACE_SCOPE("parse+enqueue");
+    ParsedVehicle parsed;
+    *valid = parseRecordLine(VEHICLE_FILE, reader->lineNumber, line, length, &parsed) &&
+             admitPlate(parsed.plate);
+    if (*valid) {
+        Vehicle* newVehicle = createVehicle(parsed.plate, parsed.road, parsed.laneNumber, parsed.isEmergency);
+        if (!enqueue(queueForRoad(newVehicle->lane), newVehicle))
+            free(newVehicle);
+    }
+    return true;
 }
 
 // delay reduced to 3 sec
 void* processVehiclesSequentially(void* arg) {
+    traceRegisterThread("ingestion");
     FILE* file = fopen(VEHICLE_FILE, "r");
     if (!file) {
         perror("Error opening file");
         return NULL;
     }
-    char buffer[MAX_LINE_LENGTH];
-    while (fgets(buffer, sizeof(buffer), file)) {
-        buffer[strcspn(buffer, "\n")] = 0;
-        char* vehicleNumber = strtok(buffer, ":");
-        char* road = strtok(NULL, ":");
-        if (vehicleNumber && road) {
-            Vehicle* newVehicle = (Vehicle*)malloc(sizeof(Vehicle));
-            strncpy(newVehicle->id, vehicleNumber, MAX_VEHICLE_ID - 1);
-            newVehicle->id[MAX_VEHICLE_ID - 1] = '\0';
-            newVehicle->lane = road[0];
-            newVehicle->arrivalTime = time(NULL);
-            newVehicle->isEmergency = (strstr(vehicleNumber, "EMG") != NULL);
-            if (strstr(vehicleNumber, "L1"))
-                newVehicle->lane_number = 1;
-            else if (strstr(vehicleNumber, "L2"))
-                newVehicle->lane_number = 2;
-            else if (strstr(vehicleNumber, "L3"))
-                newVehicle->lane_number = 3;
-            else
-                newVehicle->lane_number = 2;
-            if (road[0] == 'A')
-                newVehicle->animPos = 0.0f;
-            else if (road[0] == 'B')
-                newVehicle->animPos = (float)WINDOW_HEIGHT;
-            else if (road[0] == 'C')
-                newVehicle->animPos = (float)WINDOW_WIDTH - 10.0f; // Start slightly in view
-            else if (road[0] == 'D')
-                newVehicle->animPos = 0.0f;
-            switch(newVehicle->lane) {
-                case 'A': enqueue(queueA, newVehicle); break;
-                case 'B': enqueue(queueB, newVehicle); break;
-                case 'C': enqueue(queueC, newVehicle); break;
-                case 'D': enqueue(queueD, newVehicle); break;
-                default: free(newVehicle);
-            }
-        }
-        sleep(1); // Reduced from 3 to 1 second for more frequent spawns
+    LineReader reader;
+    initLineReader(&reader, file);
+    bool valid;
+    while (!atomic_load(&stopping) && ingestNextLine(&reader, &valid)) {
+        if (!valid) continue;
+        TRACE_SCOPE("ingest wait");
+        // Reduced from 3 to 1 second for more frequent spawns, in steps so exit needn't wait
+        for (int i = 0; i < 10 && !atomic_load(&stopping); i++)
+            usleep(100000);
     }
+    freeLineReader(&reader);
     fclose(file);
     return NULL;
 }
 
+// --shm: vehicles come from traffic_generator through the shared-memory ring
+// in vehicle_ring.h instead of vehicles.data. Records are read in place and
+// only released once their vehicle is queued, so a full lane queue stalls the
+// ring and, through it, the generator.
+Histogram ringLatencyUs;        // generator timestamp -> enqueued
+unsigned long long ringRejected;
+
+void* consumeVehicleRing(void* arg) {
+    traceRegisterThread("ingestion");
+#ifdef __linux__
+    VehicleRing* ring = vehicleRingAttach(simConfig.shmName, VEHICLE_RING_CONSUMER);
+    if (!ring) {
+        perror("Error attaching vehicle ring");
+        return NULL;
+    }
+    printf("Reading vehicles from shared-memory ring %s\n", simConfig.shmName);
+    while (!atomic_load(&stopping)) {
+        const VehicleRecord* record = vehicleRingPeek(ring);
+        if (!record) {
+            TRACE_SCOPE("ring wait");
+            vehicleRingWaitForData(ring, 100);
+            continue;
+        }
+        VehicleQueue* queue = queueForRoad(record->road);
+        if (!queue || record->laneNumber < 1 || record->laneNumber > LANES_PER_ROAD) {
+            ringRejected++;
+            vehicleRingRelease(ring);
+            continue;
+        }
+        if (getQueueSize(queue) >= MAX_QUEUE_SIZE) {
+            TRACE_SCOPE("ring backpressure");
+            usleep(10000);
+            continue;
+        }
+        PlateKey plate;
+        if (plateFromText(record->plate, strnlen(record->plate, VEHICLE_PLATE_LENGTH), &plate) != PARSE_OK) {
+            ringRejected++;
+            vehicleRingRelease(ring);
+            continue;
+        }
+        if (!admitPlate(plate)) {
+            vehicleRingRelease(ring);
+            continue;
+        }
+        Vehicle* vehicle = createVehicle(plate, record->road, record->laneNumber,
+                                         record->flags & VEHICLE_RECORD_EMERGENCY);
+        uint64_t producedUs = record->timestampUs;
+        // Only this thread fills lane queues, so the size check above holds.
+        enqueue(queue, vehicle);
+        vehicleRingRelease(ring);
+        uint64_t now = getTimeUs();
+        histogramRecord(&ringLatencyUs, now > producedUs ? now - producedUs : 0);
+    }
+    vehicleRingDetach(ring, VEHICLE_RING_CONSUMER);
+    return NULL;
+#else
+    printf("--shm is only supported on Linux\n");
+    return NULL;
+#endif
+}
+
+void printRingReport() {
+    printf("\n=== Shared-memory ingestion (%s) ===\n", simConfig.shmName);
+    printf("Vehicles: %llu, rejected records: %llu\n",
+           (unsigned long long)ringLatencyUs.total, ringRejected);
+    if (ringLatencyUs.total > 0)
+        printf("Arrival latency us: p50 %u, p99 %u, max %llu\n",
+               histogramPercentile(&ringLatencyUs, 0.50), histogramPercentile(&ringLatencyUs, 0.99),
+               (unsigned long long)ringLatencyUs.max);
+    fflush(stdout);
+}
+
+// --listen <path>: ingestion server replacing the file reader. Any number of
+// producers connect to a Unix domain socket and write "PLATE:R" lines, as many
+// per write as they like. One epoll thread services all of them. When a
+// vehicle's lane queue is full its producer is paused: it is taken out of the
+// epoll set with the unparsed bytes kept, so its socket buffer fills and its
+// writes block until the lane drains.
+#define MAX_PRODUCERS 32
+#define PRODUCER_BUFFER_SIZE 4096
+#define PRODUCER_RETRY_MS 20
+
+typedef struct {
+    int fd;                         // -1 once disconnected, then the slot is reused
+    int id;                         // connection number, counted from 0
+    bool paused;                    // backpressure: waiting for a lane queue
+    bool hungUp;                    // peer closed while paused, no longer in epoll
+    char name[16];                  // "producer N", for parse errors
+    char buffer[PRODUCER_BUFFER_SIZE];
+    size_t length;
+    bool discarding;                // dropping the rest of an overlong line
+    unsigned long long lines;
+    unsigned long long accepted, rejected;
+    unsigned long long windowCount; // accepted since windowStartMs
+    Uint32 windowStartMs, connectedMs, disconnectedMs;
+    Uint32 pausedSinceMs, pausedMs;
+    double peakRate;                // best one-second rate seen
+} Producer;
+
+Producer producers[MAX_PRODUCERS];
+int producerCount;                  // slots used, disconnected ones included
+int producerConnections;
+
+// Producers whose slot was taken by a later connection, for the report.
+struct {
+    int count;
+    unsigned long long accepted, rejected;
+} retiredProducers;
+
+#ifdef __linux__
+void pauseProducer(Producer* p, int epollFd, Uint32 now) {
+    p->paused = true;
+    p->pausedSinceMs = now;
+    if (p->hungUp) return;
+    struct epoll_event event = { 0 };
+    event.data.ptr = p;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, p->fd, &event);
+}
+
+void closeProducer(Producer* p, int epollFd, Uint32 now) {
+    if (p->paused) p->pausedMs += now - p->pausedSinceMs;
+    if (!p->hungUp) epoll_ctl(epollFd, EPOLL_CTL_DEL, p->fd, NULL);
+    close(p->fd);
+    p->fd = -1;
+    p->disconnectedMs = now;
+    printf("Producer %d disconnected (%llu vehicles)\n", p->id, p->accepted);
+}
+
+// Ingests every complete line in the producer's buffer; stops early and
+// pauses the producer if a lane queue is full.
+void drainProducerBuffer(Producer* p, int epollFd, Uint32 now) {
+    const char* start = p->buffer;
+    const char* end = p->buffer + p->length;
+    const char* newline;
+    if (p->discarding) {
+        newline = findByte(start, end, '\n');
+        start = newline ? newline + 1 : end;
+        p->discarding = !newline;
+    }
+    while ((newline = findByte(start, end, '\n'))) {
+        ParsedVehicle parsed;
+        ParseError parseResult = parseVehicleRecord(start, newline - start, &parsed);
+        IngestResult result = INGEST_REJECTED;
+        if (parseResult == PARSE_OK)
+            result = ingestVehicle(parsed.plate, parsed.road, parsed.laneNumber, parsed.isEmergency);
+        if (result == INGEST_QUEUE_FULL) {
+            pauseProducer(p, epollFd, now); // the line is parsed again on retry
+            break;
+        }
+        noteParseResult(p->name, ++p->lines, parseResult, start, newline - start);
+        if (parseResult == PARSE_EMPTY_LINE || result == INGEST_DUPLICATE) {
+            // blank lines are not records, duplicates are counted by the dedup stage
+        } else if (result == INGEST_REJECTED) {
+            p->rejected++;
+        } else {
+            p->accepted++;
+            p->windowCount++;
+        }
+        start = newline + 1;
+    }
+    p->length = end - start;
+    memmove(p->buffer, start, p->length);
+    if (p->length == PRODUCER_BUFFER_SIZE) {
+        noteParseResult(p->name, ++p->lines, PARSE_PLATE_TOO_LONG, p->buffer, p->length);
+        p->rejected++; // a "line" that does not fit the buffer
+        p->length = 0;
+        p->discarding = true;
+    }
+    if (now - p->windowStartMs >= 1000) {
+        double rate = p->windowCount * 1000.0 / (now - p->windowStartMs);
+        if (rate > p->peakRate) p->peakRate = rate;
+        p->windowCount = 0;
+        p->windowStartMs = now;
+    }
+}
+
+// Reads until the socket would block, the producer is paused or it hangs up.
+void serviceProducer(Producer* p, int epollFd, Uint32 now) {
+    TRACE_SCOPE("producer read");
+    drainProducerBuffer(p, epollFd, now);
+    while (!p->paused) {
+        ssize_t n = read(p->fd, p->buffer + p->length, PRODUCER_BUFFER_SIZE - p->length);
+        if (n > 0) {
+            p->length += n;
+            drainProducerBuffer(p, epollFd, now);
+        } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        } else {
+            closeProducer(p, epollFd, now);
+            break;
+        }
+    }
+}
+
+void acceptProducers(int listenFd, int epollFd, Uint32 now) {
+    int fd;
+    while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        int slot = 0;
+        while (slot < producerCount && producers[slot].fd != -1) slot++;
+        if (slot == MAX_PRODUCERS) {
+            printf("Too many producers, refusing connection\n");
+            close(fd);
+            continue;
+        }
+        bool reused = slot < producerCount;
+        Producer* p = &producers[reused ? slot : producerCount++];
+        if (reused) {
+            retiredProducers.count++;
+            retiredProducers.accepted += p->accepted;
+            retiredProducers.rejected += p->rejected;
+        }
+        memset(p, 0, sizeof(*p));
+        p->fd = fd;
+        p->id = producerConnections++;
+        snprintf(p->name, sizeof(p->name), "producer %d", p->id);
+        p->connectedMs = p->windowStartMs = now;
+        struct epoll_event event = { EPOLLIN, { .ptr = p } };
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        printf("Producer %d connected\n", p->id);
+    }
+}
+
+void* serveIngestionSocket(void* arg) {
+    traceRegisterThread("ingestion");
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, simConfig.listenPath, sizeof(address.sun_path) - 1);
+    unlink(simConfig.listenPath);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listenFd, MAX_PRODUCERS) != 0) {
+        perror("Error opening ingestion socket");
+        return NULL;
+    }
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listenEvent = { EPOLLIN, { .ptr = NULL } };
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+    printf("Listening for vehicle producers on %s\n", simConfig.listenPath);
+
+    struct epoll_event events[16];
+    while (!atomic_load(&stopping)) {
+        bool anyPaused = false;
+        for (int i = 0; i < producerCount; i++)
+            anyPaused |= producers[i].fd >= 0 && producers[i].paused;
+        int count = epoll_wait(epollFd, events, 16, anyPaused ? PRODUCER_RETRY_MS : 1000);
+        Uint32 now = getSimTimeMs();
+        for (int i = 0; i < count; i++) {
+            Producer* p = events[i].data.ptr;
+            if (!p) {
+                acceptProducers(listenFd, epollFd, now);
+            } else if (p->fd >= 0 && p->paused) {
+                // Only a hangup reaches a paused producer; stop watching it and
+                // let the retry below read what is left.
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, p->fd, NULL);
+                p->hungUp = true;
+            } else if (p->fd >= 0) {
+                serviceProducer(p, epollFd, now);
+            }
+        }
+        // Retry paused producers once their lane has room.
+        for (int i = 0; i < producerCount; i++) {
+            Producer* p = &producers[i];
+            if (p->fd < 0 || !p->paused) continue;
+            Uint32 pausedSince = p->pausedSinceMs;
+            p->paused = false;
+            drainProducerBuffer(p, epollFd, now);
+            if (p->paused) {
+                p->pausedSinceMs = pausedSince; // lane still full
+                continue;
+            }
+            p->pausedMs += now - p->pausedSinceMs;
+            if (!p->hungUp) {
+                struct epoll_event event = { EPOLLIN, { .ptr = p } };
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, p->fd, &event);
+            }
+            serviceProducer(p, epollFd, now);
+        }
+    }
+    close(epollFd);
+    close(listenFd);
+    return NULL;
+}
+#else
+void* serveIngestionSocket(void* arg) {
+    printf("--listen is only supported on Linux\n");
+    return NULL;
+}
+#endif
+
+void printProducerReport() {
+    Uint32 now = getSimTimeMs();
+    printf("\n=== Ingestion producers (%s) ===\n", simConfig.listenPath);
+    printf("Producer  Accepted  Rejected   Avg veh/s  Peak veh/s  Paused s\n");
+    for (int i = 0; i < producerCount; i++) {
+        Producer* p = &producers[i];
+        Uint32 end = p->fd >= 0 ? now : p->disconnectedMs;
+        Uint32 pausedMs = p->pausedMs + (p->fd >= 0 && p->paused ? now - p->pausedSinceMs : 0);
+        double seconds = (end - p->connectedMs) / 1000.0;
+        printf("%8d  %8llu  %8llu  %10.1f  %10.1f  %8.1f\n", p->id, p->accepted, p->rejected,
+               seconds > 0 ? p->accepted / seconds : 0.0, p->peakRate, pausedMs / 1000.0);
+    }
+    if (retiredProducers.count > 0)
+        printf("%d earlier producers: %llu accepted, %llu rejected\n", retiredProducers.count,
+               retiredProducers.accepted, retiredProducers.rejected);
+    fflush(stdout);
+}
+
+// --merge <feed>...: replays recorded arrival feeds (one per road or
+// detector) merged by timestamp. A feed is either text, one "ms,PLATE:R" line
+// per vehicle, or binary: VEHICLE_FEED_MAGIC followed by VehicleRecords with
+// timestampUs relative to the start. Each feed keeps a small buffer of parsed
+// records and a binary min-heap on the buffers' head timestamps picks the next
+// vehicle, so memory stays at FEED_BUFFER_RECORDS per feed whatever the length
+// of the replay.
+#define FEED_BUFFER_RECORDS 256
+
+typedef struct {
+    uint64_t timestampUs;
+    PlateKey plate;
+    char road;
+    int laneNumber;
+    bool isEmergency;
+} TimedVehicle;
+
+typedef struct {
+    const char* path;
+    FILE* file;
+    LineReader reader;              // text feeds only
+    bool binary;
+    TimedVehicle buffer[FEED_BUFFER_RECORDS];
+    int head, count;
+    unsigned long long records, malformed, outOfOrder;
+    uint64_t lastTimestampUs;
+} Feed;
+
+Feed* feeds;
+Histogram mergeLatenessUs;          // how far behind schedule vehicles were queued
+
+// Refills an empty feed buffer; returns false at end of file.
+bool fillFeed(Feed* feed) {
+    feed->head = 0;
+    feed->count = 0;
+    while (feed->count < FEED_BUFFER_RECORDS) {
+        TimedVehicle* t = &feed->buffer[feed->count];
+        if (feed->binary) {
+            VehicleRecord record;
+            if (fread(&record, sizeof(record), 1, feed->file) != 1) break;
+            t->timestampUs = record.timestampUs;
+            if (plateFromText(record.plate, strnlen(record.plate, VEHICLE_PLATE_LENGTH), &t->plate) != PARSE_OK) {
+                feed->malformed++;
+                continue;
+            }
+            t->road = record.road;
+            t->laneNumber = record.laneNumber;
+            t->isEmergency = record.flags & VEHICLE_RECORD_EMERGENCY;
+        } else {
+            const char* line;
+            size_t length;
+            if (!readLine(&feed->reader, &line, &length)) break;
+            // "ms," in front of an ordinary record
+            size_t digits = 0;
+            unsigned long long ms = 0;
+            while (digits < length && line[digits] >= '0' && line[digits] <= '9')
+                ms = ms * 10 + (line[digits++] - '0');
+            if (digits == 0 || digits == length || line[digits] != ',') {
+                noteParseResult(feed->path, feed->reader.lineNumber, PARSE_NO_DELIMITER, line, length);
+                feed->malformed++;
+                continue;
+            }
+            ParsedVehicle parsed;
+            if (!parseRecordLine(feed->path, feed->reader.lineNumber, line + digits + 1,
+                                 length - digits - 1, &parsed)) {
+                feed->malformed++;
+                continue;
+            }
+            t->plate = parsed.plate;
+            t->road = parsed.road;
+            t->laneNumber = parsed.laneNumber;
+            t->isEmergency = parsed.isEmergency;
+            t->timestampUs = ms * 1000ull;
+        }
+        if (t->timestampUs < feed->lastTimestampUs) feed->outOfOrder++;
+        feed->lastTimestampUs = t->timestampUs;
+        feed->count++;
+    }
+    return feed->count > 0;
+}
+
+uint64_t feedHeadTime(int index) {
+    return feeds[index].buffer[feeds[index].head].timestampUs;
+}
+
+void siftDownFeed(int* heap, int size, int i) {
+    while (true) {
+        int smallest = i, left = 2 * i + 1, right = left + 1;
+        if (left < size && feedHeadTime(heap[left]) < feedHeadTime(heap[smallest])) smallest = left;
+        if (right < size && feedHeadTime(heap[right]) < feedHeadTime(heap[smallest])) smallest = right;
+        if (smallest == i) return;
+        int swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+void* mergeFeeds(void* arg) {
+    traceRegisterThread("ingestion");
+    int feedCount = simConfig.mergeCount;
+    feeds = calloc(feedCount, sizeof(Feed));
+    int* heap = malloc(feedCount * sizeof(int));
+    int heapSize = 0;
+    for (int i = 0; i < feedCount; i++) {
+        Feed* feed = &feeds[i];
+        feed->path = simConfig.mergePaths[i];
+        feed->file = fopen(feed->path, "rb");
+        if (!feed->file) {
+            perror(feed->path);
+            continue;
+        }
+        char magic[8];
+        feed->binary = fread(magic, 1, 8, feed->file) == 8 && memcmp(magic, VEHICLE_FEED_MAGIC, 8) == 0;
+        if (!feed->binary) {
+            rewind(feed->file);
+            initLineReader(&feed->reader, feed->file);
+        }
+        if (fillFeed(feed)) heap[heapSize++] = i;
+    }
+    for (int i = heapSize / 2 - 1; i >= 0; i--) siftDownFeed(heap, heapSize, i);
+    printf("Merging %d feeds\n", heapSize);
+
+    uint64_t startUs = getTimeUs();
+    while (heapSize > 0 && !atomic_load(&stopping)) {
+        Feed* feed = &feeds[heap[0]];
+        TimedVehicle* next = &feed->buffer[feed->head];
+        if (simConfig.replaySpeed > 0) {
+            uint64_t dueUs = startUs + (uint64_t)(next->timestampUs / simConfig.replaySpeed);
+            uint64_t now = getTimeUs();
+            if (dueUs > now) {
+                TRACE_SCOPE("replay wait");
+                usleep(dueUs - now < 100000 ? dueUs - now : 100000);
+                continue;
+            }
+            histogramRecord(&mergeLatenessUs, now - dueUs);
+        }
+        IngestResult result;
+        while ((result = ingestVehicle(next->plate, next->road, next->laneNumber, next->isEmergency))
+               == INGEST_QUEUE_FULL && !atomic_load(&stopping)) {
+            TRACE_SCOPE("merge backpressure");
+            usleep(10000); // keep time order: everything behind waits for this lane
+        }
+        if (result == INGEST_QUEUE_FULL) break; // stopping
+        if (result == INGEST_QUEUED) feed->records++;
+        else if (result == INGEST_REJECTED) feed->malformed++;
+
+        feed->head++;
+        if (--feed->count == 0 && !fillFeed(feed)) {
+            if (!feed->binary) freeLineReader(&feed->reader);
+            fclose(feed->file);
+            feed->file = NULL;
+            heap[0] = heap[--heapSize];
+        }
+        siftDownFeed(heap, heapSize, 0);
+    }
+    free(heap);
+    if (heapSize == 0) printf("All feeds replayed\n");
+    return NULL;
+}
+
+void printMergeReport() {
+    if (!feeds) return;
+    printf("\n=== Merged feeds ===\n");
+    printf("Feed                            Records  Malformed  Out-of-order\n");
+    for (int i = 0; i < simConfig.mergeCount; i++)
+        printf("%-30.30s  %8llu  %9llu  %12llu\n", feeds[i].path, feeds[i].records,
+               feeds[i].malformed, feeds[i].outOfOrder);
+    if (mergeLatenessUs.total > 0)
+        printf("Queued behind schedule ms: p50 %.1f, p99 %.1f, max %.1f\n",
+               histogramPercentile(&mergeLatenessUs, 0.50) / 1000.0,
+               histogramPercentile(&mergeLatenessUs, 0.99) / 1000.0, mergeLatenessUs.max / 1000.0);
+    fflush(stdout);
+}
+
 void rotateVehicle(Vehicle* vehicle, Uint32 delta) {
     if (!vehicle->turning) return;
     
@@ -1776,7 +6588,7 @@ void rotateVehicle(Vehicle* vehicle, Uint32 delta) {
             vehicle->angle = 0.0f;
             // Position in new lane
             vehicle->animPos = endX;
-            printf("BL3 Vehicle %s completed turn into DL1\n", vehicle->id);
+            printf("BL3 Vehicle %s completed turn into DL1\n", plateText(vehicle->plate).text);
         }
     }
     else if (vehicle->lane == 'C' && vehicle->lane_number == 3) {
@@ -1816,7 +6628,7 @@ void rotateVehicle(Vehicle* vehicle, Uint32 delta) {
             vehicle->angle = 0.0f;
             // FIX: Set animPos correctly for B lane (vertical position)
             vehicle->animPos = endY;
-            printf("CL3 Vehicle %s completed turn into BL1\n", vehicle->id);
+            printf("CL3 Vehicle %s completed turn into BL1\n", plateText(vehicle->plate).text);
         }
     }
     else if (vehicle->lane == 'D' && vehicle->lane_number == 3) {
@@ -1848,7 +6660,7 @@ void rotateVehicle(Vehicle* vehicle, Uint32 delta) {
             vehicle->angle = 0.0f;
             // Position in new lane - set to stopA - 50 to prevent teleporting
             vehicle->animPos = stopA - 50;
-            printf("DL3 Vehicle %s completed turn into AL1\n", vehicle->id);
+            printf("DL3 Vehicle %s completed turn into AL1\n", plateText(vehicle->plate).text);
         }
     }
 }
@@ -1892,7 +6704,7 @@ void rotateVehicle(Vehicle* vehicle, Uint32 delta) {
 //         if ((int)(vehicle->turnProgress * 10) % 2 == 0 && 
 //             (int)(vehicle->turnProgress * 10) != (int)((vehicle->turnProgress - delta * 0.001f) * 10)) {
 //             printf("[ROTATION] %s: progress=%.2f, angle=%.1f, pos=(%.1f, %.1f)\n", 
-//                   vehicle->id, vehicle->turnProgress, vehicle->angle, 
+//                   plateText(vehicle->plate).text, vehicle->turnProgress, vehicle->angle, 
 //                   vehicle->turnPosX, vehicle->turnPosY);
 //         }
         
@@ -1903,7 +6715,7 @@ void rotateVehicle(Vehicle* vehicle, Uint32 delta) {
 //             vehicle->lane_number = 1;
 //             vehicle->animPos = endX; // Set to the proper position in DL1
 //             printf("[ROTATION-COMPLETE] %s: Completed turn to DL1. Final angle=%.1f\n", 
-//                   vehicle->id, vehicle->angle);
+//                   plateText(vehicle->plate).text, vehicle->angle);
 //         }
 //     }
 // }
\ No newline at end of file
@@ -9,69 +9,453 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
 #include <time.h>
+#include <signal.h>
 #ifdef _WIN32
     #include <windows.h>
     #define sleep(seconds) Sleep((seconds) * 1000)
 #else
     #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
 #endif
+#include "vehicle_ring.h"
 
 #define FILENAME "vehicles.data"
+#define NUM_ROADS 4
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define MAX_RECORD_LENGTH 32
 
-// Function to generate a random vehicle number
+typedef enum {
+    ARRIVAL_POISSON,        // constant rate
+    ARRIVAL_MMPP,           // two-state Markov-modulated Poisson: calm / burst
+    ARRIVAL_RUSH_HOUR       // rate follows a time-of-day profile
+} ArrivalModel;
+
+typedef enum {
+    FORMAT_PLAIN,           // PLATE:R, read by the simulator's default reader
+    FORMAT_TIMED,           // ms,PLATE:R - a feed for simulator --merge
+    FORMAT_BINARY           // VEHICLE_FEED_MAGIC + VehicleRecords, also for --merge
+} OutputFormat;
+
+typedef struct {
+    const char* outputPath;
+    const char* shmName;            // --shm: write into the simulator's ring instead
+    const char* socketPath;         // --socket: send to a simulator started with --listen
+    OutputFormat format;
+    uint64_t seed;
+    ArrivalModel model;
+    double laneRate[NUM_ROADS][2];  // vehicles/second for lane 2 (straight) and lane 3 (turn)
+    double totalRate;               // --rate: rescale all lanes to this total (0 = keep)
+    long long count;                // stop after this many vehicles (0 = no limit)
+    double duration;                // stop after this many simulated seconds (0 = no limit)
+    bool realtime;                  // pace output to the wall clock
+    bool quiet;
+    double burstFactor;             // MMPP: rate multiplier while bursting
+    double calmSeconds;             // MMPP: mean time between bursts
+    double burstSeconds;            // MMPP: mean burst length
+    double startHour;               // rush hour: time of day at t = 0
+    double timeScale;               // rush hour: simulated seconds per output second
+} GeneratorConfig;
+
+// Relative traffic per hour of day, peaks around 08:00 and 17:00.
+const double rushHourProfile[24] = {
+    0.15, 0.10, 0.08, 0.08, 0.12, 0.30, 0.70, 1.40, 2.00, 1.50, 1.00, 0.90,
+    1.00, 0.95, 0.90, 1.10, 1.60, 2.00, 1.70, 1.10, 0.80, 0.60, 0.40, 0.25
+};
+
+volatile sig_atomic_t stopRequested = 0;
+
+void onSignal(int sig) {
+    (void)sig;
+    stopRequested = 1;
+}
+
+// xorshift64* - small, fast and identical on every platform, unlike rand().
+uint64_t rngState;
+
+void seedRandom(uint64_t seed) {
+    // splitmix64 so that nearby seeds give unrelated streams
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    rngState = (z ^ (z >> 31)) | 1;
+}
+
+uint64_t nextRandom() {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1Dull;
+}
+
+// Uniform in (0, 1].
+double randomUnit() {
+    return ((nextRandom() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+double randomExponential(double rate) {
+    return -log(randomUnit()) / rate;
+}
+
+// Function to generate a random vehicle number (AA0AA000)
 void generateVehicleNumber(char* buffer) {
-    buffer[0] = 'A' + rand() % 26;
-    buffer[1] = 'A' + rand() % 26;
-    buffer[2] = '0' + rand() % 10;
-    buffer[3] = 'A' + rand() % 26;
-    buffer[4] = 'A' + rand() % 26;
-    buffer[5] = '0' + rand() % 10;
-    buffer[6] = '0' + rand() % 10;
-    buffer[7] = '0' + rand() % 10;
+    uint64_t r = nextRandom();
+    buffer[0] = 'A' + r % 26; r /= 26;
+    buffer[1] = 'A' + r % 26; r /= 26;
+    buffer[2] = '0' + r % 10; r /= 10;
+    buffer[3] = 'A' + r % 26; r /= 26;
+    buffer[4] = 'A' + r % 26; r /= 26;
+    buffer[5] = '0' + r % 10; r /= 10;
+    buffer[6] = '0' + r % 10; r /= 10;
+    buffer[7] = '0' + r % 10;
     buffer[8] = '\0';
 }
 
-// Function to generate a random lane
-char* generateLane() {
-    static char* lanes[] = {"A", "B", "C", "D", "L3"};
-    return lanes[rand() % 5];
+// Picks road and lane with probability proportional to their rates.
+void generateLane(const GeneratorConfig* config, double totalRate, int* road, int* laneNumber) {
+    double pick = randomUnit() * totalRate;
+    for (int r = 0; r < NUM_ROADS; r++) {
+        for (int l = 0; l < 2; l++) {
+            pick -= config->laneRate[r][l];
+            if (pick <= 0) {
+                *road = r;
+                *laneNumber = l + 2;
+                return;
+            }
+        }
+    }
+    *road = NUM_ROADS - 1;
+    *laneNumber = 2;
+}
+
+// Writes "PLATE:R" or "PLATEL3:R" and returns its length.
+int formatRecord(char* out, const char* plate, int road, int laneNumber) {
+    memcpy(out, plate, 8);
+    int n = 8;
+    if (laneNumber == 3) {
+        out[n++] = 'L';
+        out[n++] = '3';
+    }
+    out[n++] = ':';
+    out[n++] = 'A' + road;
+    out[n++] = '\n';
+    return n;
+}
+
+double wallSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sleepSeconds(double seconds) {
+    if (seconds <= 0) return;
+#ifdef _WIN32
+    Sleep((DWORD)(seconds * 1000));
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// Arrival process state: produces the simulated time of the next vehicle.
+typedef struct {
+    double time;            // simulated seconds since start
+    bool bursting;          // MMPP state
+    double stateEnds;       // MMPP: when the current state ends
+} ArrivalProcess;
+
+double rushHourMultiplier(const GeneratorConfig* config, double t) {
+    double hours = config->startHour + t * config->timeScale / 3600.0;
+    double h = fmod(hours, 24.0);
+    int i = (int)h;
+    double frac = h - i;
+    // interpolate between hourly values so the rate has no steps
+    return rushHourProfile[i] * (1 - frac) + rushHourProfile[(i + 1) % 24] * frac;
+}
+
+double nextArrival(const GeneratorConfig* config, ArrivalProcess* p, double rate) {
+    switch (config->model) {
+        case ARRIVAL_POISSON:
+            p->time += randomExponential(rate);
+            break;
+        case ARRIVAL_MMPP:
+            // Exact simulation: both the arrival and the state change are
+            // memoryless, so race them and restart on a state change.
+            while (1) {
+                double stateRate = p->bursting ? rate * config->burstFactor : rate;
+                double next = p->time + randomExponential(stateRate);
+                if (next < p->stateEnds) {
+                    p->time = next;
+                    break;
+                }
+                p->time = p->stateEnds;
+                p->bursting = !p->bursting;
+                p->stateEnds = p->time + randomExponential(
+                    1.0 / (p->bursting ? config->burstSeconds : config->calmSeconds));
+            }
+            break;
+        case ARRIVAL_RUSH_HOUR: {
+            // Thinning (Lewis-Shedler) against the profile's peak rate
+            double peak = 0;
+            for (int i = 0; i < 24; i++)
+                if (rushHourProfile[i] > peak) peak = rushHourProfile[i];
+            do {
+                p->time += randomExponential(rate * peak);
+            } while (randomUnit() * peak > rushHourMultiplier(config, p->time));
+            break;
+        }
+    }
+    return p->time;
+}
+
+// Parses "A2=0.4" style per-lane rates.
+bool parseLaneRate(GeneratorConfig* config, const char* spec) {
+    char road;
+    int lane;
+    double rate;
+    if (sscanf(spec, "%c%d=%lf", &road, &lane, &rate) != 3) return false;
+    if (road < 'A' || road > 'D' || lane < 2 || lane > 3 || rate < 0) return false;
+    config->laneRate[road - 'A'][lane - 2] = rate;
+    return true;
+}
+
+void printUsage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --output <file>         output file (default %s, appended)\n", FILENAME);
+    printf("  --shm <name>            write into the shared-memory ring of simulator --shm <name>\n");
+    printf("  --socket <path>         send to a simulator started with --listen <path>\n");
+    printf("  --format <f>            plain | timed | binary (timed/binary are --merge feeds)\n");
+    printf("  --seed <n>              seed for a reproducible stream (default: time)\n");
+    printf("  --model <m>             poisson | mmpp | rush (default poisson)\n");
+    printf("  --rate <veh/s>          total arrival rate, lanes keep their ratios (default 1)\n");
+    printf("  --lane-rate <R><L>=<r>  rate of one lane, e.g. A2=0.5 or C3=0.1 (repeatable)\n");
+    printf("  --burst-factor <x>      mmpp: rate multiplier during bursts (default 5)\n");
+    printf("  --calm <s> --burst <s>  mmpp: mean calm / burst durations (default 20 / 5)\n");
+    printf("  --start-hour <h>        rush: time of day at start (default 6)\n");
+    printf("  --time-scale <x>        rush: simulated seconds per second (default 1)\n");
+    printf("  --count <n>             stop after n vehicles\n");
+    printf("  --duration <s>          stop after s simulated seconds\n");
+    printf("  --fast                  write as fast as possible instead of in real time\n");
+    printf("  --quiet                 do not echo generated vehicles\n");
+}
+
+// Stream to a simulator's --listen socket; records are written exactly as
+// they would be to vehicles.data.
+FILE* connectSocket(const char* path) {
+#ifdef _WIN32
+    (void)path;
+    return NULL;
+#else
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return NULL;
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    return fdopen(fd, "w");
+#endif
 }
 
-// Function to get main lane for L3 vehicles
-char getMainLaneForL3() {
-    static char mainLanes[] = "ABCD";
-    return mainLanes[rand() % 4];
+bool parseArguments(int argc, char* argv[], GeneratorConfig* config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--fast") == 0) config->realtime = false;
+        else if (strcmp(arg, "--quiet") == 0) config->quiet = true;
+        else if (!value) return false;
+        else {
+            i++;
+            if (strcmp(arg, "--output") == 0) config->outputPath = value;
+            else if (strcmp(arg, "--shm") == 0) config->shmName = value;
+            else if (strcmp(arg, "--socket") == 0) config->socketPath = value;
+            else if (strcmp(arg, "--seed") == 0) config->seed = strtoull(value, NULL, 10);
+            else if (strcmp(arg, "--rate") == 0) config->totalRate = atof(value);
+            else if (strcmp(arg, "--count") == 0) config->count = atoll(value);
+            else if (strcmp(arg, "--duration") == 0) config->duration = atof(value);
+            else if (strcmp(arg, "--burst-factor") == 0) config->burstFactor = atof(value);
+            else if (strcmp(arg, "--calm") == 0) config->calmSeconds = atof(value);
+            else if (strcmp(arg, "--burst") == 0) config->burstSeconds = atof(value);
+            else if (strcmp(arg, "--start-hour") == 0) config->startHour = atof(value);
+            else if (strcmp(arg, "--time-scale") == 0) config->timeScale = atof(value);
+            else if (strcmp(arg, "--lane-rate") == 0) {
+                if (!parseLaneRate(config, value)) return false;
+            } else if (strcmp(arg, "--format") == 0) {
+                if (strcmp(value, "plain") == 0) config->format = FORMAT_PLAIN;
+                else if (strcmp(value, "timed") == 0) config->format = FORMAT_TIMED;
+                else if (strcmp(value, "binary") == 0) config->format = FORMAT_BINARY;
+                else return false;
+            } else if (strcmp(arg, "--model") == 0) {
+                if (strcmp(value, "poisson") == 0) config->model = ARRIVAL_POISSON;
+                else if (strcmp(value, "mmpp") == 0) config->model = ARRIVAL_MMPP;
+                else if (strcmp(value, "rush") == 0) config->model = ARRIVAL_RUSH_HOUR;
+                else return false;
+            } else return false;
+        }
+    }
+    if (config->socketPath && config->format != FORMAT_PLAIN) {
+        // The simulator's socket reader only parses PLATE:R lines.
+        fprintf(stderr, "--socket only sends the plain format\n");
+        return false;
+    }
+    return config->burstFactor > 0 && config->calmSeconds > 0 && config->burstSeconds > 0 &&
+           config->timeScale > 0;
 }
 
-int main() {
-    FILE* file = fopen(FILENAME, "a");
-    if (!file) {
-        perror("Error opening file");
+int main(int argc, char* argv[]) {
+    GeneratorConfig config = {
+        .outputPath = FILENAME,
+        .seed = (uint64_t)time(NULL),
+        .model = ARRIVAL_POISSON,
+        // Same mix as before: each road gets 1/5 of the straight traffic,
+        // and 1/5 of all vehicles are L3 spread over the four roads.
+        .laneRate = { {0.2, 0.05}, {0.2, 0.05}, {0.2, 0.05}, {0.2, 0.05} },
+        .realtime = true,
+        .burstFactor = 5.0,
+        .calmSeconds = 20.0,
+        .burstSeconds = 5.0,
+        .startHour = 6.0,
+        .timeScale = 1.0,
+    };
+    if (!parseArguments(argc, argv, &config)) {
+        printUsage(argv[0]);
         return 1;
     }
 
-    srand(time(NULL)); // Initialize random seed
+    double totalRate = 0;
+    for (int r = 0; r < NUM_ROADS; r++)
+        totalRate += config.laneRate[r][0] + config.laneRate[r][1];
+    if (totalRate <= 0) {
+        fprintf(stderr, "All lane rates are zero\n");
+        return 1;
+    }
+    if (config.totalRate > 0) {
+        for (int r = 0; r < NUM_ROADS; r++)
+            for (int l = 0; l < 2; l++)
+                config.laneRate[r][l] *= config.totalRate / totalRate;
+        totalRate = config.totalRate;
+    }
 
-    while (1) {
-        char vehicle[9];
+    FILE* file = NULL;
+#ifdef __linux__
+    VehicleRing* ring = NULL;
+    if (config.shmName) {
+        ring = vehicleRingAttach(config.shmName, VEHICLE_RING_PRODUCER);
+        if (!ring) {
+            perror("Error attaching vehicle ring");
+            return 1;
+        }
+    } else
+#else
+    if (config.shmName) {
+        fprintf(stderr, "--shm is only supported on Linux\n");
+        return 1;
+    }
+#endif
+    if (config.socketPath) {
+        file = connectSocket(config.socketPath);
+        if (!file) {
+            perror("Error connecting to simulator");
+            return 1;
+        }
+        setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    } else {
+        file = fopen(config.outputPath, config.format == FORMAT_BINARY ? "ab" : "a");
+        if (!file) {
+            perror("Error opening file");
+            return 1;
+        }
+        // One large buffer instead of a flush per line; in real-time mode we
+        // flush whenever we are about to wait for the next arrival.
+        setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+        fseek(file, 0, SEEK_END);
+        if (config.format == FORMAT_BINARY && ftell(file) == 0)
+            fwrite(VEHICLE_FEED_MAGIC, 1, 8, file);
+    }
+
+    seedRandom(config.seed); // reproducible stream for a given seed
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+#ifdef SIGPIPE
+    signal(SIGPIPE, SIG_IGN); // a closed simulator socket shows up as a write error
+#endif
+    fprintf(stderr, "Generating with seed %llu\n", (unsigned long long)config.seed);
+
+    ArrivalProcess process = { 0.0, false, 0.0 };
+    process.stateEnds = randomExponential(1.0 / config.calmSeconds);
+    double startWall = wallSeconds();
+    long long generated = 0;
+    char record[MAX_RECORD_LENGTH];
+    char vehicle[9];
+
+    while (!stopRequested && (config.count == 0 || generated < config.count)) {
+        double t = nextArrival(&config, &process, totalRate);
+        if (config.duration > 0 && t > config.duration) break;
+
+        if (config.realtime) {
+            double wait = t - (wallSeconds() - startWall);
+            if (wait > 0) {
+                if (file) fflush(file); // Make everything so far visible before sleeping
+                sleepSeconds(wait);
+            }
+        }
+
+        int road, laneNumber;
         generateVehicleNumber(vehicle);
-        char* lane = generateLane();
-
-        // Write to file
-        if (strcmp(lane, "L3") == 0) {
-            char mainLane = getMainLaneForL3();
-            fprintf(file, "%sL3:%c\n", vehicle, mainLane);
-            printf("Generated: %sL3:%c\n", vehicle, mainLane);
-        } else {
-            fprintf(file, "%s:%s\n", vehicle, lane);
-            printf("Generated: %s:%s\n", vehicle, lane);
+        generateLane(&config, totalRate, &road, &laneNumber);
+        int prefix = 0;
+        if (config.format == FORMAT_TIMED)
+            prefix = sprintf(record, "%llu,", (unsigned long long)(t * 1000.0));
+        int length = prefix + formatRecord(record + prefix, vehicle, road, laneNumber);
+        VehicleRecord binary;
+        if (config.format == FORMAT_BINARY) {
+            memset(&binary, 0, sizeof(binary));
+            memcpy(binary.plate, vehicle, 8);
+            binary.road = 'A' + road;
+            binary.laneNumber = laneNumber;
+            binary.timestampUs = (uint64_t)(t * 1000000.0);
         }
-        fflush(file); // Ensure data is written immediately
+#ifdef __linux__
+        if (ring) {
+            // Fill the slot in place; a full ring means the simulator is behind.
+            VehicleRecord* slot;
+            while (!(slot = vehicleRingBeginWrite(ring)) && !stopRequested)
+                vehicleRingWaitForSpace(ring, 100);
+            if (!slot) break;
+            memset(slot, 0, sizeof(*slot));
+            memcpy(slot->plate, vehicle, 8);
+            slot->road = 'A' + road;
+            slot->laneNumber = laneNumber;
+            slot->timestampUs = vehicleRingNowUs();
+            vehicleRingCommit(ring);
+        } else
+#endif
+        if (config.format == FORMAT_BINARY ? fwrite(&binary, sizeof(binary), 1, file) != 1
+                                           : fwrite(record, 1, length, file) != (size_t)length) {
+            perror("Error writing vehicle");
+            break;
+        }
+        generated++;
 
-        sleep(1); // Wait 1 second before generating next entry
+        if (config.realtime && !config.quiet)
+            printf("Generated: %.*s\n", length - 1, record);
     }
 
-    fclose(file);
+    if (file) fclose(file);
+#ifdef __linux__
+    if (ring) vehicleRingDetach(ring, VEHICLE_RING_PRODUCER);
+#endif
+    double elapsed = wallSeconds() - startWall;
+    fprintf(stderr, "Generated %lld vehicles in %.3f s (%.0f vehicles/s)\n",
+            generated, elapsed, elapsed > 0 ? generated / elapsed : 0.0);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,198 @@
+/*Shared-memory ring buffer used by traffic_generator and the simulator to pass
+vehicles without going through vehicles.data. Single producer, single consumer,
+fixed-size records that the consumer reads in place. Linux only (POSIX shm +
+futex wakeups).*/
+
+#ifndef VEHICLE_RING_H
+#define VEHICLE_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define VEHICLE_RING_MAGIC 0x564E5247u      // "VRNG"
+#define VEHICLE_RING_CAPACITY 4096          // records, power of two
+#define VEHICLE_RECORD_EMERGENCY 0x01
+#define VEHICLE_PLATE_LENGTH 15
+
+// Sides of the ring, indexing VehicleRing::pids.
+#define VEHICLE_RING_PRODUCER 0
+#define VEHICLE_RING_CONSUMER 1
+
+// One vehicle, 32 bytes.
+typedef struct {
+    uint64_t timestampUs;                   // CLOCK_MONOTONIC when produced
+    char plate[VEHICLE_PLATE_LENGTH];       // NUL padded
+    char road;                              // A/B/C/D
+    uint8_t laneNumber;                     // 1..3
+    uint8_t flags;                          // VEHICLE_RECORD_*
+    uint8_t reserved[6];
+} VehicleRecord;
+
+_Static_assert(sizeof(VehicleRecord) == 32, "VehicleRecord must stay 32 bytes");
+
+// Binary feed files (traffic_generator --format binary) are this magic
+// followed by VehicleRecords whose timestampUs counts from the start.
+#define VEHICLE_FEED_MAGIC "VRFEED01"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity;
+    _Alignas(64) atomic_uint_fast64_t head; // next slot the producer writes
+    _Alignas(64) atomic_uint_fast64_t tail; // next slot the consumer reads
+    _Alignas(64) atomic_uint dataSeq;       // futex word, bumped after every commit
+    atomic_uint consumerWaiting;
+    _Alignas(64) atomic_uint spaceSeq;      // futex word, bumped after a release when the producer waits
+    atomic_uint producerWaiting;
+    _Alignas(64) VehicleRecord records[VEHICLE_RING_CAPACITY];
+    // After the records so the layout above is unchanged.
+    _Alignas(64) atomic_int pids[2];        // attached process per side, 0 = none
+    atomic_uint resets;                     // times attach found the ring stale
+} VehicleRing;
+
+static inline uint64_t vehicleRingNowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void vehicleRingFutexWait(atomic_uint* word, unsigned value, int timeoutMs) {
+    struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+    syscall(SYS_futex, (unsigned*)word, FUTEX_WAIT, value, timeoutMs >= 0 ? &timeout : NULL, NULL, 0);
+}
+
+static inline void vehicleRingFutexWake(atomic_uint* word) {
+    syscall(SYS_futex, (unsigned*)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline bool vehicleRingAlive(int pid) {
+    return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// A side that died without detaching leaves its pid behind. If nobody is
+// left attached, head and tail belong to that old session: a new producer
+// would find the ring full, a new consumer would read old records. Start
+// over from empty.
+static inline void vehicleRingResetIfStale(VehicleRing* ring) {
+    int producer = atomic_load(&ring->pids[VEHICLE_RING_PRODUCER]);
+    int consumer = atomic_load(&ring->pids[VEHICLE_RING_CONSUMER]);
+    bool stale = (producer != 0 && !vehicleRingAlive(producer)) ||
+                 (consumer != 0 && !vehicleRingAlive(consumer));
+    if (!stale || vehicleRingAlive(producer) || vehicleRingAlive(consumer)) return;
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->dataSeq, 0);
+    atomic_store(&ring->consumerWaiting, 0);
+    atomic_store(&ring->spaceSeq, 0);
+    atomic_store(&ring->producerWaiting, 0);
+    atomic_store(&ring->pids[VEHICLE_RING_PRODUCER], 0);
+    atomic_store(&ring->pids[VEHICLE_RING_CONSUMER], 0);
+    atomic_fetch_add(&ring->resets, 1);
+}
+
+// Maps the ring called name (e.g. "/traffic") as side (VEHICLE_RING_*),
+// creating it if neither side has yet. Returns NULL on failure, or when a
+// live process already holds that side.
+static inline VehicleRing* vehicleRingAttach(const char* name, int side) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, sizeof(VehicleRing)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    void* memory = mmap(NULL, sizeof(VehicleRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) return NULL;
+    VehicleRing* ring = (VehicleRing*)memory;
+    // A fresh mapping is zero filled; the first side to get here stamps it.
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&ring->magic, &expected, VEHICLE_RING_MAGIC, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+        expected == VEHICLE_RING_MAGIC) {
+        ring->capacity = VEHICLE_RING_CAPACITY;
+        vehicleRingResetIfStale(ring);
+        int holder = atomic_load(&ring->pids[side]);
+        if ((holder == 0 || !vehicleRingAlive(holder)) &&
+            atomic_compare_exchange_strong(&ring->pids[side], &holder, (int)getpid()))
+            return ring;
+        errno = EBUSY;
+    }
+    munmap(memory, sizeof(VehicleRing));
+    return NULL;
+}
+
+static inline void vehicleRingDetach(VehicleRing* ring, int side) {
+    atomic_store(&ring->pids[side], 0);
+    munmap(ring, sizeof(VehicleRing));
+}
+
+// Producer: slot to fill in place, or NULL when the ring is full.
+static inline VehicleRecord* vehicleRingBeginWrite(VehicleRing* ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= VEHICLE_RING_CAPACITY) return NULL;
+    return &ring->records[head & (VEHICLE_RING_CAPACITY - 1)];
+}
+
+// Producer: publishes the slot returned by vehicleRingBeginWrite().
+static inline void vehicleRingCommit(VehicleRing* ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    atomic_fetch_add(&ring->dataSeq, 1);
+    if (atomic_load(&ring->consumerWaiting))
+        vehicleRingFutexWake(&ring->dataSeq);
+}
+
+// Producer: blocks until there is room (or timeoutMs passes).
+static inline void vehicleRingWaitForSpace(VehicleRing* ring, int timeoutMs) {
+    unsigned seq = atomic_load(&ring->spaceSeq);
+    atomic_store(&ring->producerWaiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!vehicleRingBeginWrite(ring))
+        vehicleRingFutexWait(&ring->spaceSeq, seq, timeoutMs);
+    atomic_store(&ring->producerWaiting, 0);
+}
+
+// Consumer: oldest unread record, read in place, or NULL when empty.
+static inline const VehicleRecord* vehicleRingPeek(VehicleRing* ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) return NULL;
+    return &ring->records[tail & (VEHICLE_RING_CAPACITY - 1)];
+}
+
+// Consumer: hands the peeked slot back to the producer.
+static inline void vehicleRingRelease(VehicleRing* ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ring->producerWaiting)) {
+        atomic_fetch_add(&ring->spaceSeq, 1);
+        vehicleRingFutexWake(&ring->spaceSeq);
+    }
+}
+
+// Consumer: blocks until a record is available (or timeoutMs passes).
+static inline void vehicleRingWaitForData(VehicleRing* ring, int timeoutMs) {
+    unsigned seq = atomic_load(&ring->dataSeq);
+    atomic_store(&ring->consumerWaiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!vehicleRingPeek(ring))
+        vehicleRingFutexWait(&ring->dataSeq, seq, timeoutMs);
+    atomic_store(&ring->consumerWaiting, 0);
+}
+#endif // __linux__
+
+#endif // VEHICLE_RING_H